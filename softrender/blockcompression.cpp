@@ -0,0 +1,513 @@
+#include "blockcompression.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+	inline int channel(uint32_t texel, int c)
+	{
+		return texel >> (c * 8) & 0xff;
+	}
+
+	inline uint32_t pack(int r, int g, int b, int a)
+	{
+		return uint32_t(r) | uint32_t(g) << 8 | uint32_t(b) << 16 | uint32_t(a) << 24;
+	}
+
+	// replicates the high bits of a bits wide value into the low bits of 8
+	inline int expand(int v, int bits)
+	{
+		v <<= 8 - bits;
+		return v | v >> bits;
+	}
+
+	inline int squared_error(const int* a, const int* b, int n)
+	{
+		int e = 0;
+		for (int c = 0; c < n; c++)
+			e += (a[c] - b[c]) * (a[c] - b[c]);
+		return e;
+	}
+
+	// endpoints of the line through the first N channels of count points along their principal axis,
+	// found by power iteration on the covariance matrix
+	template<int N>
+	void fit_line(const float (*points)[4], int count, float* e0, float* e1)
+	{
+		float mean[N] = {}, lo[N], hi[N];
+		std::fill(lo, lo + N, 255.0f);
+		std::fill(hi, hi + N, 0.0f);
+		for (int i = 0; i < count; i++)
+			for (int c = 0; c < N; c++)
+			{
+				mean[c] += points[i][c];
+				lo[c] = std::min(lo[c], points[i][c]);
+				hi[c] = std::max(hi[c], points[i][c]);
+			}
+		for (int c = 0; c < N; c++)
+			mean[c] /= float(count);
+
+		float cov[N][N] = {};
+		for (int i = 0; i < count; i++)
+			for (int a = 0; a < N; a++)
+				for (int b = 0; b < N; b++)
+					cov[a][b] += (points[i][a] - mean[a]) * (points[i][b] - mean[b]);
+
+		float axis[N];
+		for (int c = 0; c < N; c++)
+			axis[c] = hi[c] - lo[c];
+		for (int iter = 0; iter < 8; iter++)
+		{
+			float next[N] = {};
+			float norm = 0.0f;
+			for (int a = 0; a < N; a++)
+			{
+				for (int b = 0; b < N; b++)
+					next[a] += cov[a][b] * axis[b];
+				norm = std::max(norm, std::abs(next[a]));
+			}
+			if (norm <= 0.0f)
+				break;
+			for (int c = 0; c < N; c++)
+				axis[c] = next[c] / norm;
+		}
+
+		float length = 0.0f;
+		for (int c = 0; c < N; c++)
+			length += axis[c] * axis[c];
+		if (length <= 0.0f)
+		{
+			std::copy(mean, mean + N, e0);
+			std::copy(mean, mean + N, e1);
+			return;
+		}
+		for (int c = 0; c < N; c++)
+			axis[c] /= std::sqrt(length);
+
+		float t_min = 0.0f, t_max = 0.0f;
+		for (int i = 0; i < count; i++)
+		{
+			float t = 0.0f;
+			for (int c = 0; c < N; c++)
+				t += (points[i][c] - mean[c]) * axis[c];
+			t_min = std::min(t_min, t);
+			t_max = std::max(t_max, t);
+		}
+		for (int c = 0; c < N; c++)
+		{
+			e0[c] = std::clamp(mean[c] + axis[c] * t_min, 0.0f, 255.0f);
+			e1[c] = std::clamp(mean[c] + axis[c] * t_max, 0.0f, 255.0f);
+		}
+	}
+
+	// BC1 color block
+
+	inline uint16_t to_565(const float* rgb)
+	{
+		int r = int(rgb[0] * 31.0f / 255.0f + 0.5f);
+		int g = int(rgb[1] * 63.0f / 255.0f + 0.5f);
+		int b = int(rgb[2] * 31.0f / 255.0f + 0.5f);
+		return uint16_t(r << 11 | g << 5 | b);
+	}
+
+	inline void from_565(uint16_t c, int* rgb)
+	{
+		rgb[0] = expand(c >> 11 & 31, 5);
+		rgb[1] = expand(c >> 5 & 63, 6);
+		rgb[2] = expand(c & 31, 5);
+	}
+
+	// 4 colors when c0 > c1 or four_colors is set, else 3 colors and transparent black
+	void color_palette(uint16_t c0, uint16_t c1, bool four_colors, int (*palette)[4])
+	{
+		from_565(c0, palette[0]);
+		from_565(c1, palette[1]);
+		for (int c = 0; c < 3; c++)
+		{
+			if (four_colors)
+			{
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+			else
+			{
+				palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+				palette[3][c] = 0;
+			}
+		}
+		palette[0][3] = palette[1][3] = palette[2][3] = 255;
+		palette[3][3] = four_colors ? 255 : 0;
+	}
+
+	void encode_color_block(const uint32_t* texels, unsigned char* block, bool allow_transparent)
+	{
+		float points[bc::BLOCK_TEXELS][4];
+		int count = 0;
+		bool transparent = false;
+		for (int i = 0; i < bc::BLOCK_TEXELS; i++)
+		{
+			if (allow_transparent && channel(texels[i], 3) < 128)
+			{
+				transparent = true;
+				continue;
+			}
+			for (int c = 0; c < 3; c++)
+				points[count][c] = float(channel(texels[i], c));
+			count++;
+		}
+
+		uint16_t c0 = 0, c1 = 0;
+		if (count > 0)
+		{
+			float e0[3], e1[3];
+			fit_line<3>(points, count, e0, e1);
+			c0 = to_565(e1);
+			c1 = to_565(e0);
+		}
+		// the endpoint order selects the mode
+		if (transparent ? c0 > c1 : c0 < c1)
+			std::swap(c0, c1);
+		bool four_colors = !transparent;
+
+		int palette[4][4];
+		color_palette(c0, c1, four_colors, palette);
+
+		uint32_t indices = 0;
+		for (int i = 0; i < bc::BLOCK_TEXELS; i++)
+		{
+			int best = 3;
+			if (!transparent || channel(texels[i], 3) >= 128)
+			{
+				int rgb[3] = { channel(texels[i], 0), channel(texels[i], 1), channel(texels[i], 2) };
+				int best_error = INT32_MAX;
+				for (int k = 0; k < (four_colors ? 4 : 3); k++)
+				{
+					int error = squared_error(rgb, palette[k], 3);
+					if (error < best_error)
+					{
+						best = k;
+						best_error = error;
+					}
+				}
+			}
+			indices |= uint32_t(best) << (i * 2);
+		}
+
+		block[0] = c0 & 0xff;
+		block[1] = c0 >> 8;
+		block[2] = c1 & 0xff;
+		block[3] = c1 >> 8;
+		std::memcpy(block + 4, &indices, 4);
+	}
+
+	void decode_color_block(const unsigned char* block, uint32_t* texels, bool force_four_colors)
+	{
+		uint16_t c0 = uint16_t(block[0] | block[1] << 8);
+		uint16_t c1 = uint16_t(block[2] | block[3] << 8);
+		uint32_t indices;
+		std::memcpy(&indices, block + 4, 4);
+
+		int palette[4][4];
+		color_palette(c0, c1, force_four_colors || c0 > c1, palette);
+		for (int i = 0; i < bc::BLOCK_TEXELS; i++)
+		{
+			auto& p = palette[indices >> (i * 2) & 3];
+			texels[i] = pack(p[0], p[1], p[2], p[3]);
+		}
+	}
+
+	// BC3 alpha block
+
+	// 8 values when a0 > a1, else 6 values and 0 and 255
+	void alpha_palette(int a0, int a1, int* palette)
+	{
+		palette[0] = a0;
+		palette[1] = a1;
+		if (a0 > a1)
+		{
+			for (int i = 2; i < 8; i++)
+				palette[i] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+		}
+		else
+		{
+			for (int i = 2; i < 6; i++)
+				palette[i] = ((6 - i) * a0 + (i - 1) * a1) / 5;
+			palette[6] = 0;
+			palette[7] = 255;
+		}
+	}
+
+	void encode_alpha_block(const uint32_t* texels, unsigned char* block)
+	{
+		int a0 = 0, a1 = 255;
+		for (int i = 0; i < bc::BLOCK_TEXELS; i++)
+		{
+			a0 = std::max(a0, channel(texels[i], 3));
+			a1 = std::min(a1, channel(texels[i], 3));
+		}
+
+		int palette[8];
+		alpha_palette(a0, a1, palette);
+
+		uint64_t indices = 0;
+		for (int i = 0; i < bc::BLOCK_TEXELS; i++)
+		{
+			int a = channel(texels[i], 3);
+			int best = 0;
+			for (int k = 1; k < 8; k++)
+				if (std::abs(palette[k] - a) < std::abs(palette[best] - a))
+					best = k;
+			indices |= uint64_t(best) << (i * 3);
+		}
+
+		block[0] = (unsigned char)a0;
+		block[1] = (unsigned char)a1;
+		for (int i = 0; i < 6; i++)
+			block[2 + i] = (unsigned char)(indices >> (i * 8));
+	}
+
+	void decode_alpha_block(const unsigned char* block, uint32_t* texels)
+	{
+		int palette[8];
+		alpha_palette(block[0], block[1], palette);
+		uint64_t indices = 0;
+		for (int i = 0; i < 6; i++)
+			indices |= uint64_t(block[2 + i]) << (i * 8);
+		for (int i = 0; i < bc::BLOCK_TEXELS; i++)
+			texels[i] = (texels[i] & 0x00ffffffu) | uint32_t(palette[indices >> (i * 3) & 7]) << 24;
+	}
+
+	// BC7
+
+	constexpr int WEIGHTS2[] = { 0, 21, 43, 64 };
+	constexpr int WEIGHTS3[] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+	constexpr int WEIGHTS4[] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	inline const int* bc7_weights(int index_bits)
+	{
+		return index_bits == 2 ? WEIGHTS2 : index_bits == 3 ? WEIGHTS3 : WEIGHTS4;
+	}
+
+	inline int bc7_interpolate(int e0, int e1, int w)
+	{
+		return ((64 - w) * e0 + w * e1 + 32) >> 6;
+	}
+
+	// fields are packed from the lowest bit of the first byte up, the block is read as two 64 bit halves
+	struct BitReader
+	{
+		uint64_t lo, hi;
+		int pos;
+
+		BitReader(const unsigned char* data, int pos) : pos(pos)
+		{
+			std::memcpy(&lo, data, 8);
+			std::memcpy(&hi, data + 8, 8);
+		}
+
+		int read(int n)
+		{
+			uint64_t v;
+			if (pos >= 64)
+				v = hi >> (pos - 64);
+			else if (pos + n > 64)
+				v = lo >> pos | hi << (64 - pos);
+			else
+				v = lo >> pos;
+			pos += n;
+			return int(v & ((1u << n) - 1));
+		}
+	};
+
+	struct BitWriter
+	{
+		unsigned char* data;
+		int pos = 0;
+
+		void write(int v, int n)
+		{
+			for (int i = 0; i < n; i++, pos++)
+				data[pos >> 3] |= (v >> i & 1) << (pos & 7);
+		}
+	};
+
+	// the index of texel 0 is stored without its high bit, which the encoder keeps at 0
+	void read_indices(BitReader& bits, int index_bits, int* indices)
+	{
+		for (int i = 0; i < bc::BLOCK_TEXELS; i++)
+			indices[i] = bits.read(i == 0 ? index_bits - 1 : index_bits);
+	}
+}
+
+namespace bc
+{
+	void encode_bc1(const uint32_t* texels, unsigned char* block)
+	{
+		encode_color_block(texels, block, true);
+	}
+
+	void decode_bc1(const unsigned char* block, uint32_t* texels)
+	{
+		decode_color_block(block, texels, false);
+	}
+
+	void encode_bc3(const uint32_t* texels, unsigned char* block)
+	{
+		encode_alpha_block(texels, block);
+		encode_color_block(texels, block + 8, false);
+	}
+
+	void decode_bc3(const unsigned char* block, uint32_t* texels)
+	{
+		decode_color_block(block + 8, texels, true);
+		decode_alpha_block(block, texels);
+	}
+
+	void encode_bc7(const uint32_t* texels, unsigned char* block)
+	{
+		float points[BLOCK_TEXELS][4];
+		for (int i = 0; i < BLOCK_TEXELS; i++)
+			for (int c = 0; c < 4; c++)
+				points[i][c] = float(channel(texels[i], c));
+		float ef[2][4];
+		fit_line<4>(points, BLOCK_TEXELS, ef[0], ef[1]);
+
+		// 7 bits per channel and a p-bit shared by the channels of each endpoint
+		int e[2][4];
+		for (int k = 0; k < 2; k++)
+		{
+			int best_error = INT32_MAX;
+			for (int p = 0; p < 2; p++)
+			{
+				int q[4], error = 0;
+				for (int c = 0; c < 4; c++)
+				{
+					q[c] = std::clamp(int((ef[k][c] - p) * 0.5f + 0.5f), 0, 127) << 1 | p;
+					error += int((q[c] - ef[k][c]) * (q[c] - ef[k][c]));
+				}
+				if (error < best_error)
+				{
+					best_error = error;
+					std::copy(q, q + 4, e[k]);
+				}
+			}
+		}
+
+		int palette[16][4];
+		for (int i = 0; i < 16; i++)
+			for (int c = 0; c < 4; c++)
+				palette[i][c] = bc7_interpolate(e[0][c], e[1][c], WEIGHTS4[i]);
+
+		int indices[BLOCK_TEXELS];
+		for (int i = 0; i < BLOCK_TEXELS; i++)
+		{
+			int rgba[4] = { channel(texels[i], 0), channel(texels[i], 1), channel(texels[i], 2), channel(texels[i], 3) };
+			int best = 0, best_error = INT32_MAX;
+			for (int k = 0; k < 16; k++)
+			{
+				int error = squared_error(rgba, palette[k], 4);
+				if (error < best_error)
+				{
+					best = k;
+					best_error = error;
+				}
+			}
+			indices[i] = best;
+		}
+		if (indices[0] & 8)
+		{
+			std::swap(e[0], e[1]);
+			for (int& index : indices)
+				index = 15 - index;
+		}
+
+		std::memset(block, 0, BC7_BLOCK_BYTES);
+		BitWriter bits{ block };
+		bits.write(1 << 6, 7);
+		for (int c = 0; c < 4; c++)
+			for (int k = 0; k < 2; k++)
+				bits.write(e[k][c] >> 1, 7);
+		for (int k = 0; k < 2; k++)
+			bits.write(e[k][0] & 1, 1);
+		for (int i = 0; i < BLOCK_TEXELS; i++)
+			bits.write(indices[i], i == 0 ? 3 : 4);
+	}
+
+	void decode_bc7(const unsigned char* block, uint32_t* texels)
+	{
+		int mode = 0;
+		while (mode < 8 && !(block[0] >> mode & 1))
+			mode++;
+		if (mode < 4 || mode > 6)
+		{
+			std::fill(texels, texels + BLOCK_TEXELS, 0u);
+			return;
+		}
+
+		BitReader bits(block, mode + 1);
+		int rotation = 0, index_mode = 0;
+		int color_bits = 7, alpha_bits = 7;
+		if (mode == 4)
+		{
+			rotation = bits.read(2);
+			index_mode = bits.read(1);
+			color_bits = 5;
+			alpha_bits = 6;
+		}
+		else if (mode == 5)
+		{
+			rotation = bits.read(2);
+			alpha_bits = 8;
+		}
+
+		int e[2][4];
+		for (int c = 0; c < 4; c++)
+			for (int k = 0; k < 2; k++)
+				e[k][c] = bits.read(c < 3 ? color_bits : alpha_bits);
+		if (mode == 6)
+		{
+			for (int k = 0; k < 2; k++)
+			{
+				int p = bits.read(1);
+				for (int c = 0; c < 4; c++)
+					e[k][c] = e[k][c] << 1 | p;
+			}
+		}
+		else
+		{
+			for (int k = 0; k < 2; k++)
+				for (int c = 0; c < 4; c++)
+					e[k][c] = expand(e[k][c], c < 3 ? color_bits : alpha_bits);
+		}
+
+		// mode 6 has one index set, 4 and 5 a second one for alpha, swapped with the color set by index_mode
+		int primary[BLOCK_TEXELS], secondary[BLOCK_TEXELS];
+		int primary_bits = mode == 6 ? 4 : 2;
+		int secondary_bits = mode == 4 ? 3 : 2;
+		read_indices(bits, primary_bits, primary);
+		if (mode != 6)
+			read_indices(bits, secondary_bits, secondary);
+
+		const int* color_indices = primary;
+		const int* alpha_indices = mode == 6 ? primary : secondary;
+		const int* color_weights = bc7_weights(primary_bits);
+		const int* alpha_weights = bc7_weights(mode == 6 ? primary_bits : secondary_bits);
+		if (index_mode)
+		{
+			std::swap(color_indices, alpha_indices);
+			std::swap(color_weights, alpha_weights);
+		}
+
+		for (int i = 0; i < BLOCK_TEXELS; i++)
+		{
+			int rgba[4];
+			for (int c = 0; c < 3; c++)
+				rgba[c] = bc7_interpolate(e[0][c], e[1][c], color_weights[color_indices[i]]);
+			rgba[3] = bc7_interpolate(e[0][3], e[1][3], alpha_weights[alpha_indices[i]]);
+			if (rotation)
+				std::swap(rgba[3], rgba[rotation - 1]);
+			texels[i] = pack(rgba[0], rgba[1], rgba[2], rgba[3]);
+		}
+	}
+}
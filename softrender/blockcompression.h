@@ -0,0 +1,36 @@
+#ifndef BLOCK_COMPRESSION_H
+#define BLOCK_COMPRESSION_H
+
+#include <cstdint>
+
+// encoders and decoders of the BCn block formats. a block covers 4x4 texels, texels are RGBA8 packed
+// into uint32_t with red in the lowest byte, row-major inside the block.
+// the encoders fit endpoints along the principal axis of the block's colors and pick the nearest palette
+// entry for every texel, a fast single pass fit rather than an exhaustive search
+namespace bc
+{
+	constexpr int BLOCK_TEXELS = 16;
+
+	constexpr int BC1_BLOCK_BYTES = 8;
+	constexpr int BC3_BLOCK_BYTES = 16;
+	constexpr int BC7_BLOCK_BYTES = 16;
+
+	// RGB with 1 bit alpha, texels with alpha below 128 become transparent black
+	void encode_bc1(const uint32_t* texels, unsigned char* block);
+
+	void decode_bc1(const unsigned char* block, uint32_t* texels);
+
+	// BC1 colors with 8 interpolated alpha values
+	void encode_bc3(const uint32_t* texels, unsigned char* block);
+
+	void decode_bc3(const unsigned char* block, uint32_t* texels);
+
+	// encodes mode 6, one subset of RGBA endpoints with 4 bit indices
+	void encode_bc7(const uint32_t* texels, unsigned char* block);
+
+	// decodes the single subset modes 4, 5 and 6, blocks in the partitioned modes 0-3 and 7 decode to
+	// transparent black like reserved modes do
+	void decode_bc7(const unsigned char* block, uint32_t* texels);
+}
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "maths.h"
+#include "simd.h"
+
+// approximations of the transcendentals on the shading hot paths, for float and Float8.
+// shaders opt in per program, the bounds are the largest errors measured against double precision
+// over the stated domain, final rounding included:
+//
+//	rsqrt(x)	 x positive normal			relative 2.7e-7 (SSE/AVX), 4.8e-6 without SSE
+//	exp2(x)		 x in [-126, 128)			relative 1.0e-7, 0 below -126
+//	log2(x)		 x positive normal			absolute 9.0e-8 * max(1, |log2(x)|)
+//	exp(x)		 x in [-87, 88)				relative 8.0e-8 * (1 + |x|)
+//	pow(x, y)	 x positive normal			relative 1.4e-7 * (1 + |y * log2(x)|) while the result
+//											 is a normal float, 0 for x <= 0
+//
+// denormals, infinities and nans are not handled
+namespace fastmath
+{
+	namespace detail
+	{
+		using ::select;
+
+		inline float select(bool m, float a, float b) { return m ? a : b; }
+
+		// the bit pattern of x read as int32 and converted to float
+		inline float bits_to_float(float x) { return float(int32_t(simd_detail::bits(x))); }
+		// x truncated to int32, the integer's bit pattern read back as float
+		inline float float_to_bits(float x) { return simd_detail::from_bits(uint32_t(int32_t(x))); }
+
+		inline Float8 bits_to_float(const Float8& x)
+		{
+#if defined(SIMD_AVX)
+			return _mm256_cvtepi32_ps(_mm256_castps_si256(x.v));
+#elif defined(SIMD_SSE2)
+			return Float8(_mm_cvtepi32_ps(_mm_castps_si128(x.lo)), _mm_cvtepi32_ps(_mm_castps_si128(x.hi)));
+#else
+			return simd_detail::map(x, [](float v) { return bits_to_float(v); });
+#endif
+		}
+
+		inline Float8 float_to_bits(const Float8& x)
+		{
+#if defined(SIMD_AVX)
+			return _mm256_castsi256_ps(_mm256_cvttps_epi32(x.v));
+#elif defined(SIMD_SSE2)
+			return Float8(_mm_castsi128_ps(_mm_cvttps_epi32(x.lo)), _mm_castsi128_ps(_mm_cvttps_epi32(x.hi)));
+#else
+			return simd_detail::map(x, [](float v) { return float_to_bits(v); });
+#endif
+		}
+
+		inline float and_bits(float x, uint32_t m) { return simd_detail::from_bits(simd_detail::bits(x) & m); }
+		inline float or_bits(float x, uint32_t m)  { return simd_detail::from_bits(simd_detail::bits(x) | m); }
+		inline Float8 and_bits(const Float8& x, uint32_t m) { return x & Float8(simd_detail::from_bits(m)); }
+		inline Float8 or_bits(const Float8& x, uint32_t m)  { return x | Float8(simd_detail::from_bits(m)); }
+
+		// Horner's scheme, coefficients from the highest degree down
+		template<class T, size_t N>
+		inline T polynomial(const T& x, const float (&c)[N])
+		{
+			T r = c[0];
+			for (size_t i = 1; i < N; i++)
+				r = r * x + c[i];
+			return r;
+		}
+
+		// 2^f on [-0.5, 0.5] and ln(1 + x) / x^3 on [sqrt(0.5) - 1, sqrt(2) - 1], minimax fits from cephes
+		constexpr float EXP2_COEFFS[] = {
+			1.535336188319500e-4f, 1.339887440266574e-3f, 9.618437357674640e-3f,
+			5.550332471162809e-2f, 2.402264791363012e-1f, 6.931472028550421e-1f, 1.0f
+		};
+		constexpr float LOG_COEFFS[] = {
+			7.0376836292e-2f, -1.1514610310e-1f, 1.1676998740e-1f,
+			-1.2420140846e-1f, 1.4249322787e-1f, -1.6668057665e-1f,
+			2.0000714765e-1f, -2.4999993993e-1f, 3.3333331174e-1f
+		};
+
+		constexpr float LOG2E = 1.44269504088896341f;
+		constexpr float SQRT_HALF = 0.707106781186547524f;
+	}
+
+	// hardware estimate or bit trick refined by Newton steps
+	inline float rsqrt(float x)
+	{
+#if defined(SIMD_AVX) || defined(SIMD_SSE2)
+		float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+		return r * (1.5f - 0.5f * x * r * r);
+#else
+		float r = simd_detail::from_bits(0x5f375a86u - (simd_detail::bits(x) >> 1));
+		r = r * (1.5f - 0.5f * x * r * r);
+		return r * (1.5f - 0.5f * x * r * r);
+#endif
+	}
+
+	inline Float8 rsqrt(const Float8& x)
+	{
+#if defined(SIMD_AVX)
+		Float8 r = _mm256_rsqrt_ps(x.v);
+#elif defined(SIMD_SSE2)
+		Float8 r(_mm_rsqrt_ps(x.lo), _mm_rsqrt_ps(x.hi));
+#else
+		Float8 r = simd_detail::map(x, [](float v) { return simd_detail::from_bits(0x5f375a86u - (simd_detail::bits(v) >> 1)); });
+		r = r * (Float8(1.5f) - Float8(0.5f) * x * r * r);
+#endif
+		return r * (Float8(1.5f) - Float8(0.5f) * x * r * r);
+	}
+
+	// 2^round(x) built in the exponent field times a polynomial of the remainder
+	template<class T>
+	inline T exp2(const T& x)
+	{
+		using std::floor;
+		using std::min;
+		using std::max;
+		T c = min(max(x, T(-126.0f)), T(128.0f));
+		T n = floor(c + T(0.5f));
+		T p = detail::polynomial(c - n, detail::EXP2_COEFFS);
+		// 2^128 has no exponent field, it is applied as 2^127 * 2
+		T e = min(n, T(127.0f));
+		T scale = detail::float_to_bits((e + T(127.0f)) * T(8388608.0f));
+		p = p * (T(1.0f) + n - e);
+		return detail::select(x < T(-126.0f), T(0.0f), p * scale);
+	}
+
+	// x = m * 2^e with m in [sqrt(0.5), sqrt(2)), log2(x) = e + ln(m) * log2(e)
+	template<class T>
+	inline T log2(const T& x)
+	{
+		T m = detail::or_bits(detail::and_bits(x, 0x007fffffu), 0x3f000000u);
+		T e = detail::bits_to_float(detail::and_bits(x, 0x7f800000u)) * T(1.0f / 8388608.0f) - T(126.0f);
+		auto small = m < T(detail::SQRT_HALF);
+		e = detail::select(small, e - T(1.0f), e);
+		m = detail::select(small, m + m - T(1.0f), m - T(1.0f));
+		T z = m * m;
+		T ln = m - T(0.5f) * z + m * z * detail::polynomial(m, detail::LOG_COEFFS);
+		return ln * T(detail::LOG2E) + e;
+	}
+
+	template<class T>
+	inline T exp(const T& x)
+	{
+		return exp2(x * T(detail::LOG2E));
+	}
+
+	template<class T>
+	inline T pow(const T& x, const T& y)
+	{
+		return detail::select(x > T(0.0f), exp2(y * log2(x)), T(0.0f));
+	}
+
+	// x^(2^n) by repeated squaring, the scalar counterpart of pow2n in simd.h
+	inline float pow2n(float x, int n)
+	{
+		for (int i = 0; i < n; i++)
+			x *= x;
+		return x;
+	}
+
+	inline Vec3 normalize(const Vec3& a)					{ return a * rsqrt(glm::dot(a, a)); }
+	inline Vec3 pow(const Vec3& a, float e)					{ return Vec3(pow(a.x, e), pow(a.y, e), pow(a.z, e)); }
+	inline Vec3 exp(const Vec3& a)							{ return Vec3(exp(a.x), exp(a.y), exp(a.z)); }
+
+	inline Vec3x8 normalize(const Vec3x8& a)				{ return a * rsqrt(dot(a, a)); }
+	inline Vec3x8 pow(const Vec3x8& a, const Float8& e)		{ return Vec3x8(pow(a.x, e), pow(a.y, e), pow(a.z, e)); }
+	inline Vec3x8 exp(const Vec3x8& a)						{ return Vec3x8(exp(a.x), exp(a.y), exp(a.z)); }
+}
+
+#endif
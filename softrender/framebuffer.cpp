@@ -1,54 +1,107 @@
 #include "framebuffer.h"
+#include "threadpool.h"
+#include "packedcolor.h"
+
+namespace
+{
+	// the 4th half is dropped
+	inline void color_to_half3(const Color4& color, uint16_t* h)
+	{
+		uint16_t rgba[4];
+		packed::float4_to_half4(&color.r, rgba);
+		std::copy_n(rgba, 3, h);
+	}
+}
 
 FrameBuffer::FrameBuffer(int width,
 	int height,
 	ColorFormat color_format,
-	DepthFormat depth_format)
+	DepthFormat depth_format,
+	std::shared_ptr<ThreadPool> thread_pool)
 	: _width(width)
 	, _height(height)
+	, _thread_pool(std::move(thread_pool))
 	, _color_format(color_format)
 	, _depth_format(depth_format)
 {
+	_band_count = _thread_pool ? std::max(1, std::min<int>(_thread_pool->region_count(), height)) : 1;
+	_band_height = std::max(1, (height + _band_count - 1) / _band_count);
+
 	if (_color_format == ColorFormat::LDR_RGB)
-		_ldr_color_buffer.resize(width * height * 3);
+		_ldr_color_buffer.reset(new unsigned char[width * height * 3]);
 	else if(_color_format == ColorFormat::HDR_RGB)
-		_hdr_color_buffer.resize(width * height * 3);
+		_hdr_color_buffer.reset(new float[width * height * 3]);
+	else if (_color_format == ColorFormat::HDR_RGB16F)
+		_half_color_buffer.reset(new uint16_t[width * height * 3]);
+	else if (_color_format == ColorFormat::HDR_RGB9E5)
+		_rgb9e5_color_buffer.reset(new uint32_t[width * height]);
 
 	if(_depth_format == DepthFormat::FLOAT32)
-		_depth_buffer_32.resize(width * height);
+		_depth_buffer_32.reset(new float[width * height]);
+
+	clear_color(Color4(0.0f));
+	clear_depth(std::numeric_limits<float>::max());
+}
+
+template<class F>
+void FrameBuffer::_for_each_band(F&& fn)
+{
+	if (_thread_pool)
+		_thread_pool->for_each_region(_band_count, fn);
+	else
+		for (int band = 0; band < _band_count; band++)
+			fn(band);
 }
 
 void FrameBuffer::clear_color(Color4 color)
 {
-	if (_color_format == ColorFormat::LDR_RGB)
+	_for_each_band([&](size_t band)
 	{
-		int index = 0;
-		while(index < _width * _height * 3)
+		int begin, end;
+		band_rows(band, begin, end);
+		if (_color_format == ColorFormat::LDR_RGB)
 		{
-			_ldr_color_buffer[index++] = clamp<int>(color.r * 255.0f, 0, 255);
-			_ldr_color_buffer[index++] = clamp<int>(color.g * 255.0f, 0, 255);
-			_ldr_color_buffer[index++] = clamp<int>(color.b * 255.0f, 0, 255);
+			int index = begin * _width * 3;
+			while (index < end * _width * 3)
+			{
+				_ldr_color_buffer[index++] = clamp<int>(color.r * 255.0f, 0, 255);
+				_ldr_color_buffer[index++] = clamp<int>(color.g * 255.0f, 0, 255);
+				_ldr_color_buffer[index++] = clamp<int>(color.b * 255.0f, 0, 255);
+			}
 		}
-	}
-	else if (_color_format == ColorFormat::HDR_RGB)
-	{
-		int index = 0;
-		while (index < _width * _height * 3)
+		else if (_color_format == ColorFormat::HDR_RGB)
 		{
-			_hdr_color_buffer[index++] = color.r;
-			_hdr_color_buffer[index++] = color.g;
-			_hdr_color_buffer[index++] = color.b;
+			int index = begin * _width * 3;
+			while (index < end * _width * 3)
+			{
+				_hdr_color_buffer[index++] = color.r;
+				_hdr_color_buffer[index++] = color.g;
+				_hdr_color_buffer[index++] = color.b;
+			}
 		}
-	}
+		else if (_color_format == ColorFormat::HDR_RGB16F)
+		{
+			uint16_t h[3];
+			color_to_half3(color, h);
+			for (int index = begin * _width * 3; index < end * _width * 3; index += 3)
+				std::copy_n(h, 3, &_half_color_buffer[index]);
+		}
+		else if (_color_format == ColorFormat::HDR_RGB9E5)
+			std::fill(&_rgb9e5_color_buffer[begin * _width], &_rgb9e5_color_buffer[end * _width], packed::float3_to_rgb9e5(&color.r));
+	});
 }
 
 void FrameBuffer::clear_depth(float depth)
 {
-	if (_depth_format == DepthFormat::FLOAT32)
+	if (_depth_format != DepthFormat::FLOAT32)
+		return;
+	_for_each_band([&](size_t band)
 	{
-		for (int i = 0; i < _width * _height; i++)
+		int begin, end;
+		band_rows(band, begin, end);
+		for (int i = begin * _width; i < end * _width; i++)
 			_depth_buffer_32[i] = depth;
-	}
+	});
 }
 
 int FrameBuffer::width()
@@ -64,7 +117,7 @@ int FrameBuffer::height()
 unsigned char* FrameBuffer::ldr_color_buffer_data()
 {
 	if (_color_format == ColorFormat::LDR_RGB)
-		return _ldr_color_buffer.data();
+		return _ldr_color_buffer.get();
 	else
 		return nullptr;
 }
@@ -72,7 +125,23 @@ unsigned char* FrameBuffer::ldr_color_buffer_data()
 float* FrameBuffer::hdr_color_buffer_data()
 {
 	if (_color_format == ColorFormat::HDR_RGB)
-		return _hdr_color_buffer.data();
+		return _hdr_color_buffer.get();
+	else
+		return nullptr;
+}
+
+uint16_t* FrameBuffer::half_color_buffer_data()
+{
+	if (_color_format == ColorFormat::HDR_RGB16F)
+		return _half_color_buffer.get();
+	else
+		return nullptr;
+}
+
+uint32_t* FrameBuffer::rgb9e5_color_buffer_data()
+{
+	if (_color_format == ColorFormat::HDR_RGB9E5)
+		return _rgb9e5_color_buffer.get();
 	else
 		return nullptr;
 }
@@ -80,7 +149,7 @@ float* FrameBuffer::hdr_color_buffer_data()
 float* FrameBuffer::depth_buffer_data()
 {
 	if (_depth_format == DepthFormat::FLOAT32)
-		return _depth_buffer_32.data();
+		return _depth_buffer_32.get();
 	else
 		return nullptr;
 }
@@ -99,6 +168,10 @@ void FrameBuffer::set_color(int x, int y, const Color4& color)
 		_hdr_color_buffer[(y * _width + x) * 3 + 1] = color[1];
 		_hdr_color_buffer[(y * _width + x) * 3 + 2] = color[2];
 	}
+	else if (_color_format == ColorFormat::HDR_RGB16F)
+		color_to_half3(color, &_half_color_buffer[(y * _width + x) * 3]);
+	else if (_color_format == ColorFormat::HDR_RGB9E5)
+		_rgb9e5_color_buffer[y * _width + x] = packed::float3_to_rgb9e5(&color.r);
 }
 
 void FrameBuffer::set_depth(int x, int y, float depth)
@@ -127,6 +200,21 @@ Color4 FrameBuffer::get_color(int x, int y) const
 		color.a = 1.0f;
 		return color;
 	}
+	else if (_color_format == ColorFormat::HDR_RGB16F)
+	{
+		Color4 color;
+		for (int c = 0; c < 3; c++)
+			color[c] = packed::half_to_float(_half_color_buffer[(y * _width + x) * 3 + c]);
+		color.a = 1.0f;
+		return color;
+	}
+	else if (_color_format == ColorFormat::HDR_RGB9E5)
+	{
+		Color4 color;
+		packed::rgb9e5_to_float3(_rgb9e5_color_buffer[y * _width + x], &color.r);
+		color.a = 1.0f;
+		return color;
+	}
 	else
 		return Color4(0.0f);
 }
@@ -148,3 +236,24 @@ FrameBuffer::DepthFormat FrameBuffer::depth_format() const
 {
 	return _depth_format;
 }
+
+int FrameBuffer::band_count() const
+{
+	return _band_count;
+}
+
+const std::shared_ptr<ThreadPool>& FrameBuffer::thread_pool() const
+{
+	return _thread_pool;
+}
+
+int FrameBuffer::band_of_row(int y) const
+{
+	return y / _band_height;
+}
+
+void FrameBuffer::band_rows(int band, int& begin, int& end) const
+{
+	begin = std::min(band * _band_height, _height);
+	end = std::min(begin + _band_height, _height);
+}
@@ -2,8 +2,11 @@
 #define FRAMEBUFFER_H
 
 #include <vector>
+#include <memory>
+#include <cstdint>
 #include "maths.h"
 
+class ThreadPool;
 
 class FrameBuffer
 {
@@ -12,7 +15,9 @@ public:
 	enum class ColorFormat
 	{
 		LDR_RGB,
-		HDR_RGB
+		HDR_RGB,
+		HDR_RGB16F,		// half floats, 6 bytes per pixel
+		HDR_RGB9E5		// 4 bytes per pixel, 9 bit RGB with a shared exponent, negative colors become 0
 	};
 
 	enum class DepthFormat
@@ -26,7 +31,8 @@ public:
 		int width, 
 		int height, 
 		ColorFormat color_format = ColorFormat::LDR_RGB, 
-		DepthFormat depth_format = DepthFormat::FLOAT32);
+		DepthFormat depth_format = DepthFormat::FLOAT32,
+		std::shared_ptr<ThreadPool> thread_pool = nullptr);
 
 	void clear_color(Color4 color);
 
@@ -40,6 +46,11 @@ public:
 
 	float* hdr_color_buffer_data();
 
+	// 3 halves per pixel
+	uint16_t* half_color_buffer_data();
+
+	uint32_t* rgb9e5_color_buffer_data();
+
 	float* depth_buffer_data();
 
 	void set_color(int x, int y, const Color4& color);
@@ -53,19 +64,41 @@ public:
 	ColorFormat color_format() const;
 
 	DepthFormat depth_format() const;
+
+	// the buffer is split into horizontal bands, band i is cleared and depth tested by the worker of
+	// thread_pool() owning region i, so its pages live on that worker's NUMA node and in its cache,
+	// a buffer created without a pool has a single band and is cleared on the calling thread
+	int band_count() const;
+
+	const std::shared_ptr<ThreadPool>& thread_pool() const;
+
+	int band_of_row(int y) const;
+
+	void band_rows(int band, int& begin, int& end) const;
 	
 private:
 
 	int _width;
 	int _height;
 	
-	std::vector<unsigned char> _ldr_color_buffer;
-	std::vector<float>		   _hdr_color_buffer;
+	int _band_count;
+	int _band_height;
+
+	std::shared_ptr<ThreadPool> _thread_pool;
 
-	std::vector<float> _depth_buffer_32;
+	// left uninitialized on allocation, the first touch happens in the banded clear
+	std::unique_ptr<unsigned char[]> _ldr_color_buffer;
+	std::unique_ptr<float[]>		 _hdr_color_buffer;
+	std::unique_ptr<uint16_t[]>		 _half_color_buffer;
+	std::unique_ptr<uint32_t[]>		 _rgb9e5_color_buffer;
+
+	std::unique_ptr<float[]> _depth_buffer_32;
 
 	ColorFormat _color_format;
 	DepthFormat _depth_format;
+
+	template<class F>
+	void _for_each_band(F&& fn);
 	
 };
 
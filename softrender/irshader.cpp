@@ -0,0 +1,229 @@
+#include "irshader.h"
+#include "pipeline.h"
+#include <cassert>
+
+namespace Uniform
+{
+	static const auto transform_model		= UniformRegistry::register_uniform<Mat4>("transform.model");
+	static const auto transform_view		= UniformRegistry::register_uniform<Mat4>("transform.view");
+	static const auto transform_projection	= UniformRegistry::register_uniform<Mat4>("transform.projection");
+};
+
+namespace
+{
+	// constants of the current vertex batch, either the shader's or the current instance's
+	thread_local const float* vertex_constants;
+	thread_local std::vector<float> instance_constants;
+
+	thread_local std::vector<Float8> registers;
+
+	Float8* thread_registers(const ShaderIR::Program& program)
+	{
+		if (registers.size() < size_t(program.register_num))
+			registers.resize(program.register_num);
+		return registers.data();
+	}
+
+	float lane0(const Float8& x)
+	{
+		alignas(32) float lanes[SIMD_WIDTH];
+		x.store(lanes);
+		return lanes[0];
+	}
+
+	void ir_draw(RenderDevice& device, FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count)
+	{
+		device.draw<IRVertexShader, IRFragmentShader, DYNAMIC_VARYING_NUM>(framebuffer, vertex_array, instance_buffer, instance_count);
+	}
+}
+
+template<class Base>
+void IRShader<Base>::load_uniforms()
+{
+	using ShaderIR::UniformBinding;
+
+	_constants = _program->constants;
+	for (auto& binding : _program->uniforms)
+	{
+		float* dst = &_constants[binding.slot];
+		const float* def = binding.default_val;
+		switch (binding.type)
+		{
+		case UniformBinding::Type::FLOAT:
+			dst[0] = this->get_uniform(UniformHandle<float>{ binding.id, binding.block, binding.offset }, def[0]);
+			break;
+		case UniformBinding::Type::VEC3:
+		{
+			Vec3 v = this->get_uniform(UniformHandle<Vec3>{ binding.id, binding.block, binding.offset }, Vec3(def[0], def[1], def[2]));
+			for (int i = 0; i < 3; i++)
+				dst[i] = v[i];
+			break;
+		}
+		case UniformBinding::Type::COLOR4:
+		{
+			Color4 v = this->get_uniform(UniformHandle<Color4>{ binding.id, binding.block, binding.offset }, Color4(def[0], def[1], def[2], def[3]));
+			for (int i = 0; i < 4; i++)
+				dst[i] = v[i];
+			break;
+		}
+		}
+	}
+
+	_samplers.clear();
+	for (auto& binding : _program->samplers)
+	{
+		_samplers.push_back(this->get_uniform(binding.handle, binding.default_val));
+		if (_samplers.back().empty() && binding.fallback >= 0)
+			_samplers.back() = _samplers[binding.fallback];
+	}
+
+	if (_uses_transform())
+	{
+		_projection = this->get_uniform(Uniform::transform_projection);
+		_modelview = this->get_uniform(Uniform::transform_model) * this->get_uniform(Uniform::transform_view);
+		_write_builtins(_constants.data(), _modelview);
+	}
+}
+
+template<class Base>
+bool IRShader<Base>::_uses_transform() const
+{
+	for (int slot : _program->builtin_slots)
+		if (slot >= 0)
+			return true;
+	return false;
+}
+
+template<class Base>
+void IRShader<Base>::_write_builtins(float* constants, const Mat4& modelview) const
+{
+	using ShaderIR::Builtin;
+
+	if (int slot = _program->builtin_slots[int(Builtin::MODELVIEW)]; slot >= 0)
+	{
+		for (int j = 0; j < 4; j++)
+			for (int i = 0; i < 4; i++)
+				constants[slot + j * 4 + i] = modelview[j][i];
+	}
+	if (int slot = _program->builtin_slots[int(Builtin::PROJECTION)]; slot >= 0)
+	{
+		for (int j = 0; j < 4; j++)
+			for (int i = 0; i < 4; i++)
+				constants[slot + j * 4 + i] = _projection[j][i];
+	}
+	if (int slot = _program->builtin_slots[int(Builtin::NORMAL_TRANSFORM)]; slot >= 0)
+	{
+		Mat3 normal_transform = trans::normalTransformMat(modelview);
+		for (int j = 0; j < 3; j++)
+			for (int i = 0; i < 3; i++)
+				constants[slot + j * 3 + i] = normal_transform[j][i];
+	}
+}
+
+template class IRShader<VertexShader>;
+template class IRShader<FragmentShader>;
+
+
+void IRVertexShader::begin_batch()
+{
+	vertex_constants = _constants.data();
+}
+
+void IRVertexShader::load_instance(const Instance& instance, size_t /*instance_id*/)
+{
+	if (!_uses_transform())
+		return;
+	Mat4 instance_model;
+	for (int i = 0; i < 4; i++)
+		instance_model[i] = instance.attributes[i];
+	instance_constants = _constants;
+	_write_builtins(instance_constants.data(), instance_model * _modelview);
+	vertex_constants = instance_constants.data();
+}
+
+void IRVertexShader::run(const VSIn& in, VSOut& out)
+{
+	VSInBatch batch;
+	VSOutBatch result;
+	std::vector<Vec4x8> varyings(_program->output_num - 1);
+	result.out_varying = varyings.data();
+	result.varying_num = int(varyings.size());
+	for (int i = 0; i < _program->input_num; i++)
+		batch.attributes[i] = Vec4x8(in.attributes[i]);
+	run_batch(batch, result);
+	for (int c = 0; c < 4; c++)
+	{
+		out.position[c] = lane0(result.position[c]);
+		for (int v = 0; v + 1 < _program->output_num; v++)
+			out.out_varying[v][c] = lane0(result.out_varying[v][c]);
+	}
+}
+
+void IRVertexShader::run_batch(const VSInBatch& in, VSOutBatch& out)
+{
+	static const Mask8 all_lanes = mask8(0xff);
+
+	auto& program = *_program;
+	Float8* regs = thread_registers(program);
+	for (int i = 0; i < program.input_num; i++)
+		for (int c = 0; c < 4; c++)
+			regs[i * 4 + c] = in.attributes[i][c];
+
+	ShaderIR::ExecContext context;
+	context.constants = vertex_constants;
+	context.samplers = _samplers.data();
+	context.active = all_lanes;
+	program.execute(regs, context);
+
+	for (int c = 0; c < 4; c++)
+	{
+		out.position[c] = regs[program.outputs[c]];
+		for (int v = 0; v + 1 < program.output_num; v++)
+			out.out_varying[v][c] = regs[program.outputs[(v + 1) * 4 + c]];
+	}
+}
+
+
+void IRFragmentShader::run(const FSIn& in, FSOut& out)
+{
+	FSInPacket packet;
+	FSOutPacket result;
+	std::vector<Vec4x8> varyings(_program->input_num);
+	for (int i = 0; i < _program->input_num; i++)
+		varyings[i] = Vec4x8(in.in_varying[i]);
+	packet.in_varying = varyings.data();
+	packet.varying_num = int(varyings.size());
+	packet.frag_coord = Vec2x8(in.frag_coord);
+	packet.active = mask8(1);
+	// the IR samples at lod 0 and never reads derivatives
+	run_packet(packet, result);
+	for (int c = 0; c < 4; c++)
+		out.color[c] = lane0(result.color[c]);
+}
+
+void IRFragmentShader::run_packet(const FSInPacket& in, FSOutPacket& out)
+{
+	auto& program = *_program;
+	Float8* regs = thread_registers(program);
+	for (int i = 0; i < program.input_num; i++)
+		for (int c = 0; c < 4; c++)
+			regs[i * 4 + c] = in.in_varying[i][c];
+
+	ShaderIR::ExecContext context;
+	context.constants = _constants.data();
+	context.samplers = _samplers.data();
+	context.active = in.active;
+	program.execute(regs, context);
+
+	for (int c = 0; c < 4; c++)
+		out.color[c] = regs[program.outputs[c]];
+	out.discarded = Mask8(0.0f);
+}
+
+
+ShaderProgram make_ir_program(std::shared_ptr<const ShaderIR::Program> vs, std::shared_ptr<const ShaderIR::Program> fs)
+{
+	assert(vs->input_num <= MAX_ATTRIBUTE_NUM);
+	assert(vs->output_num == fs->input_num + 1 && fs->output_num == 1);
+	return ShaderProgram(std::make_shared<IRVertexShader>(vs), std::make_shared<IRFragmentShader>(fs), fs->input_num, &ir_draw);
+}
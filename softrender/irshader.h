@@ -0,0 +1,82 @@
+#ifndef IR_SHADER_H
+#define IR_SHADER_H
+
+#include <memory>
+#include <vector>
+#include "shader.h"
+#include "shaderir.h"
+
+// shaders that run a ShaderIR::Program, the program is compiled once by the first set_shader_program
+// and shared by every copy. the transform builtins are computed from "transform.model", "transform.view"
+// and "transform.projection", instance attributes 0-3 hold the instance model matrix like in Phong and Unlit
+template<class Base>
+class IRShader : public Base
+{
+public:
+
+	explicit IRShader(std::shared_ptr<const ShaderIR::Program> program) : _program(std::move(program)) {}
+
+	const ShaderIR::Program& program() const { return *_program; }
+
+	void compile() override { _program->compile(); }
+
+	void load_uniforms() override;
+
+protected:
+
+	std::shared_ptr<const ShaderIR::Program> _program;
+	std::vector<float> _constants;
+	std::vector<TextureSampler> _samplers;
+	Mat4 _projection;
+	Mat4 _modelview;
+
+	bool _uses_transform() const;
+
+	void _write_builtins(float* constants, const Mat4& modelview) const;
+
+};
+
+class IRVertexShader final : public IRShader<VertexShader>
+{
+public:
+
+	// outputs are the position followed by the varyings
+	using IRShader::IRShader;
+
+	std::shared_ptr<VertexShader> clone() const override { return std::make_shared<IRVertexShader>(*this); }
+
+	void begin_batch() override;
+
+	void load_instance(const Instance& instance, size_t instance_id) override;
+
+	void run(const VSIn& in, VSOut& out) override;
+
+	int batch_attribute_num() const override { return _program->input_num; }
+
+	void run_batch(const VSInBatch& in, VSOutBatch& out) override;
+
+};
+
+class IRFragmentShader final : public IRShader<FragmentShader>
+{
+public:
+
+	// inputs are the varyings, the only output is the color
+	using IRShader::IRShader;
+
+	std::shared_ptr<FragmentShader> clone() const override { return std::make_shared<IRFragmentShader>(*this); }
+
+	void run(const FSIn& in, FSOut& out) override;
+
+	bool supports_packet() const override { return true; }
+
+	// the IR has no discard or depth output
+	bool may_discard() const override { return false; }
+
+	void run_packet(const FSInPacket& in, FSOutPacket& out) override;
+
+};
+
+ShaderProgram make_ir_program(std::shared_ptr<const ShaderIR::Program> vs, std::shared_ptr<const ShaderIR::Program> fs);
+
+#endif
@@ -0,0 +1,94 @@
+#include "lightgrid.h"
+#include "framebuffer.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+	// ThreadPool::grain_size cost of binning one tile, mostly the depth reads and light tests
+	constexpr double TILE_ITEM_COST = 1000.0;
+
+	// screen position in pixels and depth back to the projection's space
+	Vec3 unproject(float x, float y, float depth, const Viewport& viewport, const Mat4& inv_projection)
+	{
+		Vec4 ndc = Vec4(x / viewport.w * 2.0f - 1.0f, y / viewport.h * 2.0f - 1.0f, depth, 1.0f);
+		Vec4 p = ndc * inv_projection;
+		return vec3(p) / p.w;
+	}
+}
+
+void LightGrid::build(const std::vector<PointLight>& lights, FrameBuffer& framebuffer, const Viewport& viewport, const Mat4& projection,
+	ThreadPool* thread_pool, TaskQueue* queue)
+{
+	_lights = lights;
+	_tile_x_num = (viewport.w + TILE_SIZE - 1) / TILE_SIZE;
+	_tile_y_num = (viewport.h + TILE_SIZE - 1) / TILE_SIZE;
+	_tiles.resize(size_t(_tile_x_num) * _tile_y_num);
+
+	Mat4 inv_projection = glm::inverse(projection);
+	auto bin_tiles = [&](size_t l, size_t r) {
+		for (size_t tile = l; tile < r; tile++)
+			_bin_tile(int(tile), framebuffer, viewport, inv_projection);
+	};
+
+	if (thread_pool)
+		thread_pool->parallel_for(0, _tiles.size(), ThreadPool::grain_size(TILE_ITEM_COST), bin_tiles, queue);
+	else
+		bin_tiles(0, _tiles.size());
+}
+
+int LightGrid::tile_of(int x, int y) const
+{
+	int tx = clamp(x / TILE_SIZE, 0, _tile_x_num - 1);
+	int ty = clamp(y / TILE_SIZE, 0, _tile_y_num - 1);
+	return ty * _tile_x_num + tx;
+}
+
+void LightGrid::_bin_tile(int tile, FrameBuffer& framebuffer, const Viewport& viewport, const Mat4& inv_projection)
+{
+	auto& bin = _tiles[tile];
+	bin.clear();
+
+	int x0 = tile % _tile_x_num * TILE_SIZE;
+	int y0 = tile / _tile_x_num * TILE_SIZE;
+	int x1 = std::min(x0 + TILE_SIZE, viewport.w);
+	int y1 = std::min(y0 + TILE_SIZE, viewport.h);
+
+	// cleared pixels hold a depth past the far plane and count as the far plane
+	float min_depth = 0.0f;
+	float max_depth = 1.0f;
+	if (framebuffer.depth_format() != FrameBuffer::DepthFormat::None)
+	{
+		min_depth = 1.0f;
+		max_depth = 0.0f;
+		for (int y = y0; y < std::min(y1, framebuffer.height()); y++)
+			for (int x = x0; x < std::min(x1, framebuffer.width()); x++)
+			{
+				float depth = std::min(framebuffer.get_depth(x, y), 1.0f);
+				min_depth = std::min(min_depth, depth);
+				max_depth = std::max(max_depth, depth);
+			}
+		min_depth = std::max(min_depth, 0.0f);
+		if (min_depth > max_depth)
+			return;
+	}
+
+	// bounding box of the tile's frustum slice, a looser test than the slice itself but never misses a light
+	Vec3 box_min = Vec3(std::numeric_limits<float>::max());
+	Vec3 box_max = Vec3(-std::numeric_limits<float>::max());
+	for (int i = 0; i < 8; i++)
+	{
+		Vec3 p = unproject(float(i & 1 ? x1 : x0), float(i & 2 ? y1 : y0), i & 4 ? max_depth : min_depth, viewport, inv_projection);
+		box_min = glm::min(box_min, p);
+		box_max = glm::max(box_max, p);
+	}
+
+	for (uint32_t i = 0; i < _lights.size(); i++)
+	{
+		auto& light = _lights[i];
+		Vec3 d = light.position - glm::clamp(light.position, box_min, box_max);
+		if (glm::dot(d, d) < light.radius * light.radius)
+			bin.push_back(i);
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef LIGHT_GRID_H
+#define LIGHT_GRID_H
+
+#include <vector>
+#include <cstdint>
+#include "maths.h"
+#include "renderstates.h"
+
+class FrameBuffer;
+class ThreadPool;
+class TaskQueue;
+
+struct PointLight
+{
+	Vec3 position;		// in the space the program shades in, view space for Phong
+	float radius;		// no effect at or past radius
+	Color3 color;
+};
+
+// lights binned into TILE_SIZE x TILE_SIZE pixel tiles (Forward+). every tile keeps the lights whose
+// sphere touches the view-space bounds of the tile between its min and max depth, so a fragment shader
+// only loops over the lights near its pixel. bound through the "light_grid" uniform
+class LightGrid
+{
+public:
+
+	static constexpr int TILE_SIZE = 16;
+
+	// culls lights against the depth currently in framebuffer, normally filled by a depth prepass of the
+	// same geometry. the previous frame's depth also works but may drop lights where geometry moved.
+	// projection and viewport must be the ones the frame is drawn with
+	void build(const std::vector<PointLight>& lights, FrameBuffer& framebuffer, const Viewport& viewport, const Mat4& projection,
+		ThreadPool* thread_pool = nullptr, TaskQueue* queue = nullptr);
+
+	const std::vector<PointLight>& lights() const { return _lights; }
+
+	int tile_count() const { return int(_tiles.size()); }
+
+	// the tile holding pixel (x, y), clamped to the grid
+	int tile_of(int x, int y) const;
+
+	// indices into lights()
+	const std::vector<uint32_t>& tile_lights(int tile) const { return _tiles[tile]; }
+
+private:
+
+	std::vector<PointLight> _lights;
+	int _tile_x_num = 0;
+	int _tile_y_num = 0;
+	std::vector<std::vector<uint32_t>> _tiles;
+
+	void _bin_tile(int tile, FrameBuffer& framebuffer, const Viewport& viewport, const Mat4& inv_projection);
+
+};
+
+#endif
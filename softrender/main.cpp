@@ -11,6 +11,7 @@
 #include "unlit.h"
 #include "texture.h"
 #include "model.h"
+#include "threadpool.h"
 #include "profiler.h"
 
 static const int WIN_W = 500;
@@ -18,12 +19,30 @@ static const int WIN_H = 500;
 static const int fps_limit = 1000000;
 static const double min_frame_time = 1.0 / fps_limit;
 
-int main()
+// softrender --cook <image> [bc1|bc3|bc7] writes <image>.srtex, which Model maps in place of decoding the image
+static int cook(int argc, char** argv)
 {
+	Texture::ColorFormat format = Texture::ColorFormat::LDR_RGBA;
+	std::string_view name = argc > 3 ? argv[3] : "";
+	if (name == "bc1")
+		format = Texture::ColorFormat::BC1;
+	else if (name == "bc3")
+		format = Texture::ColorFormat::BC3;
+	else if (name == "bc7")
+		format = Texture::ColorFormat::BC7;
+	std::string path = argv[2];
+	return Texture::cook(path, path + std::string(Texture::COOKED_EXTENSION), false, format, ThreadPool::shared().get()) ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 2 && std::string_view(argv[1]) == "--cook")
+		return cook(argc, argv);
+
 	Profiler::set_mode(Profiler::Mode::SUM);
 
 	auto device = std::make_shared<RenderDevice>();
-	auto window = std::make_shared<RenderWindow>();
+	auto window = std::make_shared<RenderWindow>(device->thread_pool());
 		
 	if (!window->open(WIN_W, WIN_H, "Software Renderer"))
 	{
@@ -168,7 +187,8 @@ int main()
 
 	auto test_tex = std::make_shared<Texture>("res\\tex\\test.png");
 	test_tex->sampleMode = Texture::SampleMode::BILINEAR;
-	device->set_shader_uniform("material.texture_diffuse0", TextureSampler(test_tex));
+	auto& textures = device->texture_table();
+	device->set_shader_uniform("material.texture_diffuse0", textures.sampler(textures.add(test_tex)));
 	
 	Model model;
 	model.load("res\\model\\nanosuit\\nanosuit.obj");
@@ -186,6 +206,9 @@ int main()
 	projection = trans::perspective(PI * 0.25f, 1.0f, 0.1f, 500.0f);
 	// projection = trans::ortho(-1.0f, 1.0f, -1.0f, 1.0f, 0.5f, 50.0f);
 	device->set_shader_uniform("transform.projection", projection);
+
+	const auto camera_pos_uniform = UniformRegistry::register_uniform<Vec3>("camera_pos");
+	const auto view_uniform = UniformRegistry::register_uniform<Mat4>("transform.view");
 	
 	while (window->is_open())
 	{
@@ -200,13 +223,13 @@ int main()
 		static float t = 0.0;
 		t += deltatime;
 
-		device->set_shader_uniform("camera_pos", vec3(0.0f, 0.0f, 0.0f));
+		device->set_shader_uniform(camera_pos_uniform, vec3(0.0f, 0.0f, 0.0f));
 		
 		static Mat4 view;
 		view = trans::identity();
 		view *= camera_rotate_mat;
 		view *= trans::translate(0.0, 0.0, -camera_dist);
-		device->set_shader_uniform("transform.view", view);
+		device->set_shader_uniform(view_uniform, view);
 
 		{
 			window->clear(Color4(0.08, 0.08, 0.1, 1.0));
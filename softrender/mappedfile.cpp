@@ -0,0 +1,94 @@
+#include "mappedfile.h"
+#include <string>
+
+#if defined(_WIN32)
+
+#include <Windows.h>
+
+bool MappedFile::open(std::string_view path)
+{
+	close();
+	HANDLE file = CreateFileA(std::string(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size = {};
+	// empty files cannot be mapped
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!data)
+	{
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	_file = file;
+	_mapping = mapping;
+	_data = static_cast<const unsigned char*>(data);
+	_size = size_t(size.QuadPart);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (_data)
+		UnmapViewOfFile(_data);
+	if (_mapping)
+		CloseHandle(_mapping);
+	if (_file)
+		CloseHandle(_file);
+	_data = nullptr;
+	_size = 0;
+	_mapping = nullptr;
+	_file = nullptr;
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+bool MappedFile::open(std::string_view path)
+{
+	close();
+	int fd = ::open(std::string(path).c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st = {};
+	// empty files cannot be mapped
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+	// the mapping stays valid after the descriptor is closed
+	void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	_data = static_cast<const unsigned char*>(data);
+	_size = size_t(st.st_size);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (_data)
+		munmap(const_cast<unsigned char*>(_data), _size);
+	_data = nullptr;
+	_size = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile()
+{
+	close();
+}
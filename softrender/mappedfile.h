@@ -0,0 +1,42 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string_view>
+#include <cstddef>
+
+// a whole file mapped read-only. pages are read on first touch and shared through the page cache with every
+// other process mapping the same file
+class MappedFile
+{
+public:
+
+	MappedFile() = default;
+
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(std::string_view path);
+
+	void close();
+
+	bool empty() const { return !_data; }
+
+	const unsigned char* data() const { return _data; }
+
+	size_t size() const { return _size; }
+
+private:
+
+	const unsigned char* _data = nullptr;
+	size_t _size = 0;
+
+#if defined(_WIN32)
+	void* _file = nullptr;
+	void* _mapping = nullptr;
+#endif
+
+};
+
+#endif
@@ -1,18 +1,106 @@
 #include "mesh.h"
 #include <unordered_map>
 
+static const auto transform_model = UniformRegistry::register_uniform<Mat4>("transform.model");
+
 void Mesh::draw(std::shared_ptr<RenderDevice> device, FrameBuffer& framebuffer, const Mat4& transform)
 {
+	// residency only ever grows, a changed count means some textures finished decoding since the last draw
+	size_t resident_num = 0;
+	for (auto& texture : textures)
+		resident_num += texture.tex && texture.tex->resident();
+	if (_texture_uniforms.size() != textures.size() || _resident_texture_num != resident_num || _color_uniforms.size() != material_colors.size())
+		update_uniforms();
+
+	TextureTable& table = device->texture_table();
+	if (_table_handles.generation != table.generation())
+	{
+		_table_handles.release();
+		_table_handles.device = device;
+		_table_handles.generation = table.generation();
+		for (auto& uniform : _texture_uniforms)
+		{
+			if (!uniform.texture)
+				continue;
+			TextureHandle handle = table.add(uniform.texture);
+			_table_handles.handles.push_back(handle);
+			uniform.sampler = table.sampler(handle);
+		}
+	}
+
+	// a pending texture's slot may still hold the texture of the mesh drawn before
+	for (auto& uniform : _texture_uniforms)
+	{
+		if (uniform.texture)
+			device->set_shader_uniform(uniform.handle, uniform.sampler);
+		else
+			device->clear_shader_uniform(uniform.handle);
+	}
+	for (auto& [handle, color] : _color_uniforms)
+		device->set_shader_uniform(handle, color);
+
+	device->set_shader_uniform(transform_model, transform);
+
+	device->draw(framebuffer, vertex_array);
+}
+
+void Mesh::update_uniforms()
+{
+	_texture_uniforms.clear();
+	_color_uniforms.clear();
+
+	_resident_texture_num = 0;
+	_table_handles.release();
+
 	std::unordered_map<std::string, size_t> type_num;
 	for (auto& [tex, type_name] : textures)
 	{
+		// numbered over all textures of the type so a texture keeps its name however the decodes finish
 		std::string name = "material." + type_name + std::to_string(type_num[type_name]++);
-		device->set_shader_uniform(name, TextureSampler(tex));
+		auto texture = tex ? tex->texture() : nullptr;
+		_texture_uniforms.push_back({ UniformRegistry::register_uniform<TextureSampler>(name), texture, TextureSampler() });
+		_resident_texture_num += texture != nullptr;
 	}
 	for (auto& [name, color] : material_colors)
-		device->set_shader_uniform("material." + name, color);
+		_color_uniforms.emplace_back(UniformRegistry::register_uniform<Color4>("material." + name), color);
+}
 
-	device->set_shader_uniform("transform.model", transform);
+Mesh::TableHandles::TableHandles(TableHandles&& other) noexcept
+	: device(std::move(other.device)), generation(other.generation), handles(std::move(other.handles))
+{
+	other.generation = 0;
+	other.handles.clear();
+}
 
-	device->draw(framebuffer, vertex_array);
+Mesh::TableHandles& Mesh::TableHandles::operator=(const TableHandles& other)
+{
+	if (this != &other)
+		release();
+	return *this;
+}
+
+Mesh::TableHandles& Mesh::TableHandles::operator=(TableHandles&& other) noexcept
+{
+	if (this != &other)
+	{
+		release();
+		device = std::move(other.device);
+		generation = other.generation;
+		handles = std::move(other.handles);
+		other.generation = 0;
+		other.handles.clear();
+	}
+	return *this;
+}
+
+void Mesh::TableHandles::release()
+{
+	// a destroyed device took its table along, a cleared table already dropped the handles
+	auto owner = device.lock();
+	if (owner && owner->texture_table().generation() == generation)
+		for (auto handle : handles)
+			owner->texture_table().remove(handle);
+	device.reset();
+	generation = 0;
+	handles.clear();
 }
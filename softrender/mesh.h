@@ -4,10 +4,47 @@
 #include "renderdevice.h"
 #include "texture.h"
 #include <unordered_map>
+#include <atomic>
+
+// a texture decoded in the background. texture() is null until the decode publishes it with set_texture,
+// which happens once
+class AsyncTexture
+{
+public:
+
+	AsyncTexture() = default;
+
+	AsyncTexture(std::shared_ptr<Texture> texture) { set_texture(std::move(texture)); }
+
+	AsyncTexture(const AsyncTexture&) = delete;
+	AsyncTexture& operator=(const AsyncTexture&) = delete;
+
+	bool resident() const
+	{
+		return _resident.load(std::memory_order_acquire);
+	}
+
+	std::shared_ptr<Texture> texture() const
+	{
+		return resident() ? _texture : nullptr;
+	}
+
+	void set_texture(std::shared_ptr<Texture> texture)
+	{
+		_texture = std::move(texture);
+		_resident.store(true, std::memory_order_release);
+	}
+
+private:
+
+	std::shared_ptr<Texture> _texture = nullptr;
+	std::atomic<bool> _resident = false;
+
+};
 
 struct ModelTexture
 {
-	std::shared_ptr<Texture> tex;
+	std::shared_ptr<AsyncTexture> tex;
 	std::string type_name;
 };
 
@@ -22,6 +59,43 @@ public:
 	std::unordered_map<std::string, Vec4> material_colors;
 
 	void draw(std::shared_ptr<RenderDevice> device, FrameBuffer& frame_buffer, const Mat4& transform);
+
+	// resolves the uniform handles of textures and material_colors, call again after changing them. the uniforms
+	// of textures that are not resident yet are cleared so shaders use their defaults, draw binds them once they are
+	void update_uniforms();
+
+private:
+
+	struct TextureUniform
+	{
+		UniformHandle<TextureSampler> handle;
+		std::shared_ptr<Texture> texture;		// null while it is decoding
+		TextureSampler sampler;
+	};
+
+	// the handles the samplers were added to a device's texture table with, removed again with the mesh or when
+	// it is drawn with another table. a copy holds none and adds its own when it is drawn
+	struct TableHandles
+	{
+		std::weak_ptr<RenderDevice> device;
+		uint64_t generation = 0;		// of the table, 0 when nothing was added
+		std::vector<TextureHandle> handles;
+
+		TableHandles() = default;
+		TableHandles(const TableHandles&) {}
+		TableHandles(TableHandles&& other) noexcept;
+		TableHandles& operator=(const TableHandles& other);
+		TableHandles& operator=(TableHandles&& other) noexcept;
+		~TableHandles() { release(); }
+
+		void release();
+	};
+
+	size_t _resident_texture_num = 0;
+
+	std::vector<TextureUniform> _texture_uniforms;
+	TableHandles _table_handles;
+	std::vector<std::pair<UniformHandle<Color4>, Color4>> _color_uniforms;
 	
 };
 
@@ -5,6 +5,8 @@
 #include <assimp/postprocess.h>
 #include <assimp/texture.h>
 #include <iostream>
+#include <thread>
+#include <algorithm>
 
 
 Model::Model()
@@ -17,6 +19,11 @@ Model::Model(std::string_view path)
 	load(path);
 }
 
+Model::~Model()
+{
+	wait_textures();
+}
+
 bool Model::load(std::string_view path)
 {
 	Assimp::Importer importer;
@@ -67,6 +74,22 @@ bool Model::load(std::string_view path)
 	return true;
 }
 
+std::shared_ptr<ThreadPool> Model::_texture_decode_pool()
+{
+	static std::shared_ptr<ThreadPool> pool = std::make_shared<ThreadPool>(std::max(std::thread::hardware_concurrency() / 2, 1u));
+	return pool;
+}
+
+void Model::wait_textures()
+{
+	_decode_pool->wait(_decode_counter);
+}
+
+bool Model::textures_resident() const
+{
+	return _decode_counter.is_zero();
+}
+
 void Model::draw(std::shared_ptr<RenderDevice> device, FrameBuffer& framebuffer)
 {
 	Mat4 global_transform = get_global_transform();
@@ -76,6 +99,7 @@ void Model::draw(std::shared_ptr<RenderDevice> device, FrameBuffer& framebuffer)
 
 void Model::clear()
 {
+	wait_textures();
 	_meshes.clear();
 	_directory.clear();
 	_textures.clear();
@@ -182,6 +206,8 @@ void Model::_process_mesh(aiMesh* mesh, const aiScene* scene)
 		_load_textures(m, material, aiTextureType_NORMALS, "texture_normal");
 		_load_textures(m, material, aiTextureType_OPACITY, "texture_opacity");
 	}
+
+	m.update_uniforms();
 }
 
 void Model::_load_textures(Mesh& mesh, aiMaterial* mat, aiTextureType type, std::string_view type_name)
@@ -199,9 +225,24 @@ void Model::_load_textures(Mesh& mesh, aiMaterial* mat, aiTextureType type, std:
 		}
 		
 		ModelTexture tex;
-		tex.tex = std::make_shared<Texture>(_directory + path.C_Str(), false);
+		tex.tex = std::make_shared<AsyncTexture>();
 		tex.type_name = type_name;
 
+		// the decode only touches its own texture, the handle is published once it is ready to sample.
+		// an image cooked next to it is mapped instead, it is already tiled and holds its mip chain
+		_decode_pool->execute([handle = tex.tex, file = _directory + path.C_Str()]()
+		{
+			auto texture = std::make_shared<Texture>();
+			if (!texture->load_cooked(file + std::string(Texture::COOKED_EXTENSION)))
+			{
+				texture->load(file, false);
+				texture->set_layout(Texture::Layout::TILED);
+				texture->generate_mipmaps();
+			}
+			texture->sampleMode = Texture::SampleMode::TRILINEAR;
+			handle->set_texture(std::move(texture));
+		}, _decode_counter);
+
 		mesh.textures.push_back(tex);
 		_textures[path.C_Str()] = tex;
 	}
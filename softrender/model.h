@@ -2,6 +2,7 @@
 #define MODEL_H
 
 #include "mesh.h"
+#include "threadpool.h"
 #include <unordered_map>
 
 struct aiNode;
@@ -22,7 +23,16 @@ public:
     
     Model(std::string_view path);
 
+    ~Model();
+
+    // textures are decoded on a pool of their own while the meshes are built and may still be decoding
+    // when load returns, meshes draw without them until they are resident
     bool load(std::string_view path);
+
+    // blocks until every texture of the model is resident
+    void wait_textures();
+
+    bool textures_resident() const;
 	
     void draw(std::shared_ptr<RenderDevice> device, FrameBuffer& framebuffer);
 
@@ -46,6 +56,9 @@ private:
 
     std::unordered_map<std::string, ModelTexture> _textures;
 
+    std::shared_ptr<ThreadPool> _decode_pool = _texture_decode_pool();
+    TaskCounter _decode_counter;
+
     Vec3 _centroid_position;
     Vec3 _aabb_start;
     Vec3 _aabb_end;
@@ -53,6 +66,10 @@ private:
     int _position_count;
 
 
+    // decodes take long enough to stall a frame behind them, so they get their own workers instead of the
+    // shared pool the devices render on
+    static std::shared_ptr<ThreadPool> _texture_decode_pool();
+
     void _process_node(aiNode* node, const aiScene* scene);
 	
     void _process_mesh(aiMesh* mesh, const aiScene* scene);
@@ -0,0 +1,106 @@
+#ifndef PACKED_COLOR_H
+#define PACKED_COLOR_H
+
+#include <cstdint>
+#include <algorithm>
+#include "simd.h"
+
+// conversions of the compact HDR storage formats: IEEE half floats, with F16C when the target has it,
+// and RGB9E5, three 9 bit mantissas sharing a 5 bit exponent (no sign, no alpha, at most 65408).
+// both round to nearest
+namespace packed
+{
+	// round to nearest even, overflow gives infinity and nans stay nans
+	inline uint16_t float_to_half(float x)
+	{
+#if defined(SIMD_F16C)
+		return uint16_t(_mm_extract_epi16(_mm_cvtps_ph(_mm_set_ss(x), _MM_FROUND_TO_NEAREST_INT), 0));
+#else
+		uint32_t u = simd_detail::bits(x);
+		uint32_t sign = u >> 16 & 0x8000u;
+		u &= 0x7fffffffu;
+		uint32_t h;
+		if (u >= 0x47800000u)
+			h = u > 0x7f800000u ? 0x7e00u : 0x7c00u;
+		else if (u < 0x38800000u)
+		{
+			// denormals: the float addition aligns and rounds the mantissa at the bottom of the word
+			uint32_t magic = 0x3f000000u;
+			h = simd_detail::bits(simd_detail::from_bits(u) + simd_detail::from_bits(magic)) - magic;
+		}
+		else
+			h = (u + 0xc8000fffu + (u >> 13 & 1)) >> 13;
+		return uint16_t(h | sign);
+#endif
+	}
+
+	inline float half_to_float(uint16_t h)
+	{
+#if defined(SIMD_F16C)
+		return _mm_cvtss_f32(_mm_cvtph_ps(_mm_cvtsi32_si128(h)));
+#else
+		uint32_t u = uint32_t(h & 0x7fffu) << 13;
+		uint32_t exponent = u & 0x0f800000u;
+		u += 0x38000000u;
+		if (exponent == 0x0f800000u)
+			u += 0x38000000u;
+		else if (exponent == 0)
+			u = simd_detail::bits(simd_detail::from_bits(u + 0x00800000u) - simd_detail::from_bits(0x38800000u));
+		return simd_detail::from_bits(u | uint32_t(h & 0x8000u) << 16);
+#endif
+	}
+
+	inline void float4_to_half4(const float* x, uint16_t* h)
+	{
+#if defined(SIMD_F16C)
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(h), _mm_cvtps_ph(_mm_loadu_ps(x), _MM_FROUND_TO_NEAREST_INT));
+#else
+		for (int i = 0; i < 4; i++)
+			h[i] = float_to_half(x[i]);
+#endif
+	}
+
+	inline void half4_to_float4(const uint16_t* h, float* x)
+	{
+#if defined(SIMD_F16C)
+		_mm_storeu_ps(x, _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(h))));
+#else
+		for (int i = 0; i < 4; i++)
+			x[i] = half_to_float(h[i]);
+#endif
+	}
+
+	constexpr float RGB9E5_MAX = 65408.0f;
+
+	// negative values and nans become 0, the exponent is picked so the largest channel keeps 9 bits
+	inline uint32_t float3_to_rgb9e5(const float* rgb)
+	{
+		float c[3];
+		for (int i = 0; i < 3; i++)
+			c[i] = rgb[i] > 0.0f ? std::min(rgb[i], RGB9E5_MAX) : 0.0f;
+		float m = std::max(std::max(c[0], c[1]), c[2]);
+
+		// 2^(exponent - 24) is the size of a mantissa step, exponent 0 covers everything below 2^-15
+		int exponent = std::max(int(simd_detail::bits(m) >> 23) - 127, -16) + 16;
+		float scale = simd_detail::from_bits(uint32_t(151 - exponent) << 23);
+		if (int(m * scale + 0.5f) == 512)
+		{
+			exponent++;
+			scale *= 0.5f;
+		}
+
+		uint32_t v = uint32_t(exponent) << 27;
+		for (int i = 0; i < 3; i++)
+			v |= uint32_t(c[i] * scale + 0.5f) << (i * 9);
+		return v;
+	}
+
+	inline void rgb9e5_to_float3(uint32_t v, float* rgb)
+	{
+		float scale = simd_detail::from_bits(uint32_t(103 + (v >> 27)) << 23);
+		for (int i = 0; i < 3; i++)
+			rgb[i] = float(v >> (i * 9) & 511u) * scale;
+	}
+}
+
+#endif
@@ -1,21 +1,56 @@
 #include "phong.h"
+#include "pipeline.h"
+#include "irshader.h"
+#include "fastmath.h"
 
+namespace Uniform
+{
+	static const auto transform_model			= UniformRegistry::register_uniform<Mat4>("transform.model");
+	static const auto transform_view			= UniformRegistry::register_uniform<Mat4>("transform.view");
+	static const auto transform_projection		= UniformRegistry::register_uniform<Mat4>("transform.projection");
+	static const auto camera_pos				= UniformRegistry::register_uniform<Vec3>("camera_pos");
+	static const auto gamma						= UniformRegistry::register_uniform<float>("gamma");
+	static const auto exposure					= UniformRegistry::register_uniform<float>("exposure");
+	static const auto material_color_ambient	= UniformRegistry::register_uniform<Color4>("material.color_ambient");
+	static const auto material_color_diffuse	= UniformRegistry::register_uniform<Color4>("material.color_diffuse");
+	static const auto material_color_specular	= UniformRegistry::register_uniform<Color4>("material.color_specular");
+	static const auto material_texture_ambient0	= UniformRegistry::register_uniform<TextureSampler>("material.texture_ambient0");
+	static const auto material_texture_diffuse0	= UniformRegistry::register_uniform<TextureSampler>("material.texture_diffuse0");
+	static const auto material_texture_specular0	= UniformRegistry::register_uniform<TextureSampler>("material.texture_specular0");
+	static const auto light_grid				= UniformRegistry::register_uniform<std::shared_ptr<const LightGrid>>("light_grid");
+};
+
+// the transform the current thread runs with, either the shader's snapshot or the current instance's
 namespace Transform
 {
-	static thread_local Mat4 model;
-	static thread_local Mat4 view;
-	static thread_local Mat4 projection;
-	static thread_local Mat4 modelview;
-	static thread_local Mat3 normal_tranform;
+	static thread_local const Mat4* modelview;
+	static thread_local const Mat3* normal_tranform;
+	static thread_local Mat4 instance_modelview;
+	static thread_local Mat3 instance_normal_tranform;
 };
 
 void Phong::VS::load_uniforms()
 {
-	Transform::model			= get_uniform<Mat4>("transform.model");
-	Transform::view				= get_uniform<Mat4>("transform.view");
-	Transform::projection		= get_uniform<Mat4>("transform.projection");
-	Transform::modelview		= Transform::model * Transform::view;
-	Transform::normal_tranform	= trans::normalTransformMat(Transform::modelview);
+	_projection			= get_uniform(Uniform::transform_projection);
+	_modelview			= get_uniform(Uniform::transform_model) * get_uniform(Uniform::transform_view);
+	_normal_transform	= trans::normalTransformMat(_modelview);
+}
+
+void Phong::VS::begin_batch()
+{
+	Transform::modelview		= &_modelview;
+	Transform::normal_tranform	= &_normal_transform;
+}
+
+void Phong::VS::load_instance(const Instance& instance, size_t /*instance_id*/)
+{
+	Mat4 instance_model;
+	for (int i = 0; i < 4; i++)
+		instance_model[i] = instance.attributes[INST_model + i];
+	Transform::instance_modelview		= instance_model * _modelview;
+	Transform::instance_normal_tranform	= trans::normalTransformMat(Transform::instance_modelview);
+	Transform::modelview				= &Transform::instance_modelview;
+	Transform::normal_tranform			= &Transform::instance_normal_tranform;
 }
 
 void Phong::VS::run(const VSIn& in, VSOut& out)
@@ -28,39 +63,44 @@ void Phong::VS::run(const VSIn& in, VSOut& out)
 	auto& out_normal	= out.out_varying[VARY_normal];
 	auto& out_texcoord	= out.out_varying[VARY_texcoord];
 
-	out.position = vec4(in_position) * Transform::modelview * Transform::projection;
+	out.position = vec4(in_position) * *Transform::modelview * _projection;
 
-	out_position = vec4(in_position) * Transform::modelview;
+	out_position = vec4(in_position) * *Transform::modelview;
 	out_texcoord = vec4(in_texcoord);
-	out_normal = vec4(Transform::normal_tranform * in_normal);
+	out_normal = vec4(*Transform::normal_tranform * in_normal);
 }
 
-static thread_local Vec3 camera_pos;
-static thread_local float gamma;
-static thread_local float exposure;
-namespace Material
+void Phong::VS::run_batch(const VSInBatch& in, VSOutBatch& out)
 {
-	static Color3 color_ambient;
-	static Color3 color_diffuse;
-	static Color3 color_specular;
-	static thread_local TextureSampler texture_ambient0;
-	static thread_local TextureSampler texture_diffuse0;
-	static thread_local TextureSampler texture_specular0;
-};
+	Vec3x8 in_position	= vec3(in.attributes[ATTR_position]);
+	Vec3x8 in_normal	= vec3(in.attributes[ATTR_normal]);
+	Vec2x8 in_texcoord	= vec2(in.attributes[ATTR_texcoord]);
+
+	auto& out_position	= out.out_varying[VARY_position];
+	auto& out_normal	= out.out_varying[VARY_normal];
+	auto& out_texcoord	= out.out_varying[VARY_texcoord];
+
+	out_position = vec4(in_position) * *Transform::modelview;
+	out.position = out_position * _projection;
+
+	out_texcoord = Vec4x8(in_texcoord.x, in_texcoord.y, 0.0f, 1.0f);
+	out_normal = vec4(*Transform::normal_tranform * in_normal);
+}
 
 void Phong::FS::load_uniforms()
 {
-	camera_pos = get_uniform<Vec3>("camera_pos");
-	gamma = get_uniform<float>("gamma", 2.2f);
-	exposure = get_uniform<float>("exposure", 1.0f);
-	Material::color_ambient		= vec3(get_uniform<Color4>("material.color_ambient",  Color::WHITE));
-	Material::color_diffuse     = vec3(get_uniform<Color4>("material.color_diffuse",  Color::WHITE));
-	Material::color_specular    = vec3(get_uniform<Color4>("material.color_specular", Color::WHITE));
-	Material::texture_ambient0  = get_uniform<TextureSampler>("material.texture_ambient0",  TextureSampler(Color::WHITE));
-	Material::texture_diffuse0  = get_uniform<TextureSampler>("material.texture_diffuse0",  TextureSampler(Color::WHITE));
-	Material::texture_specular0 = get_uniform<TextureSampler>("material.texture_specular0", TextureSampler(Color::BLACK));
+	_camera_pos			= get_uniform(Uniform::camera_pos);
+	_gamma				= get_uniform(Uniform::gamma, 2.2f);
+	_exposure			= get_uniform(Uniform::exposure, 1.0f);
+	_color_ambient		= vec3(get_uniform(Uniform::material_color_ambient,  Color::WHITE));
+	_color_diffuse		= vec3(get_uniform(Uniform::material_color_diffuse,  Color::WHITE));
+	_color_specular		= vec3(get_uniform(Uniform::material_color_specular, Color::WHITE));
+	_texture_ambient0	= get_uniform(Uniform::material_texture_ambient0,  TextureSampler(Color::WHITE));
+	_texture_diffuse0	= get_uniform(Uniform::material_texture_diffuse0,  TextureSampler(Color::WHITE));
+	_texture_specular0	= get_uniform(Uniform::material_texture_specular0, TextureSampler(Color::BLACK));
+	_light_grid			= get_uniform(Uniform::light_grid);
 	
-	if (Material::texture_ambient0.empty()) Material::texture_ambient0 = Material::texture_diffuse0;
+	if (_texture_ambient0.empty()) _texture_ambient0 = _texture_diffuse0;
 }
 
 void Phong::FS::run(const FSIn& in, FSOut& out)
@@ -68,27 +108,227 @@ void Phong::FS::run(const FSIn& in, FSOut& out)
 	Vec3 in_position	= vec3(in.in_varying[VARY_position]);
 	Vec3 in_normal		= vec3(in.in_varying[VARY_normal]);
 	Vec2 in_texcoord	= vec2(in.in_varying[VARY_texcoord]);
+	Vec2 ddx_texcoord	= vec2(in.ddx_varying[VARY_texcoord]);
+	Vec2 ddy_texcoord	= vec2(in.ddy_varying[VARY_texcoord]);
 
 	Vec3 light_dir = Vec3(2.0f, 1.0f, 1.0f);
-	Vec3 n = glm::normalize(in_normal);
+	Vec3 n = _fast_math ? fastmath::normalize(in_normal) : glm::normalize(in_normal);
 	Vec3 d = glm::normalize(light_dir);
-	Vec3 h = glm::normalize((camera_pos - in_position + d) * 0.5f);
+	Vec3 h = (_camera_pos - in_position + d) * 0.5f;
+	h = _fast_math ? fastmath::normalize(h) : glm::normalize(h);
 
 	float ambient  = 0.2f;
 	float diffuse  = std::max(0.0f, glm::dot(n, d));
-	float specular = glm::pow(std::max(0.0f, glm::dot(n, h)), 64.0f);
+	float specular = std::max(0.0f, glm::dot(n, h));
+	specular = _fast_math ? fastmath::pow2n(specular, 6) : glm::pow(specular, 64.0f);
+
+	Vec3 ambient_color = vec3(_texture_ambient0.sample(in_texcoord, ddx_texcoord, ddy_texcoord));
+	Vec3 diffuse_color = vec3(_texture_diffuse0.sample(in_texcoord, ddx_texcoord, ddy_texcoord));
+	Vec3 specular_color = vec3(_texture_specular0.sample(in_texcoord, ddx_texcoord, ddy_texcoord));
 
-	Vec3 ambient_color = vec3(Material::texture_ambient0.sample(in_texcoord));
-	Vec3 diffuse_color = vec3(Material::texture_diffuse0.sample(in_texcoord));
-	Vec3 specular_color = vec3(Material::texture_specular0.sample(in_texcoord));
+	Vec3 color = ambient_color  * ambient  * _color_ambient
+			   + diffuse_color  * diffuse  * _color_diffuse
+			   + specular_color * specular * _color_specular;
 
-	Vec3 color = ambient_color  * ambient  * Material::color_ambient
-			   + diffuse_color  * diffuse  * Material::color_diffuse
-			   + specular_color * specular * Material::color_specular;
+	// point lights of the fragment's tile, attenuated to zero at their radius
+	if (_light_grid && _light_grid->tile_count() > 0)
+	{
+		auto& lights = _light_grid->lights();
+		int tile = _light_grid->tile_of(int(in.frag_coord.x), int(in.frag_coord.y));
+		for (uint32_t i : _light_grid->tile_lights(tile))
+		{
+			auto& light = lights[i];
+			Vec3 l = light.position - in_position;
+			float dist2 = glm::dot(l, l);
+			float radius2 = light.radius * light.radius;
+			if (dist2 >= radius2 || dist2 <= 0.0f)
+				continue;
+			float falloff = 1.0f - dist2 / radius2;
+			falloff *= falloff;
 
-	color = glm::pow(color, vec3(1.0f / gamma));
-	if(exposure > 0.0f)
-		color = vec3(1.0f) - glm::exp(-color * exposure);
+			Vec3 lh = (_camera_pos - in_position + l) * 0.5f;
+			l  = _fast_math ? fastmath::normalize(l)  : glm::normalize(l);
+			lh = _fast_math ? fastmath::normalize(lh) : glm::normalize(lh);
+			float light_diffuse  = std::max(0.0f, glm::dot(n, l));
+			float light_specular = fastmath::pow2n(std::max(0.0f, glm::dot(n, lh)), 6);
+
+			color += (diffuse_color  * light_diffuse  * _color_diffuse
+					+ specular_color * light_specular * _color_specular) * light.color * falloff;
+		}
+	}
+
+	if (_fast_math)
+	{
+		color = fastmath::pow(color, 1.0f / _gamma);
+		if (_exposure > 0.0f)
+			color = vec3(1.0f) - fastmath::exp(-color * _exposure);
+	}
+	else
+	{
+		color = glm::pow(color, vec3(1.0f / _gamma));
+		if (_exposure > 0.0f)
+			color = vec3(1.0f) - glm::exp(-color * _exposure);
+	}
 	
 	out.color = vec4(color, 1.0f);
 }
+
+void Phong::FS::run_packet(const FSInPacket& in, FSOutPacket& out)
+{
+	Vec3x8 in_position	= vec3(in.in_varying[VARY_position]);
+	Vec3x8 in_normal	= vec3(in.in_varying[VARY_normal]);
+	Vec2x8 in_texcoord	= vec2(in.in_varying[VARY_texcoord]);
+	Vec2x8 ddx_texcoord	= vec2(in.ddx_varying[VARY_texcoord]);
+	Vec2x8 ddy_texcoord	= vec2(in.ddy_varying[VARY_texcoord]);
+
+	Vec3x8 n = _fast_math ? fastmath::normalize(in_normal) : normalize(in_normal);
+	Vec3x8 d = glm::normalize(Vec3(2.0f, 1.0f, 1.0f));
+	Vec3x8 h = (Vec3x8(_camera_pos) - in_position + d) * 0.5f;
+	h = _fast_math ? fastmath::normalize(h) : normalize(h);
+
+	Float8 ambient  = 0.2f;
+	Float8 diffuse  = max(0.0f, dot(n, d));
+	Float8 specular = pow2n(max(0.0f, dot(n, h)), 6);
+
+	Vec3x8 ambient_color  = vec3(_texture_ambient0.sample(in_texcoord, ddx_texcoord, ddy_texcoord, in.active));
+	Vec3x8 diffuse_color  = vec3(_texture_diffuse0.sample(in_texcoord, ddx_texcoord, ddy_texcoord, in.active));
+	Vec3x8 specular_color = vec3(_texture_specular0.sample(in_texcoord, ddx_texcoord, ddy_texcoord, in.active));
+
+	Vec3x8 color = ambient_color  * ambient  * Vec3x8(_color_ambient)
+				 + diffuse_color  * diffuse  * Vec3x8(_color_diffuse)
+				 + specular_color * specular * Vec3x8(_color_specular);
+
+	// point lights, lanes are grouped by tile and every group loops over its tile's lights
+	if (_light_grid && _light_grid->tile_count() > 0)
+	{
+		auto& lights = _light_grid->lights();
+		alignas(32) float frag_x[SIMD_WIDTH];
+		alignas(32) float frag_y[SIMD_WIDTH];
+		in.frag_coord.x.store(frag_x);
+		in.frag_coord.y.store(frag_y);
+		int tiles[SIMD_WIDTH];
+		for (int lane = 0; lane < SIMD_WIDTH; lane++)
+			tiles[lane] = _light_grid->tile_of(int(frag_x[lane]), int(frag_y[lane]));
+
+		Vec3x8 view = Vec3x8(_camera_pos) - in_position;
+		int pending = movemask(in.active);
+		while (pending)
+		{
+			int first = 0;
+			while (!(pending >> first & 1))
+				first++;
+			int group = 0;
+			for (int lane = first; lane < SIMD_WIDTH; lane++)
+				group |= int((pending >> lane & 1) && tiles[lane] == tiles[first]) << lane;
+			pending &= ~group;
+			Mask8 group_mask = mask8(group);
+
+			for (uint32_t i : _light_grid->tile_lights(tiles[first]))
+			{
+				auto& light = lights[i];
+				Vec3x8 l = Vec3x8(light.position) - in_position;
+				Float8 dist2 = dot(l, l);
+				Float8 radius2 = light.radius * light.radius;
+				Mask8 lit = group_mask & (dist2 < radius2) & (Float8(0.0f) < dist2);
+				if (none(lit))
+					continue;
+				Float8 falloff = Float8(1.0f) - dist2 / radius2;
+				falloff *= falloff;
+
+				Vec3x8 lh = (view + l) * 0.5f;
+				l  = _fast_math ? fastmath::normalize(l)  : normalize(l);
+				lh = _fast_math ? fastmath::normalize(lh) : normalize(lh);
+				Float8 light_diffuse  = max(0.0f, dot(n, l));
+				Float8 light_specular = pow2n(max(0.0f, dot(n, lh)), 6);
+
+				Vec3x8 light_color = (diffuse_color  * light_diffuse  * Vec3x8(_color_diffuse)
+									+ specular_color * light_specular * Vec3x8(_color_specular)) * Vec3x8(light.color) * falloff;
+				color = select(lit, color + light_color, color);
+			}
+		}
+	}
+
+	if (_fast_math)
+	{
+		color = fastmath::pow(color, 1.0f / _gamma);
+		if (_exposure > 0.0f)
+			color = Vec3x8(1.0f) - fastmath::exp(-color * _exposure);
+	}
+	else
+	{
+		color = pow(color, 1.0f / _gamma);
+		if (_exposure > 0.0f)
+			color = Vec3x8(1.0f) - exp(-color * _exposure);
+	}
+
+	out.color = vec4(color, 1.0f);
+	out.discarded = Mask8(0.0f);
+}
+
+void Phong::specialized_draw(RenderDevice& device, FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count)
+{
+	device.draw<VS, FS, VARY_NUM>(framebuffer, vertex_array, instance_buffer, instance_count);
+}
+
+ShaderProgram Phong::ir_program()
+{
+	using namespace ShaderIR;
+
+	static const ShaderProgram program = []
+	{
+		Builder vs(ATTR_NUM, VARY_NUM + 1);
+		{
+			Value3 in_position	= vec3(vs.input(ATTR_position));
+			Value3 in_normal	= vec3(vs.input(ATTR_normal));
+			Value2 in_texcoord	= vec2(vs.input(ATTR_texcoord));
+
+			Value4 out_position = vec4(in_position) * vs.matrix4(Builtin::MODELVIEW);
+			vs.output(0, out_position * vs.matrix4(Builtin::PROJECTION));
+			vs.output(1 + VARY_position, out_position);
+			vs.output(1 + VARY_texcoord, { { in_texcoord[0], in_texcoord[1], vs.constant(0.0f), vs.constant(1.0f) } });
+			vs.output(1 + VARY_normal, vec4(vs.matrix3(Builtin::NORMAL_TRANSFORM) * in_normal));
+		}
+
+		Builder fs(VARY_NUM, 1);
+		{
+			Value3 in_position	= vec3(fs.input(VARY_position));
+			Value3 in_normal	= vec3(fs.input(VARY_normal));
+			Value2 in_texcoord	= vec2(fs.input(VARY_texcoord));
+
+			Value3 camera_pos		= fs.uniform(Uniform::camera_pos);
+			Value gamma				= fs.uniform(Uniform::gamma, 2.2f);
+			Value exposure			= fs.uniform(Uniform::exposure, 1.0f);
+			Value3 color_ambient	= vec3(fs.uniform(Uniform::material_color_ambient,  Color::WHITE));
+			Value3 color_diffuse	= vec3(fs.uniform(Uniform::material_color_diffuse,  Color::WHITE));
+			Value3 color_specular	= vec3(fs.uniform(Uniform::material_color_specular, Color::WHITE));
+			int texture_diffuse0	= fs.sampler(Uniform::material_texture_diffuse0,  TextureSampler(Color::WHITE));
+			int texture_ambient0	= fs.sampler(Uniform::material_texture_ambient0,  TextureSampler(Color::WHITE), texture_diffuse0);
+			int texture_specular0	= fs.sampler(Uniform::material_texture_specular0, TextureSampler(Color::BLACK));
+
+			Value3 n = normalize(in_normal);
+			Value3 d = fs.constant(glm::normalize(Vec3(2.0f, 1.0f, 1.0f)));
+			Value3 h = normalize((camera_pos - in_position + d) * 0.5f);
+
+			Value ambient  = fs.constant(0.2f);
+			Value diffuse  = max(0.0f, dot(n, d));
+			Value specular = pow2n(max(0.0f, dot(n, h)), 6);
+
+			Value3 ambient_color  = vec3(fs.sample(texture_ambient0, in_texcoord));
+			Value3 diffuse_color  = vec3(fs.sample(texture_diffuse0, in_texcoord));
+			Value3 specular_color = vec3(fs.sample(texture_specular0, in_texcoord));
+
+			Value3 color = ambient_color  * ambient  * color_ambient
+						 + diffuse_color  * diffuse  * color_diffuse
+						 + specular_color * specular * color_specular;
+
+			color = pow(color, 1.0f / gamma);
+			color = select(exposure > 0.0f, 1.0f - exp(-color * exposure), color);
+
+			fs.output(0, vec4(color, 1.0f));
+		}
+
+		return make_ir_program(vs.build(), fs.build());
+	}();
+
+	return program;
+}
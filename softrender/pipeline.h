@@ -0,0 +1,542 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+// templated pipeline stages of RenderDevice. the dynamic path instantiates them with the VertexShader and
+// FragmentShader base classes, specialized programs with their final shader classes so the compiler can
+// inline the shaders and unroll the varying loops
+
+#include <array>
+#include <utility>
+#include <algorithm>
+#include "renderdevice.h"
+#include "shader.h"
+#include "framebuffer.h"
+#include "threadpool.h"
+#include "profiler.h"
+
+// rough per-item cost of each parallel stage in nanoseconds, used to size parallel_for chunks
+static constexpr double VS_ITEM_COST		= 40.0;
+static constexpr double RASTER_ITEM_COST	= 1000.0;
+static constexpr double FS_ITEM_COST		= 100.0;
+static constexpr double BIN_ITEM_COST		= 4.0;
+
+// below this many fragments the depth and fragment tests run serially on the calling thread
+static constexpr size_t MIN_BANDED_FRAGMENTS = 16384;
+
+
+template<class VS, class FS, int VARYING_NUM>
+void RenderDevice::draw(FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count)
+{
+	static constexpr auto pipelines = _pipeline_table<VS, FS, VARYING_NUM>(std::make_index_sequence<PIPELINE_PERMUTATION_NUM>());
+	(this->*pipelines[_pipeline_permutation()])(framebuffer, vertex_array, instance_buffer, instance_count);
+}
+
+template<class VS, class FS, int VARYING_NUM, size_t... I>
+constexpr std::array<RenderDevice::Pipeline, sizeof...(I)> RenderDevice::_pipeline_table(std::index_sequence<I...>)
+{
+	return { { &RenderDevice::_run_pipeline<VS, FS, VARYING_NUM, (I / 9 != 0), CullFaceMode(I / 3 % 3), PolygonMode(I % 3)>... } };
+}
+
+template<int VARYING_NUM>
+int RenderDevice::_varying_num() const
+{
+	if constexpr (VARYING_NUM == DYNAMIC_VARYING_NUM)
+		return _shader_program->varying_num;
+	else
+		return VARYING_NUM;
+}
+
+template<class VS, class FS, int VARYING_NUM, bool DEPTH_TEST, CullFaceMode CULL_FACE, PolygonMode POLYGON>
+void RenderDevice::_run_pipeline(FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count)
+{
+	auto& [vertices, indices] = vertex_array;
+
+	if (vertices.empty() || instance_count == 0)
+		return;
+
+	if (indices.empty() && _identity_indices.size() < vertices.size())
+	{
+		size_t ind = _identity_indices.size();
+		_identity_indices.resize(vertices.size());
+		for (; ind < _identity_indices.size(); ind++)
+			_identity_indices[ind] = ind;
+	}
+	const IndexBuffer& index_buffer = indices.empty() ? _identity_indices : indices;
+	size_t index_count = indices.empty() ? vertices.size() : indices.size();
+
+	if (_render_states.viewport.w == 0)
+	{
+		_render_states.viewport.w = framebuffer.width();
+		_render_states.viewport.h = framebuffer.height();
+	}
+
+	{
+		PROFILE_SCOPE("clear buffers")
+		clear_buffers();
+	}
+
+	{
+		PROFILE_SCOPE("load uniforms")
+		_shader_program->vertex_shader->update_uniforms();
+		_shader_program->fragment_shader->update_uniforms();
+	}
+		
+	_run_vertex_shader<VS, VARYING_NUM>(vertices, instance_buffer, instance_count);
+	
+	switch (_render_states.primitive_mode)
+	{
+	case PrimitiveMode::POINTS:
+		_assemble_points(index_buffer, index_count, vertices.size(), instance_count);
+		_clipping_points();
+		_to_viewport();
+		_rasterize_points();
+		break;
+
+	case PrimitiveMode::LINES:
+	case PrimitiveMode::LINE_STRIPE:
+	case PrimitiveMode::LINE_LOOP:
+		_assemble_lines(index_buffer, index_count, vertices.size(), instance_count);
+		_clipping_lines();
+		_to_viewport();
+		_rasterize_lines();
+		break;
+
+	case PrimitiveMode::TRIANGLES:
+	case PrimitiveMode::TRIANGLE_STRIPE:
+	case PrimitiveMode::TRIANGLE_FAN:
+	case PrimitiveMode::QUADS:
+		_assemble_triangles(index_buffer, index_count, vertices.size(), instance_count);
+		_clipping_triangles();
+		_to_viewport();
+		_face_culling<CULL_FACE>();
+		_rasterize_triangles<POLYGON>();
+		break;
+	}
+
+	_bin_fragments(framebuffer);
+
+	DepthTestStage depth_stage = _depth_test_stage();
+
+	_early_z_test<DEPTH_TEST>(framebuffer, depth_stage);
+
+	_run_fragment_shader<FS, VARYING_NUM>();
+
+	_fragment_test<DEPTH_TEST>(framebuffer, depth_stage);
+
+	_post_processing(framebuffer);
+}
+
+
+template<class VS, int VARYING_NUM>
+void RenderDevice::_run_vertex_shader(const VertexBuffer& vertices, const InstanceBuffer* instance_buffer, size_t instance_count)
+{
+	PROFILE_SCOPE("run vs")
+	assert(_shader_program->vertex_shader);
+	VS* vs = static_cast<VS*>(_shader_program->vertex_shader.get());
+
+	size_t vertex_count = vertices.size();
+	size_t total = vertex_count * instance_count;
+
+	_vsout_buffer.resize(total);
+
+	int batch_attribute_num = vs->batch_attribute_num();
+	int varying_num = _varying_num<VARYING_NUM>();
+
+	// vertices [first, first + n) of the buffer go to _vsout_buffer[k...], transposed to SoA for run_batch
+	auto run_vs_batched = [vs, this, &vertices, batch_attribute_num, varying_num](size_t first, size_t n, size_t k)
+	{
+		alignas(32) float lanes[4][SIMD_WIDTH];
+		std::vector<Vec4x8> varyings(varying_num);
+		VSInBatch in;
+		VSOutBatch out;
+		out.out_varying = varyings.data();
+		out.varying_num = varying_num;
+		for (size_t base = 0; base < n; base += VS_BATCH_SIZE)
+		{
+			size_t lane_count = std::min<size_t>(VS_BATCH_SIZE, n - base);
+			for (int a = 0; a < batch_attribute_num; a++)
+			{
+				for (size_t lane = 0; lane < VS_BATCH_SIZE; lane++)
+				{
+					// lanes past the end repeat the last vertex and are not written back
+					auto& attribute = vertices[first + base + std::min(lane, lane_count - 1)].attributes[a];
+					for (int c = 0; c < 4; c++)
+						lanes[c][lane] = attribute[c];
+				}
+				for (int c = 0; c < 4; c++)
+					in.attributes[a][c] = Float8::load(lanes[c]);
+			}
+
+			vs->run_batch(in, out);
+
+			for (int c = 0; c < 4; c++)
+			{
+				out.position[c].store(lanes[c]);
+				for (size_t lane = 0; lane < lane_count; lane++)
+					_vsout_buffer[k + base + lane][0][c] = lanes[c][lane];
+			}
+			for (int v = 0; v < varying_num; v++)
+			{
+				for (int c = 0; c < 4; c++)
+				{
+					out.out_varying[v][c].store(lanes[c]);
+					for (size_t lane = 0; lane < lane_count; lane++)
+						_vsout_buffer[k + base + lane][1 + v][c] = lanes[c][lane];
+				}
+			}
+		}
+	};
+
+	auto run_vs = [vs, this, &vertices, instance_buffer, vertex_count, batch_attribute_num, &run_vs_batched](size_t l, size_t r)
+	{
+		// instance attributes 0-3 conventionally hold the model matrix, an empty buffer leaves the model as is
+		static const Instance identity_instance = { { Vec4(1, 0, 0, 0), Vec4(0, 1, 0, 0), Vec4(0, 0, 1, 0), Vec4(0, 0, 0, 1) } };
+		vs->begin_batch();
+		size_t instance_id = l / vertex_count;
+		size_t i = l % vertex_count;
+		for (size_t k = l; k < r; instance_id++, i = 0)
+		{
+			if (instance_buffer)
+			{
+				auto& instance = instance_buffer->empty() ? identity_instance : (*instance_buffer)[instance_id];
+				vs->load_instance(instance, instance_id);
+			}
+			if (batch_attribute_num > 0)
+			{
+				size_t n = std::min(vertex_count - i, r - k);
+				run_vs_batched(i, n, k);
+				i += n;
+				k += n;
+			}
+			for (; i < vertex_count && k < r; i++, k++)
+			{
+				VSOut result(_vsout_buffer[k]);
+				vs->run(vertices[i], result);
+			}
+		}
+	};
+
+	_thread_pool->parallel_for(0, total, ThreadPool::grain_size(VS_ITEM_COST), run_vs, _task_queue);
+}
+
+template<CullFaceMode CULL_FACE>
+void RenderDevice::_face_culling()
+{
+	PROFILE_SCOPE("face culling")
+	if constexpr (CULL_FACE != CullFaceMode::NONE)
+	{
+		auto order = _render_states.front_vertex_order;
+		if constexpr (CULL_FACE == CullFaceMode::BACK)
+			order = order == FrontVertexOrder::CLOCKWISE ? FrontVertexOrder::COUNTER_CLOCKWISE : FrontVertexOrder::CLOCKWISE;
+		for (auto& triangle : _triangle_buffer)
+		{
+			if (triangle.culled) continue;
+			auto& v0 = _vsout_buffer[triangle.v[0]][0];
+			auto& v1 = _vsout_buffer[triangle.v[1]][0];
+			auto& v2 = _vsout_buffer[triangle.v[2]][0];
+			auto d1 = vec2(v1 - v0);
+			auto d2 = vec2(v2 - v1);
+			float s = d1.x * d2.y - d1.y * d2.x;
+			if ((order == FrontVertexOrder::CLOCKWISE && s < 0.0f)
+				|| (order == FrontVertexOrder::COUNTER_CLOCKWISE && s > 0.0f))
+			{
+				triangle.culled = true;
+			}
+		}
+	}
+}
+
+template<PolygonMode POLYGON>
+void RenderDevice::_rasterize_triangles()
+{
+	PROFILE_SCOPE("rasterize triangles")
+
+	bool gradients = _shader_program->fragment_shader->uses_derivatives();
+	if (gradients)
+		_gradient_buffer.resize(_triangle_buffer.size());
+
+	auto rasterize = [this, gradients](size_t l, size_t r, size_t chunk) {
+		
+		auto& fsin_buffer = _thread_fsin_buffer[chunk];
+		auto& fragment_buffer = _thread_fragment_buffer[chunk];
+		fsin_buffer.reset(_fsin_buffer.stride());
+		fragment_buffer.clear();
+		
+		for(size_t i = l; i < r; i++)
+		{
+			auto& triangle = _triangle_buffer[i];
+			if (triangle.culled) continue;
+
+			const Vec4* v0 = _vsout_buffer[triangle.v[0]];
+			const Vec4* v1 = _vsout_buffer[triangle.v[1]];
+			const Vec4* v2 = _vsout_buffer[triangle.v[2]];
+
+			if constexpr (POLYGON == PolygonMode::POINTED)
+			{
+				draw_point(v0, fsin_buffer, fragment_buffer);
+				draw_point(v1, fsin_buffer, fragment_buffer);
+				draw_point(v2, fsin_buffer, fragment_buffer);
+			}
+			else if constexpr (POLYGON == PolygonMode::WIREFRAME)
+			{
+				draw_line(v0, v1, fsin_buffer, fragment_buffer);
+				draw_line(v1, v2, fsin_buffer, fragment_buffer);
+				draw_line(v2, v0, fsin_buffer, fragment_buffer);
+			}
+			else if (gradients)
+			{
+				triangle_gradients(v0, v1, v2, _gradient_buffer[i]);
+				draw_triangle(v0, v1, v2, fsin_buffer, fragment_buffer, uint32_t(i));
+			}
+			else
+			{
+				draw_triangle(v0, v1, v2, fsin_buffer, fragment_buffer);
+			}
+		}
+	};
+
+	// chunk_count is 1 even for no triangles, that chunk's buffers would still hold the last draw's fragments
+	if (_triangle_buffer.empty())
+		return;
+
+	size_t grain = ThreadPool::grain_size(RASTER_ITEM_COST);
+	size_t chunk_count = _thread_pool->chunk_count(_triangle_buffer.size(), grain);
+
+	if (_thread_fsin_buffer.size() < chunk_count)
+	{
+		_thread_fsin_buffer.resize(chunk_count);
+		_thread_fragment_buffer.resize(chunk_count);
+	}
+
+	_thread_pool->parallel_for(0, _triangle_buffer.size(), grain, rasterize, _task_queue);
+
+	// merge in chunk order so the fragment order does not depend on scheduling
+	std::vector<size_t> offsets(chunk_count + 1, _fragment_buffer.size());
+	for (size_t i = 0; i < chunk_count; i++)
+		offsets[i + 1] = offsets[i] + _thread_fragment_buffer[i].size();
+	_fsin_buffer.resize(offsets[chunk_count]);
+	_fragment_buffer.resize(offsets[chunk_count]);
+
+	_thread_pool->parallel_for(0, chunk_count, 1, [this, &offsets](size_t l, size_t r) {
+		for (size_t i = l; i < r; i++)
+		{
+			_fsin_buffer.copy_from(_thread_fsin_buffer[i], offsets[i]);
+			std::copy(_thread_fragment_buffer[i].begin(), _thread_fragment_buffer[i].end(), _fragment_buffer.begin() + offsets[i]);
+		}
+	}, _task_queue);
+}
+
+template<class F>
+void RenderDevice::_for_each_band(FrameBuffer& framebuffer, F&& fn)
+{
+	if (!_is_banded)
+	{
+		for (auto& fragment : _fragment_buffer)
+			if (fragment.x >= 0 && fragment.y >= 0 && fragment.x < framebuffer.width() && fragment.y < framebuffer.height())
+				fn(fragment);
+		return;
+	}
+
+	// every band is touched only by the worker owning it, fragments outside the framebuffer are never visited
+	_thread_pool->for_each_region(framebuffer.band_count(), [&](size_t band) {
+		for (uint32_t i = _band_offsets[band]; i < _band_offsets[band + 1]; i++)
+			fn(_fragment_buffer[_band_fragments[i]]);
+	}, _task_queue);
+}
+
+template<bool DEPTH_TEST>
+void RenderDevice::_early_z_test(FrameBuffer& framebuffer, DepthTestStage stage)
+{
+	PROFILE_SCOPE("early z test")
+	if (DEPTH_TEST && stage != DepthTestStage::LATE)
+	{
+		assert(framebuffer.depth_format() != FrameBuffer::DepthFormat::None);
+		// depth only ever decreases, a fragment failing now fails after shading too
+		bool write_depth = stage == DepthTestStage::EARLY && !_render_states.depth_mask;
+		_for_each_band(framebuffer, [&](Fragment& fragment) {
+			int x = fragment.x;
+			int y = fragment.y;
+			if (fragment.depth <= framebuffer.get_depth(x, y))
+			{
+				if (write_depth)
+					framebuffer.set_depth(x, y, fragment.depth);
+			}
+			else
+				fragment.discarded = true;
+		});
+	}
+}
+
+template<class FS, int VARYING_NUM>
+void RenderDevice::_run_fragment_shader()
+{
+	PROFILE_SCOPE("run fs")
+	
+	assert(_shader_program->fragment_shader);
+	FS* fs = static_cast<FS*>(_shader_program->fragment_shader.get());
+	int varying_num = _varying_num<VARYING_NUM>();
+	bool writes_depth = fs->writes_depth();
+	bool derivatives = fs->uses_derivatives();
+	
+	auto run_fs = [this, fs, varying_num, writes_depth, derivatives](size_t l, size_t r)
+	{
+		std::vector<Vec4> ddx(derivatives ? varying_num : 0);
+		std::vector<Vec4> ddy(derivatives ? varying_num : 0);
+		for (size_t i = l; i < r; i++) 
+		{
+			Vec4* varying = _fsin_buffer[i];
+			auto& fragment = _fragment_buffer[i];
+			if (fragment.discarded)
+				continue;
+			FSOut result;
+			result.depth = fragment.depth;
+			FSIn in(varying, Vec2(fragment.x + 0.5f, fragment.y + 0.5f));
+			if (derivatives)
+			{
+				varying_derivatives(fragment, varying, ddx.data(), ddy.data());
+				in.ddx_varying = ddx.data();
+				in.ddy_varying = ddy.data();
+			}
+			for (int j = 0; j < varying_num; j++)
+				varying[j] /= fragment.inv_w;
+			fs->run(in, result);
+			fragment.color = result.color;
+			fragment.discarded |= result.discarded;
+			if (writes_depth)
+				fragment.depth = result.depth;
+		}
+	};
+	
+	// fragments already rejected by early z stay inactive, lanes past the end repeat the last fragment
+	auto run_fs_packets = [this, fs, varying_num, writes_depth, derivatives](size_t l, size_t r)
+	{
+		alignas(32) float lanes[4][SIMD_WIDTH];
+		alignas(32) float inv_w[SIMD_WIDTH];
+		alignas(32) float depth[SIMD_WIDTH];
+		alignas(32) float frag_x[SIMD_WIDTH];
+		alignas(32) float frag_y[SIMD_WIDTH];
+		std::vector<Vec4x8> varyings(varying_num);
+		FSInPacket in;
+		FSOutPacket out;
+		in.in_varying = varyings.data();
+		in.varying_num = varying_num;
+		// per lane derivatives transposed into SoA
+		std::vector<Vec4> lane_ddx(derivatives ? varying_num * FS_PACKET_SIZE : 0);
+		std::vector<Vec4> lane_ddy(derivatives ? varying_num * FS_PACKET_SIZE : 0);
+		std::vector<Vec4x8> ddx(derivatives ? varying_num : 0);
+		std::vector<Vec4x8> ddy(derivatives ? varying_num : 0);
+		if (derivatives)
+		{
+			in.ddx_varying = ddx.data();
+			in.ddy_varying = ddy.data();
+		}
+		for (size_t base = l; base < r; base += FS_PACKET_SIZE)
+		{
+			size_t lane_count = std::min<size_t>(FS_PACKET_SIZE, r - base);
+			int active = 0;
+			for (size_t lane = 0; lane < FS_PACKET_SIZE; lane++)
+			{
+				auto& fragment = _fragment_buffer[base + std::min(lane, lane_count - 1)];
+				inv_w[lane] = fragment.inv_w;
+				depth[lane] = fragment.depth;
+				frag_x[lane] = fragment.x + 0.5f;
+				frag_y[lane] = fragment.y + 0.5f;
+				active |= int(lane < lane_count && !fragment.discarded) << lane;
+			}
+			if (!active)
+				continue;
+
+			Float8 w = Float8(1.0f) / Float8::load(inv_w);
+			for (int v = 0; v < varying_num; v++)
+			{
+				for (size_t lane = 0; lane < FS_PACKET_SIZE; lane++)
+				{
+					auto& varying = _fsin_buffer[base + std::min(lane, lane_count - 1)][v];
+					for (int c = 0; c < 4; c++)
+						lanes[c][lane] = varying[c];
+				}
+				for (int c = 0; c < 4; c++)
+					varyings[v][c] = Float8::load(lanes[c]) * w;
+			}
+			if (derivatives)
+			{
+				for (size_t lane = 0; lane < FS_PACKET_SIZE; lane++)
+				{
+					size_t i = base + std::min(lane, lane_count - 1);
+					varying_derivatives(_fragment_buffer[i], _fsin_buffer[i], &lane_ddx[lane * varying_num], &lane_ddy[lane * varying_num]);
+				}
+				for (int v = 0; v < varying_num; v++)
+				{
+					for (int c = 0; c < 4; c++)
+					{
+						for (size_t lane = 0; lane < FS_PACKET_SIZE; lane++)
+							lanes[c][lane] = lane_ddx[lane * varying_num + v][c];
+						ddx[v][c] = Float8::load(lanes[c]);
+						for (size_t lane = 0; lane < FS_PACKET_SIZE; lane++)
+							lanes[c][lane] = lane_ddy[lane * varying_num + v][c];
+						ddy[v][c] = Float8::load(lanes[c]);
+					}
+				}
+			}
+			in.frag_coord = Vec2x8(Float8::load(frag_x), Float8::load(frag_y));
+			in.active = mask8(active);
+			out.depth = Float8::load(depth);
+
+			fs->run_packet(in, out);
+
+			int discarded = movemask(out.discarded);
+			for (int c = 0; c < 4; c++)
+			{
+				out.color[c].store(lanes[c]);
+				for (size_t lane = 0; lane < lane_count; lane++)
+					_fragment_buffer[base + lane].color[c] = lanes[c][lane];
+			}
+			for (size_t lane = 0; lane < lane_count; lane++)
+				_fragment_buffer[base + lane].discarded |= bool(discarded >> lane & 1);
+			if (writes_depth)
+			{
+				out.depth.store(depth);
+				for (size_t lane = 0; lane < lane_count; lane++)
+					_fragment_buffer[base + lane].depth = depth[lane];
+			}
+		}
+	};
+
+	size_t grain = ThreadPool::grain_size(FS_ITEM_COST);
+	if (fs->supports_packet())
+		_thread_pool->parallel_for(0, _fragment_buffer.size(), std::max<size_t>(grain, FS_PACKET_SIZE), run_fs_packets, _task_queue);
+	else
+		_thread_pool->parallel_for(0, _fragment_buffer.size(), grain, run_fs, _task_queue);
+}
+
+template<bool DEPTH_TEST>
+void RenderDevice::_fragment_test(FrameBuffer& framebuffer, DepthTestStage stage)
+{
+	PROFILE_SCOPE("fragment test")
+	_for_each_band(framebuffer, [&](Fragment& fragment) {
+		if (fragment.discarded) return;
+
+		if (_render_states.alpha_test)
+			if (fragment.color.a < _render_states.alpha_test_threshold)
+				return;
+
+		if (DEPTH_TEST && stage != DepthTestStage::EARLY)
+		{
+			assert(framebuffer.depth_format() != FrameBuffer::DepthFormat::None);
+			if (fragment.depth <= framebuffer.get_depth(fragment.x, fragment.y))
+			{
+				if (!_render_states.depth_mask)
+					framebuffer.set_depth(fragment.x, fragment.y, fragment.depth);
+				if (!_render_states.color_mask)
+					framebuffer.set_color(fragment.x, fragment.y, fragment.color);
+			}
+		}
+		else
+		{
+			if (!_render_states.color_mask)
+				framebuffer.set_color(fragment.x, fragment.y, fragment.color);
+		}
+	});
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <unordered_map>
 #include <sstream>
 #include <iomanip>
+#include <mutex>
 
 class Profiler
 {
@@ -27,6 +28,7 @@ public:
 		if (!_stoped)
 		{
 			auto delta = get_time() - _current_start_time;
+			std::lock_guard<std::mutex> lk(_mtx);
 			switch (_mode)
 			{
 			case Profiler::Mode::OVERRIDE:
@@ -48,6 +50,7 @@ public:
 
 	static double get(std::string_view name)
 	{
+		std::lock_guard<std::mutex> lk(_mtx);
 		auto& p = _times.find(name.data())->second;
 		return p.first / p.second;
 	}
@@ -58,8 +61,11 @@ public:
 		out << std::fixed << std::setprecision(7);
 		std::vector<std::pair<std::string, double>> times;
 		size_t max_len = 0;
-		for (auto& [name, p] : _times)
-			times.emplace_back(name, get(name)), max_len = std::max(max_len, name.size());
+		{
+			std::lock_guard<std::mutex> lk(_mtx);
+			for (auto& [name, p] : _times)
+				times.emplace_back(name, p.first / p.second), max_len = std::max(max_len, name.size());
+		}
 		if(sorted_by_length)
 			std::sort(times.begin(), times.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
 		for (auto [name, time] : times)
@@ -82,6 +88,7 @@ public:
 
 	static void clear()
 	{
+		std::lock_guard<std::mutex> lk(_mtx);
 		_times.clear();
 	}
 
@@ -96,6 +103,9 @@ private:
 	inline static std::unordered_map<std::string, std::pair<double, int>> _times;
 
 	inline static Mode _mode = Mode::OVERRIDE;
+
+	// devices may render on several threads at once
+	inline static std::mutex _mtx;
 		
 };
 
@@ -3,26 +3,36 @@
 #include "framebuffer.h"
 #include "threadpool.h"
 #include "profiler.h"
+#include "pipeline.h"
 #include <algorithm>
 
 
-RenderDevice::RenderDevice()
+RenderDevice::RenderDevice() : RenderDevice(ThreadPool::shared())
 {
-	_thread_pool = std::make_unique<FixedThreadPool>(std::thread::hardware_concurrency());
 }
 
-RenderDevice::~RenderDevice()
+RenderDevice::RenderDevice(std::shared_ptr<ThreadPool> thread_pool)
 {
+	_thread_pool = std::move(thread_pool);
+	_task_queue = _thread_pool->create_queue();
+}
 
+RenderDevice::~RenderDevice()
+{
+	_thread_pool->release_queue(_task_queue);
 }
 
 void RenderDevice::set_shader_program(const ShaderProgram& program)
 {
 	assert(program.vertex_shader && program.fragment_shader);
-	assert(program.varying_num <= MAX_VARYING_NUM);
+	assert(program.varying_num >= 0);
 	*_shader_program = program;
+	_shader_program->vertex_shader = program.vertex_shader->clone();
+	_shader_program->fragment_shader = program.fragment_shader->clone();
 	_shader_program->vertex_shader->set_device(shared_from_this());
 	_shader_program->fragment_shader->set_device(shared_from_this());
+	_shader_program->vertex_shader->compile();
+	_shader_program->fragment_shader->compile();
 }
 
 ShaderProgram& RenderDevice::shader_program()
@@ -51,164 +61,134 @@ const RenderStates& RenderDevice::render_states() const
 	return _render_states;
 }
 
-
-void RenderDevice::draw(FrameBuffer& framebuffer, VertexArray vertex_array)
+TextureTable& RenderDevice::texture_table()
 {
-	auto& [vertices, indices] = vertex_array;
-
-	if (indices.empty() && vertices.size()) {
-		indices.resize(vertices.size());
-		int ind = 0;
-		for (auto& x : indices) x = ind++;
-	}
-	if (_render_states.viewport.w == 0)
-	{
-		_render_states.viewport.w = framebuffer.width();
-		_render_states.viewport.h = framebuffer.height();
-	}
-
-	{
-		PROFILE_SCOPE("clear buffers")
-		clear_buffers();
-	}
-		
-	_run_vertex_shader(vertices);
-	
-	switch (_render_states.primitive_mode)
-	{
-	case PrimitiveMode::POINTS:
-		_assemble_points(indices);
-		_clipping_points();
-		_to_viewport();
-		_rasterize_points();
-		break;
-
-	case PrimitiveMode::LINES:
-	case PrimitiveMode::LINE_STRIPE:
-	case PrimitiveMode::LINE_LOOP:
-		_assemble_lines(indices);
-		_clipping_lines();
-		_to_viewport();
-		_rasterize_lines();
-		break;
-
-	case PrimitiveMode::TRIANGLES:
-	case PrimitiveMode::TRIANGLE_STRIPE:
-	case PrimitiveMode::TRIANGLE_FAN:
-	case PrimitiveMode::QUADS:
-		_assemble_triangles(indices);
-		_clipping_triangles();
-		_to_viewport();
-		_face_culling();
-		_rasterize_triangles();
-		break;
-	}
-
-	_early_z_test(framebuffer);
-	 
-	_run_fragment_shader();
-
-	_fragment_test(framebuffer);
-
-	_post_processing(framebuffer);
-			
+	return _texture_table;
 }
 
+const TextureTable& RenderDevice::texture_table() const
+{
+	return _texture_table;
+}
 
-void RenderDevice::_run_vertex_shader(const VertexBuffer& vertices)
+const std::shared_ptr<ThreadPool>& RenderDevice::thread_pool() const
 {
-	PROFILE_SCOPE("run vs")
-	assert(_shader_program->vertex_shader);
-	auto vs = _shader_program->vertex_shader;
+	return _thread_pool;
+}
 
-	int batch_count = _thread_pool->thread_count();
-	int batch_size = vertices.size() / batch_count;
 
-	_vsout_buffer.resize(vertices.size());
+void RenderDevice::draw(FrameBuffer& framebuffer, const VertexArray& vertex_array)
+{
+	_draw(framebuffer, vertex_array, nullptr, 1);
+}
 
-	auto run_vs = [vs, this, &vertices](int l, int r)
-	{
-		vs->load_uniforms();
-		for(int i = l; i < r; i++)
-		{
-			VSOut result;
-			vs->run(vertices[i], result);
-			_vsout_buffer[i] = result;
-		}
-	};
+void RenderDevice::draw_instanced(FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer& instance_buffer, size_t count)
+{
+	assert(instance_buffer.empty() || instance_buffer.size() >= count);
+	if (!instance_buffer.empty())
+		count = std::min(count, instance_buffer.size());
+	_draw(framebuffer, vertex_array, &instance_buffer, count);
+}
 
+void RenderDevice::build_light_grid(LightGrid& grid, const std::vector<PointLight>& lights, FrameBuffer& framebuffer, const Mat4& projection)
+{
+	PROFILE_SCOPE("light culling")
+	Viewport viewport = _render_states.viewport;
+	if (viewport.w == 0)
 	{
-		static std::vector<std::future<void>> futs;
-		futs.clear();
-		for (int i = 0, l = 0, r = 0; i < batch_count; i++, l = r)
-		{
-			r += get_batch_size(vertices.size(), batch_count, i);
-			futs.push_back(_thread_pool->execute(std::bind(run_vs, l, r)));
-		}
-		for (auto&& fut : futs)
-			fut.wait();
+		viewport.w = framebuffer.width();
+		viewport.h = framebuffer.height();
 	}
+	grid.build(lights, framebuffer, viewport, projection, _thread_pool.get(), _task_queue);
 }
 
-void RenderDevice::_assemble_points(const IndexBuffer& indices)
+RenderDevice::DepthTestStage RenderDevice::_depth_test_stage() const
 {
-	PROFILE_SCOPE("assemble points")
-	for (size_t i = 0; i < indices.size(); i++)
-		add_point(indices[i]);
+	auto& fs = *_shader_program->fragment_shader;
+	if (!_render_states.eary_z_test || fs.writes_depth())
+		return DepthTestStage::LATE;
+	// fragments rejected after shading must not have written depth
+	if (fs.may_discard() || _render_states.alpha_test)
+		return DepthTestStage::HYBRID;
+	return DepthTestStage::EARLY;
 }
 
-void RenderDevice::_assemble_lines(const IndexBuffer& indices)
+void RenderDevice::_draw(FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count)
 {
-	PROFILE_SCOPE("assemble lines")
-	if (_render_states.primitive_mode == PrimitiveMode::LINES)
-	{
-		for(size_t i = 0; i + 1 < indices.size(); i += 2)
-			add_line(indices[i], indices[i + 1]);
-	}
-	else if (_render_states.primitive_mode == PrimitiveMode::LINE_STRIPE)
+	if (_shader_program->specialized_draw)
+		_shader_program->specialized_draw(*this, framebuffer, vertex_array, instance_buffer, instance_count);
+	else
+		draw<VertexShader, FragmentShader, DYNAMIC_VARYING_NUM>(framebuffer, vertex_array, instance_buffer, instance_count);
+}
+
+void RenderDevice::_assemble_points(const IndexBuffer& indices, size_t count, size_t vertex_count, size_t instance_count)
+{
+	PROFILE_SCOPE("assemble points")
+	for (size_t base = 0; base < vertex_count * instance_count; base += vertex_count)
 	{
-		if(indices.size() >= 2)
-			add_line(indices[0], indices[1]);
-		for (size_t i = 2; i < indices.size(); i++)
-			add_line(indices[i - 1], indices[i]);
+		for (size_t i = 0; i < count; i++)
+			add_point(base + indices[i]);
 	}
-	else if (_render_states.primitive_mode == PrimitiveMode::LINE_LOOP)
+}
+
+void RenderDevice::_assemble_lines(const IndexBuffer& indices, size_t count, size_t vertex_count, size_t instance_count)
+{
+	PROFILE_SCOPE("assemble lines")
+	for (size_t base = 0; base < vertex_count * instance_count; base += vertex_count)
 	{
-		for (size_t i = 0; i < indices.size(); i++)
-			add_line(indices[i], indices[(i + 1) % indices.size()]);
+		if (_render_states.primitive_mode == PrimitiveMode::LINES)
+		{
+			for(size_t i = 0; i + 1 < count; i += 2)
+				add_line(base + indices[i], base + indices[i + 1]);
+		}
+		else if (_render_states.primitive_mode == PrimitiveMode::LINE_STRIPE)
+		{
+			if(count >= 2)
+				add_line(base + indices[0], base + indices[1]);
+			for (size_t i = 2; i < count; i++)
+				add_line(base + indices[i - 1], base + indices[i]);
+		}
+		else if (_render_states.primitive_mode == PrimitiveMode::LINE_LOOP)
+		{
+			for (size_t i = 0; i < count; i++)
+				add_line(base + indices[i], base + indices[(i + 1) % count]);
+		}
 	}
 }
 
-void RenderDevice::_assemble_triangles(const IndexBuffer& indices)
+void RenderDevice::_assemble_triangles(const IndexBuffer& indices, size_t count, size_t vertex_count, size_t instance_count)
 {
 	PROFILE_SCOPE("assemble triangles")
-	if (_render_states.primitive_mode == PrimitiveMode::TRIANGLES)
+	for (size_t base = 0; base < vertex_count * instance_count; base += vertex_count)
 	{
-		for(size_t i = 0; i + 2 < indices.size(); i += 3)
-			add_triangle(indices[i], indices[i + 1], indices[i + 2]);
-	}
-	else if(_render_states.primitive_mode == PrimitiveMode::TRIANGLE_STRIPE)
-	{
-		if(indices.size() >= 3)
-			add_triangle(indices[0], indices[1], indices[2]);
-		for (size_t i = 3; i < indices.size(); i += 2)
+		if (_render_states.primitive_mode == PrimitiveMode::TRIANGLES)
 		{
-			add_triangle(indices[i - 2], indices[i - 1], indices[i]);
-			if (i & 1)
-				_triangle_buffer.back().reverse_order();
+			for(size_t i = 0; i + 2 < count; i += 3)
+				add_triangle(base + indices[i], base + indices[i + 1], base + indices[i + 2]);
 		}
-	}
-	else if (_render_states.primitive_mode == PrimitiveMode::TRIANGLE_FAN)
-	{
-		for(size_t i = 0; i + 1 < indices.size(); i++)
-			add_triangle(indices[0], indices[i + 1], indices[i + 2]);
-	}
-	else if (_render_states.primitive_mode == PrimitiveMode::QUADS)
-	{
-		for (size_t i = 0; i + 3 < indices.size(); i += 4)
+		else if(_render_states.primitive_mode == PrimitiveMode::TRIANGLE_STRIPE)
 		{
-			add_triangle(indices[i], indices[i + 1], indices[i + 2]);
-			add_triangle(indices[i], indices[i + 2], indices[i + 3]);
+			if(count >= 3)
+				add_triangle(base + indices[0], base + indices[1], base + indices[2]);
+			for (size_t i = 3; i < count; i += 2)
+			{
+				add_triangle(base + indices[i - 2], base + indices[i - 1], base + indices[i]);
+				if (i & 1)
+					_triangle_buffer.back().reverse_order();
+			}
+		}
+		else if (_render_states.primitive_mode == PrimitiveMode::TRIANGLE_FAN)
+		{
+			for(size_t i = 0; i + 2 < count; i++)
+				add_triangle(base + indices[0], base + indices[i + 1], base + indices[i + 2]);
+		}
+		else if (_render_states.primitive_mode == PrimitiveMode::QUADS)
+		{
+			for (size_t i = 0; i + 3 < count; i += 4)
+			{
+				add_triangle(base + indices[i], base + indices[i + 1], base + indices[i + 2]);
+				add_triangle(base + indices[i], base + indices[i + 2], base + indices[i + 3]);
+			}
 		}
 	}
 }
@@ -218,11 +198,11 @@ void RenderDevice::_clipping_points()
 	PROFILE_SCOPE("clipping points")
 	for (auto& point : _point_buffer)
 	{
-		auto& p = point.v;
-		float w = p.position.w;
-		if (p.position.x <= -w || p.position.x >= w
-			|| p.position.y <= -w || p.position.y >= w
-			|| p.position.z <= 0 || p.position.z >= w)
+		const Vec4& p = _vsout_buffer[point.v][0];
+		float w = p.w;
+		if (p.x <= -w || p.x >= w
+			|| p.y <= -w || p.y >= w
+			|| p.z <= 0 || p.z >= w)
 			point.culled = true;
 	}
 }
@@ -249,43 +229,12 @@ void RenderDevice::_clipping_triangles()
 	clip_triangles_by_plane(ClipPlane::FAR);
 }
 
-void RenderDevice::_face_culling()
-{
-	PROFILE_SCOPE("face culling")
-	if (_render_states.cull_face_mode != CullFaceMode::NONE)
-	{
-		auto order = _render_states.front_vertex_order;
-		if (_render_states.cull_face_mode == CullFaceMode::BACK)
-			order = order == FrontVertexOrder::CLOCKWISE ? FrontVertexOrder::COUNTER_CLOCKWISE : FrontVertexOrder::CLOCKWISE;
-		for (auto& triangle : _triangle_buffer)
-		{
-			if (triangle.culled) continue;
-			auto& v0 = triangle.v[0];
-			auto& v1 = triangle.v[1];
-			auto& v2 = triangle.v[2];
-			auto d1 = vec2(v1.position - v0.position);
-			auto d2 = vec2(v2.position - v1.position);
-			float s = d1.x * d2.y - d1.y * d2.x;
-			if (order == FrontVertexOrder::CLOCKWISE && s < 0.0f
-				|| order == FrontVertexOrder::COUNTER_CLOCKWISE && s > 0.0f)
-			{
-				triangle.culled = true;
-			}
-		}
-	}
-}
-
 void RenderDevice::_to_viewport()
 {
 	PROFILE_SCOPE("to viewport")
-	for (auto& point : _point_buffer)
-		vsout_to_viewport(point.v);
-	for (auto& line : _line_buffer)
-		for (int i = 0; i < 2; i++)
-			vsout_to_viewport(line.v[i]);
-	for (auto& triangle : _triangle_buffer)
-		for (int i = 0; i < 3; i++)
-			vsout_to_viewport(triangle.v[i]);
+	// primitives share their vertices, so every vertex is transformed once
+	for (size_t i = 0; i < _vsout_buffer.size(); i++)
+		vsout_to_viewport(_vsout_buffer[i]);
 }
 
 void RenderDevice::_rasterize_points()
@@ -294,7 +243,7 @@ void RenderDevice::_rasterize_points()
 	for (auto& point : _point_buffer)
 	{
 		if (point.culled) continue;
-		draw_point(point.v, _fsin_buffer, _fragment_buffer);
+		draw_point(_vsout_buffer[point.v], _fsin_buffer, _fragment_buffer);
 	}
 }
 
@@ -306,177 +255,68 @@ void RenderDevice::_rasterize_lines()
 		if (line.culled) continue;
 		if (_render_states.polygon_mode == PolygonMode::POINTED)
 		{
-			draw_point(line.v[0], _fsin_buffer, _fragment_buffer);
-			draw_point(line.v[1], _fsin_buffer, _fragment_buffer);
+			draw_point(_vsout_buffer[line.v[0]], _fsin_buffer, _fragment_buffer);
+			draw_point(_vsout_buffer[line.v[1]], _fsin_buffer, _fragment_buffer);
 		}
 		else
 		{
-			draw_line(line.v[0], line.v[1], _fsin_buffer, _fragment_buffer);
+			draw_line(_vsout_buffer[line.v[0]], _vsout_buffer[line.v[1]], _fsin_buffer, _fragment_buffer);
 		}
 	}
 }
 
-void RenderDevice::_rasterize_triangles()
+void RenderDevice::_bin_fragments(FrameBuffer& framebuffer)
 {
-	PROFILE_SCOPE("rasterize triangles")
+	PROFILE_SCOPE("bin fragments")
 
-	std::mutex merge_mtx;
+	size_t fragment_count = _fragment_buffer.size();
+	size_t band_count = framebuffer.band_count();
+	// the bands only map onto our regions when the buffer was created on this pool
+	_is_banded = band_count > 1 && framebuffer.thread_pool() == _thread_pool
+		&& fragment_count >= MIN_BANDED_FRAGMENTS && _thread_pool->thread_count() > 1;
+	if (!_is_banded)
+		return;
 
-	auto rasterize = [this, &merge_mtx](int l, int r, int tid) {
-		
-		_thread_fsin_buffer[tid].clear();
-		_thread_fragment_buffer[tid].clear();
-		
-		for(int i = l; i < r; i++)
-		{
-			auto& triangle = _triangle_buffer[i];
-			if (triangle.culled) continue;
-
-			auto& v0 = triangle.v[0];
-			auto& v1 = triangle.v[1];
-			auto& v2 = triangle.v[2];
-
-			if (_render_states.polygon_mode == PolygonMode::POINTED)
-			{
-				draw_point(v0, _thread_fsin_buffer[tid], _thread_fragment_buffer[tid]);
-				draw_point(v1, _thread_fsin_buffer[tid], _thread_fragment_buffer[tid]);
-				draw_point(v2, _thread_fsin_buffer[tid], _thread_fragment_buffer[tid]);
-			}
-			else if (_render_states.polygon_mode == PolygonMode::WIREFRAME)
-			{
-				draw_line(v0, v1, _thread_fsin_buffer[tid], _thread_fragment_buffer[tid]);
-				draw_line(v1, v2, _thread_fsin_buffer[tid], _thread_fragment_buffer[tid]);
-				draw_line(v2, v0, _thread_fsin_buffer[tid], _thread_fragment_buffer[tid]);
-			}
-			else
-			{
-				draw_triangle(v0, v1, v2, _thread_fsin_buffer[tid], _thread_fragment_buffer[tid]);
-			}
-		}
-
-		{
-			std::lock_guard<std::mutex> lock(merge_mtx);
-			for(auto&& fsin : _thread_fsin_buffer[tid])
-				_fsin_buffer.push_back(fsin);
-			for(auto&& fragment : _thread_fragment_buffer[tid])
-				_fragment_buffer.push_back(fragment);
-		}
+	// stable counting sort of the fragment indices by band, each chunk counts and then scatters its own range
+	int width = framebuffer.width();
+	int height = framebuffer.height();
+	auto band_of = [&](const Fragment& fragment) -> size_t {
+		if (fragment.x < 0 || fragment.y < 0 || fragment.x >= width || fragment.y >= height)
+			return band_count;
+		return framebuffer.band_of_row(fragment.y);
 	};
 
-	int batch_count = _thread_pool->thread_count() * 10;
-	int batch_size = _triangle_buffer.size() / batch_count;
+	size_t grain = ThreadPool::grain_size(BIN_ITEM_COST);
+	size_t chunk_count = _thread_pool->chunk_count(fragment_count, grain);
+	size_t stride = band_count + 1;
+	_band_histogram.assign(chunk_count * stride, 0);
 
-	_thread_fsin_buffer.resize(batch_count);
-	_thread_fragment_buffer.resize(batch_count);
+	_thread_pool->parallel_for(0, fragment_count, grain, [&](size_t l, size_t r, size_t chunk) {
+		uint32_t* histogram = &_band_histogram[chunk * stride];
+		for (size_t i = l; i < r; i++)
+			histogram[band_of(_fragment_buffer[i])]++;
+	}, _task_queue);
 
+	_band_offsets.assign(stride + 1, 0);
+	uint32_t offset = 0;
+	for (size_t band = 0; band < stride; band++)
 	{
-		static std::vector<std::future<void>> futs;
-		futs.clear();
-
-		for (int i = 0, l = 0, r = 0; i < batch_count; i++, l = r)
+		_band_offsets[band] = offset;
+		for (size_t chunk = 0; chunk < chunk_count; chunk++)
 		{
-			r += get_batch_size(_triangle_buffer.size(), batch_count, i);
-			futs.push_back(_thread_pool->execute(std::bind(rasterize, l, r, i)));
+			uint32_t count = _band_histogram[chunk * stride + band];
+			_band_histogram[chunk * stride + band] = offset;
+			offset += count;
 		}
-		for (auto&& fut : futs)
-			fut.wait();
 	}
-}
+	_band_offsets[stride] = offset;
+	_band_fragments.resize(fragment_count);
 
-void RenderDevice::_early_z_test(FrameBuffer& framebuffer)
-{
-	PROFILE_SCOPE("early z test")
-	if (_render_states.depth_test && _render_states.eary_z_test)
-	{
-		assert(framebuffer.depth_format() != FrameBuffer::DepthFormat::None);
-		for(auto& fragment : _fragment_buffer)
-		{
-			int x = fragment.x;
-			int y = fragment.y;
-			if (x < 0 || y < 0 || x >= framebuffer.width() || y >= framebuffer.height())
-				continue;
-			if (fragment.depth <= framebuffer.get_depth(x, y))
-			{
-				if (!_render_states.depth_mask)
-					framebuffer.set_depth(x, y, fragment.depth);
-			}
-			else
-				fragment.discarded = true;
-		}
-	}
-}
-
-void RenderDevice::_run_fragment_shader()
-{
-	PROFILE_SCOPE("run fs")
-	
-	assert(_shader_program->fragment_shader);
-	
-	auto run_fs = [this](int l, int r)
-	{
-		auto fs = _shader_program->fragment_shader;
-		fs->load_uniforms();
-		for (int i = l; i < r; i++) 
-		{
-			auto& fsin = _fsin_buffer[i];
-			auto& fragment = _fragment_buffer[i];
-			FSOut result;
-			for (int j = 0; j < _shader_program->varying_num; j++)
-				fsin.in_varying[j] /= fragment.inv_w;
-			fs->run(fsin, result);
-			fragment.color = result.color;
-			fragment.discarded |= result.discarded;
-		}
-	};
-	
-	{
-		int batch_count = _thread_pool->thread_count();
-		int batch_size = _fragment_buffer.size() / batch_count;
-
-		static std::vector<std::future<void>> futs;
-		futs.clear();
-		for (int i = 0, l = 0, r = 0; i < batch_count; i++, l = r)
-		{
-			r += get_batch_size(_fragment_buffer.size(), batch_count, i);
-			futs.push_back(_thread_pool->execute(std::bind(run_fs, l, r)));
-		}
-		for (auto&& fut : futs)
-			fut.wait();
-	}
-}
-
-void RenderDevice::_fragment_test(FrameBuffer& framebuffer)
-{
-	PROFILE_SCOPE("fragment test")
-	for (auto& fragment : _fragment_buffer)
-	{
-		if (fragment.discarded) continue;
-		int x = fragment.x;
-		int y = fragment.y;
-		if (x < 0 || y < 0 || x >= framebuffer.width() || y >= framebuffer.height())
-			continue;
-
-		if (_render_states.alpha_test)
-			if (fragment.color.a < _render_states.alpha_test_threshold)
-				continue;
-
-		if (_render_states.depth_test && !_render_states.eary_z_test)
-		{
-			assert(framebuffer.depth_format() != FrameBuffer::DepthFormat::None);
-			if (fragment.depth <= framebuffer.get_depth(x, y))
-			{
-				if (!_render_states.depth_mask)
-					framebuffer.set_depth(x, y, fragment.depth);
-				if (!_render_states.color_mask)
-					framebuffer.set_color(fragment.x, fragment.y, fragment.color);
-			}
-		}
-		else
-		{
-			if (!_render_states.color_mask)
-				framebuffer.set_color(fragment.x, fragment.y, fragment.color);
-		}
-	}
+	_thread_pool->parallel_for(0, fragment_count, grain, [&](size_t l, size_t r, size_t chunk) {
+		uint32_t* position = &_band_histogram[chunk * stride];
+		for (size_t i = l; i < r; i++)
+			_band_fragments[position[band_of(_fragment_buffer[i])]++] = i;
+	}, _task_queue);
 }
 
 void RenderDevice::_post_processing(FrameBuffer& framebuffer)
@@ -487,70 +327,72 @@ void RenderDevice::_post_processing(FrameBuffer& framebuffer)
 
 void RenderDevice::clear_buffers()
 {
-	_vsout_buffer.clear();
+	int varying_num = _shader_program->varying_num;
+	_vsout_buffer.reset(1 + varying_num);
 	_point_buffer.clear();
 	_line_buffer.clear();
 	_triangle_buffer.clear();
-	_fsin_buffer.clear();
+	_fsin_buffer.reset(varying_num);
+	_gradient_buffer.reset(2 * varying_num + 1);
 	_fragment_buffer.clear();
 }
 
-size_t RenderDevice::add_vsout(const VSOut& vertex)
-{
-	_vsout_buffer.push_back(vertex);
-	return _vsout_buffer.size() - 1;
-}
-
 void RenderDevice::add_point(size_t i)
 {
-	_point_buffer.push_back(Point{ _vsout_buffer[i] });
+	_point_buffer.push_back(Point{ i });
 }
 
 void RenderDevice::add_line(size_t i, size_t j)
 {
-	_line_buffer.push_back(Line{ _vsout_buffer[i], _vsout_buffer[j] });
+	_line_buffer.push_back(Line{ { i, j } });
 }
 
 void RenderDevice::add_triangle(size_t i, size_t j, size_t k)
 {
-	_triangle_buffer.push_back(Triangle{ _vsout_buffer[i], _vsout_buffer[j], _vsout_buffer[k] });
+	_triangle_buffer.push_back(Triangle{ { i, j, k } });
 }
 
-void RenderDevice::draw_point(const VSOut& v, std::vector<FSIn>& fsin_buffer, std::vector<Fragment>& fragment_buffer)
+void RenderDevice::draw_point(const Vec4* v, VaryingArena& fsin_buffer, std::vector<Fragment>& fragment_buffer)
 {
-	int sx = std::ceil(v.position.x - _render_states.point_size * 0.5f);
-	int tx = std::floor(v.position.x + _render_states.point_size * 0.5f);
-	int sy = std::ceil(v.position.y - _render_states.point_size * 0.5f);
-	int ty = std::floor(v.position.y + _render_states.point_size * 0.5f);
+	const Vec4& position = v[0];
+	int varying_num = fsin_buffer.stride();
+
+	int sx = std::ceil(position.x - _render_states.point_size * 0.5f);
+	int tx = std::floor(position.x + _render_states.point_size * 0.5f);
+	int sy = std::ceil(position.y - _render_states.point_size * 0.5f);
+	int ty = std::floor(position.y + _render_states.point_size * 0.5f);
 
 	for (int x = sx; x <= tx; x++)
 		for (int y = sy; y <= ty; y++)
 		{
 			if (_render_states.point_style == PointStyle::CIRCLE)
 			{
-				float dx = x + 0.5f - v.position.x;
-				float dy = y + 0.5f - v.position.y;
+				float dx = x + 0.5f - position.x;
+				float dy = y + 0.5f - position.y;
 				if (dx * dx + dy * dy > _render_states.point_size * _render_states.point_size * 0.25)
 					continue;
 			}
 
-			fsin_buffer.push_back(FSIn(v, _shader_program->varying_num));
+			Vec4* varying = fsin_buffer[fsin_buffer.push_back()];
+			std::copy(v + 1, v + 1 + varying_num, varying);
 
 			Fragment fragment;
 			fragment.x = x;
 			fragment.y = y;
-			fragment.depth = v.position.z;
-			fragment.inv_w = v.position.w;
+			fragment.depth = position.z;
+			fragment.inv_w = position.w;
 			fragment_buffer.push_back(fragment);
 		}
 }
 
-void RenderDevice::draw_line(const VSOut& vs, const VSOut& vt, std::vector<FSIn>& fsin_buffer, std::vector<Fragment>& fragment_buffer)
+void RenderDevice::draw_line(const Vec4* vs, const Vec4* vt, VaryingArena& fsin_buffer, std::vector<Fragment>& fragment_buffer)
 {
-	int sx = floor(vs.position.x);
-	int tx = floor(vt.position.x);
-	int sy = floor(vs.position.y);
-	int ty = floor(vt.position.y);
+	int varying_num = fsin_buffer.stride();
+
+	int sx = floor(vs[0].x);
+	int tx = floor(vt[0].x);
+	int sy = floor(vs[0].y);
+	int ty = floor(vt[0].y);
 
 	bool steep = abs(ty - sy) > abs(tx - sx);
 	if (steep)
@@ -568,16 +410,19 @@ void RenderDevice::draw_line(const VSOut& vs, const VSOut& vt, std::vector<FSIn>
 	for (int x = sx; x <= tx; x++)
 	{
 		float t = float(x - sx) / (tx - sx);
-		VSOut v = interpolation_vsout(vs, vt, reverse ? 1.0f - t : t);
-
-		fsin_buffer.push_back(FSIn(v, _shader_program->varying_num));
+		if (reverse)
+			t = 1.0f - t;
+		Vec4 position = lerp(vs[0], vt[0], t);
+		Vec4* varying = fsin_buffer[fsin_buffer.push_back()];
+		for (int i = 0; i < varying_num; i++)
+			varying[i] = lerp(vs[i + 1], vt[i + 1], t);
 
 		Fragment fragment;
 		fragment.x = x;
 		fragment.y = y;
 		if (steep) std::swap(fragment.x, fragment.y);
-		fragment.depth = v.position.z;
-		fragment.inv_w = v.position.w;
+		fragment.depth = position.z;
+		fragment.inv_w = position.w;
 		fragment_buffer.push_back(fragment);
 
 		error -= dy;
@@ -586,12 +431,15 @@ void RenderDevice::draw_line(const VSOut& vs, const VSOut& vt, std::vector<FSIn>
 	}
 }
 
-void RenderDevice::draw_triangle(const VSOut& v0, const VSOut& v1, const VSOut& v2, std::vector<FSIn>& fsin_buffer, std::vector<Fragment>& fragment_buffer)
+void RenderDevice::draw_triangle(const Vec4* v0, const Vec4* v1, const Vec4* v2, VaryingArena& fsin_buffer, std::vector<Fragment>& fragment_buffer,
+	uint32_t primitive)
 {
+	int varying_num = fsin_buffer.stride();
+
 	Vec2 p[3] = {
-			Vec2(v0.position.x, v0.position.y),
-			Vec2(v1.position.x, v1.position.y),
-			Vec2(v2.position.x, v2.position.y)
+			Vec2(v0[0].x, v0[0].y),
+			Vec2(v1[0].x, v1[0].y),
+			Vec2(v2[0].x, v2[0].y)
 	};
 	int sx = std::floor(std::min({ p[0].x, p[1].x, p[2].x }));
 	int tx = std::floor(std::max({ p[0].x, p[1].x, p[2].x }));
@@ -610,20 +458,69 @@ void RenderDevice::draw_triangle(const VSOut& v0, const VSOut& v1, const VSOut&
 			if (t0 < 0.0f || t1 < 0.0f || t2 < 0.0f)
 				continue;
 
-			VSOut v = interpolation_vsout(v0, v1, v2, t0, t1, t2);
-
-			fsin_buffer.emplace_back(v, _shader_program->varying_num);
+			Vec4 position = v0[0] * t0 + v1[0] * t1 + v2[0] * t2;
+			Vec4* varying = fsin_buffer[fsin_buffer.push_back()];
+			for (int i = 0; i < varying_num; i++)
+				varying[i] = v0[i + 1] * t0
+						   + v1[i + 1] * t1
+						   + v2[i + 1] * t2;
 
 			Fragment fragment;
 			fragment.x = x;
 			fragment.y = y;
-			fragment.depth = v.position.z;
-			fragment.inv_w = v.position.w;
+			fragment.depth = position.z;
+			fragment.inv_w = position.w;
+			fragment.primitive = primitive;
 			fragment_buffer.push_back(fragment);
 		}
 
 }
 
+void RenderDevice::triangle_gradients(const Vec4* v0, const Vec4* v1, const Vec4* v2, Vec4* gradients) const
+{
+	int varying_num = _fsin_buffer.stride();
+
+	// attributes of the viewport vertices are linear in screen space, solve for their plane
+	Vec2 e1 = vec2(v1[0] - v0[0]);
+	Vec2 e2 = vec2(v2[0] - v0[0]);
+	float det = e1.x * e2.y - e2.x * e1.y;
+	float inv_det = std::abs(det) > 0.0f ? 1.0f / det : 0.0f;
+	auto gradient = [&](const Vec4& a0, const Vec4& a1, const Vec4& a2, Vec4& ddx, Vec4& ddy) {
+		Vec4 d1 = a1 - a0;
+		Vec4 d2 = a2 - a0;
+		ddx = (d1 * e2.y - d2 * e1.y) * inv_det;
+		ddy = (d2 * e1.x - d1 * e2.x) * inv_det;
+	};
+
+	for (int i = 0; i < varying_num; i++)
+		gradient(v0[i + 1], v1[i + 1], v2[i + 1], gradients[i], gradients[varying_num + i]);
+	Vec4 ddx, ddy;
+	gradient(Vec4(v0[0].w), Vec4(v1[0].w), Vec4(v2[0].w), ddx, ddy);
+	gradients[2 * varying_num] = Vec4(ddx.x, ddy.x, 0.0f, 0.0f);
+}
+
+void RenderDevice::varying_derivatives(const Fragment& fragment, const Vec4* record, Vec4* ddx, Vec4* ddy) const
+{
+	int varying_num = _fsin_buffer.stride();
+	if (fragment.primitive == NO_PRIMITIVE)
+	{
+		std::fill(ddx, ddx + varying_num, Vec4(0.0f));
+		std::fill(ddy, ddy + varying_num, Vec4(0.0f));
+		return;
+	}
+
+	// v = p / q with p = varying / w and q = 1 / w both linear, so dv = (dp - v * dq) / q
+	const Vec4* gradients = _gradient_buffer[fragment.primitive];
+	Vec4 dq = gradients[2 * varying_num];
+	float w = 1.0f / fragment.inv_w;
+	for (int i = 0; i < varying_num; i++)
+	{
+		Vec4 v = record[i] * w;
+		ddx[i] = (gradients[i] - v * dq.x) * w;
+		ddy[i] = (gradients[varying_num + i] - v * dq.y) * w;
+	}
+}
+
 
 void RenderDevice::clip_triangles_by_plane(RenderDevice::ClipPlane plane)
 {	
@@ -632,12 +529,12 @@ void RenderDevice::clip_triangles_by_plane(RenderDevice::ClipPlane plane)
 	{
 		auto& triangle = _triangle_buffer[i];
 		if (triangle.culled) continue;
-		auto& v = triangle.v;
+		size_t v[3] = { triangle.v[0], triangle.v[1], triangle.v[2] };
 
 		size_t incnt  = 0, in[3]  = {};
 		size_t outcnt = 0, out[3] = {};
 		for (int j = 0; j < 3; j++) 
-			(check_in_clip_plane(v[j].position, plane) ? in[incnt++] : out[outcnt++]) = j;
+			(check_in_clip_plane(_vsout_buffer[v[j]][0], plane) ? in[incnt++] : out[outcnt++]) = j;
 
 		if (outcnt == 3)
 		{
@@ -647,13 +544,13 @@ void RenderDevice::clip_triangles_by_plane(RenderDevice::ClipPlane plane)
 		{
 			triangle.culled = true;
 			
-			float t0 = get_clip_interpolation_ratio(v[in[0]].position, v[out[0]].position, plane);
-			float t1 = get_clip_interpolation_ratio(v[in[0]].position, v[out[1]].position, plane);
+			float t0 = get_clip_interpolation_ratio(_vsout_buffer[v[in[0]]][0], _vsout_buffer[v[out[0]]][0], plane);
+			float t1 = get_clip_interpolation_ratio(_vsout_buffer[v[in[0]]][0], _vsout_buffer[v[out[1]]][0], plane);
 			
-			VSOut v0 = interpolation_vsout(v[in[0]], v[out[0]], t0);
-			VSOut v1 = interpolation_vsout(v[in[0]], v[out[1]], t1);
+			size_t v0 = interpolation_vsout(v[in[0]], v[out[0]], t0);
+			size_t v1 = interpolation_vsout(v[in[0]], v[out[1]], t1);
 
-			_triangle_buffer.push_back(Triangle{ _triangle_buffer[i].v[in[0]], v0, v1 });
+			_triangle_buffer.push_back(Triangle{ { v[in[0]], v0, v1 } });
 			if (in[0] == 1)
 				_triangle_buffer.back().reverse_order();
 		}
@@ -661,14 +558,14 @@ void RenderDevice::clip_triangles_by_plane(RenderDevice::ClipPlane plane)
 		{
 			triangle.culled = true;
 
-			float t0 = get_clip_interpolation_ratio(v[in[0]].position, v[out[0]].position, plane);
-			float t1 = get_clip_interpolation_ratio(v[in[1]].position, v[out[0]].position, plane);
+			float t0 = get_clip_interpolation_ratio(_vsout_buffer[v[in[0]]][0], _vsout_buffer[v[out[0]]][0], plane);
+			float t1 = get_clip_interpolation_ratio(_vsout_buffer[v[in[1]]][0], _vsout_buffer[v[out[0]]][0], plane);
 
-			VSOut v0 = interpolation_vsout(v[in[0]], v[out[0]], t0);
-			VSOut v1 = interpolation_vsout(v[in[1]], v[out[0]], t1);
+			size_t v0 = interpolation_vsout(v[in[0]], v[out[0]], t0);
+			size_t v1 = interpolation_vsout(v[in[1]], v[out[0]], t1);
 			
-			_triangle_buffer.push_back(Triangle{ _triangle_buffer[i].v[in[0]], _triangle_buffer[i].v[in[1]], v0 });
-			_triangle_buffer.push_back(Triangle{ _triangle_buffer[i].v[in[1]], v1, v0 });
+			_triangle_buffer.push_back(Triangle{ { v[in[0]], v[in[1]], v0 } });
+			_triangle_buffer.push_back(Triangle{ { v[in[1]], v1, v0 } });
 
 			if (out[0] == 1)
 			{
@@ -689,7 +586,7 @@ void RenderDevice::clip_lines_by_plane(RenderDevice::ClipPlane plane)
 
 		bool in[2];
 		for (int j = 0; j < 2; j++)
-			in[j] = check_in_clip_plane(line.v[j].position, plane);
+			in[j] = check_in_clip_plane(_vsout_buffer[line.v[j]][0], plane);
 
 		if (!in[0] && !in[1])
 		{
@@ -698,44 +595,37 @@ void RenderDevice::clip_lines_by_plane(RenderDevice::ClipPlane plane)
 		else if (in[0] ^ in[1])
 		{
 			line.culled = true;
-			float t = get_clip_interpolation_ratio(line.v[0].position, line.v[1].position, plane);
-			VSOut v = interpolation_vsout(line.v[0], line.v[1], t);
-			_line_buffer.push_back(in[0] ? Line{ line.v[0], v } : Line{ v, line.v[1] });
+			size_t s = line.v[0], t = line.v[1];
+			float ratio = get_clip_interpolation_ratio(_vsout_buffer[s][0], _vsout_buffer[t][0], plane);
+			size_t v = interpolation_vsout(s, t, ratio);
+			_line_buffer.push_back(in[0] ? Line{ { s, v } } : Line{ { v, t } });
 		}
 	}
 }
 
-VSOut RenderDevice::interpolation_vsout(const VSOut& a, const VSOut& b, float t) const
-{
-	VSOut c;
-	c.position = lerp(a.position, b.position, t);
-	for (int i = 0; i < _shader_program->varying_num; i++)
-		c.out_varying[i] = lerp(a.out_varying[i], b.out_varying[i], t);
-	return c;
-}
-
-VSOut RenderDevice::interpolation_vsout(const VSOut& a, const VSOut& b, const VSOut& c, float t0, float t1, float t2) const
+size_t RenderDevice::interpolation_vsout(size_t a, size_t b, float t)
 {
-	VSOut d;
-	d.position = a.position * t0 + b.position * t1 + c.position * t2;
-	for (int i = 0; i < _shader_program->varying_num; i++)
-		d.out_varying[i] = a.out_varying[i] * t0
-						 + b.out_varying[i] * t1
-						 + c.out_varying[i] * t2;
-	return d;
+	size_t k = _vsout_buffer.push_back();
+	Vec4* c = _vsout_buffer[k];
+	const Vec4* va = _vsout_buffer[a];
+	const Vec4* vb = _vsout_buffer[b];
+	for (int i = 0; i < _vsout_buffer.stride(); i++)
+		c[i] = lerp(va[i], vb[i], t);
+	return k;
 }
 
-void RenderDevice::vsout_to_viewport(VSOut& v)
+void RenderDevice::vsout_to_viewport(Vec4* v)
 {
-	for (int i = 0; i < _shader_program->varying_num; i++)
-		v.out_varying[i] /= v.position.w;
-	v.position.x /= v.position.w;
-	v.position.y /= v.position.w;
-	v.position.z /= v.position.w;
-	v.position.w = 1.0f / v.position.w;
+	Vec4& position = v[0];
+	for (int i = 1; i < _vsout_buffer.stride(); i++)
+		v[i] /= position.w;
+	position.x /= position.w;
+	position.y /= position.w;
+	position.z /= position.w;
+	position.w = 1.0f / position.w;
 	
-	v.position.x = (v.position.x + 1.0f) * _render_states.viewport.w * 0.5f;
-	v.position.y = (v.position.y + 1.0f) * _render_states.viewport.h * 0.5f;
+	position.x = (position.x + 1.0f) * _render_states.viewport.w * 0.5f;
+	position.y = (position.y + 1.0f) * _render_states.viewport.h * 0.5f;
 	
 }
 
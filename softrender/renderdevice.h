@@ -1,42 +1,94 @@
 #ifndef RENDER_DEVICE_H
 #define RENDER_DEVICE_H
 
-#include <unordered_map>
 #include <vector>
 #include <string>
-#include <any>
 #include <memory>
+#include <cstdint>
+#include <array>
+#include <utility>
 #include "renderstates.h"
 #include "framebuffer.h"
+#include "uniform.h"
+#include "simd.h"
+#include "varyingarena.h"
+#include "lightgrid.h"
+#include "texturetable.h"
 
-constexpr int MAX_VARYING_NUM = 5;
+constexpr int MAX_ATTRIBUTE_NUM = 5;
+constexpr int MAX_INSTANCE_ATTRIBUTE_NUM = 4;
+
+// varying count template argument of RenderDevice::draw that reads the count from the shader program
+constexpr int DYNAMIC_VARYING_NUM = -1;
 
 struct ShaderProgram;
 
 struct VSIn
 {
-	Vec4 attributes[MAX_VARYING_NUM];
+	Vec4 attributes[MAX_ATTRIBUTE_NUM];
 };
+// views into a vertex record of the device, the position followed by the program's varyings
 struct VSOut
 {
-	Vec4 position;
-	Vec4 out_varying[MAX_VARYING_NUM];
+	Vec4& position;
+	Vec4* out_varying;
+
+	explicit VSOut(Vec4* record) : position(record[0]), out_varying(record + 1) {}
 };
+// view into a fragment record of the device holding the program's varyings, frag_coord is the pixel center.
+// ddx_varying and ddy_varying are the varyings' derivatives per pixel along screen x and y, set only for
+// shaders whose uses_derivatives is true and zero for points and lines
 struct FSIn
 {
-	FSIn() = default;
-	FSIn(const VSOut& vsout, size_t varying_num) 
-	{
-		memcpy(in_varying, vsout.out_varying, sizeof(Vec4) * varying_num);
-	}
-	Vec4 in_varying[MAX_VARYING_NUM];
+	const Vec4* in_varying;
+	Vec2 frag_coord;
+	const Vec4* ddx_varying = nullptr;
+	const Vec4* ddy_varying = nullptr;
+
+	FSIn(const Vec4* record, const Vec2& frag_coord) : in_varying(record), frag_coord(frag_coord) {}
 };
+// depth starts as the fragment's depth and is only read back from shaders that declare writes_depth
 struct FSOut
 {
 	Vec4 color;
+	float depth = 0.0f;
 	bool discarded = false;
 };
 
+// SoA attribute streams of VS_BATCH_SIZE vertices for VertexShader::run_batch
+constexpr int VS_BATCH_SIZE = SIMD_WIDTH;
+
+struct VSInBatch
+{
+	Vec4x8 attributes[MAX_ATTRIBUTE_NUM];
+};
+// out_varying points to varying_num streams owned by the caller
+struct VSOutBatch
+{
+	Vec4x8 position;
+	Vec4x8* out_varying = nullptr;
+	int varying_num = 0;
+};
+
+// SoA packet of FS_PACKET_SIZE fragments for FragmentShader::run_packet, lanes outside active are ignored
+constexpr int FS_PACKET_SIZE = SIMD_WIDTH;
+
+struct FSInPacket
+{
+	const Vec4x8* in_varying = nullptr;
+	int varying_num = 0;
+	Vec2x8 frag_coord;
+	const Vec4x8* ddx_varying = nullptr;
+	const Vec4x8* ddy_varying = nullptr;
+	Mask8 active;
+};
+struct FSOutPacket
+{
+	Vec4x8 color;
+	Float8 depth;
+	Mask8 discarded;
+};
+
 using Vertex = VSIn;
 using VertexBuffer = std::vector<Vertex>;
 using IndexBuffer = std::vector<size_t>;
@@ -47,7 +99,15 @@ struct VertexArray
 	IndexBuffer indices;
 };
 
-class FixedThreadPool;
+struct Instance
+{
+	Vec4 attributes[MAX_INSTANCE_ATTRIBUTE_NUM];
+};
+
+using InstanceBuffer = std::vector<Instance>;
+
+class ThreadPool;
+class TaskQueue;
 
 
 class RenderDevice : public std::enable_shared_from_this<RenderDevice>
@@ -56,33 +116,60 @@ public:
 
 	RenderDevice();
 
+	explicit RenderDevice(std::shared_ptr<ThreadPool> thread_pool);
+
 	~RenderDevice();
 
 	void set_shader_program(const ShaderProgram& program);
 
 	ShaderProgram& shader_program();
 
+	template<class T>
+	void set_shader_uniform(UniformHandle<T> handle, const typename UniformHandle<T>::value_type& value)
+	{
+		_shader_uniforms.set(handle, value);
+	}
+
+	template<class T>
+	T get_shader_uniform(UniformHandle<T> handle, const typename UniformHandle<T>::value_type& default_val = T()) const
+	{
+		const T* value = _shader_uniforms.get(handle);
+		return value ? *value : default_val;
+	}
+
+	template<class T>
+	bool has_shader_uniform(UniformHandle<T> handle) const
+	{
+		return _shader_uniforms.is_set(handle.id);
+	}
+
+	template<class T>
+	void clear_shader_uniform(UniformHandle<T> handle)
+	{
+		_shader_uniforms.clear(handle.id);
+	}
+
+	// name based access goes through the registry on every call, prefer handles in per-draw code
 	template<class T>
 	void set_shader_uniform(std::string_view name, const T& value)
 	{
-		_shader_uniforms[name.data()] = value;
+		set_shader_uniform(UniformRegistry::register_uniform<T>(name), value);
 	}
 
 	template<class T>
 	T get_shader_uniform(std::string_view name, const T& default_val = T()) const
 	{
-		auto it = _shader_uniforms.find(name.data());
-		return it != _shader_uniforms.end() ? std::any_cast<T>(it->second) : default_val;
+		return get_shader_uniform(UniformRegistry::find<T>(name), default_val);
 	}
 
 	bool has_shader_uniform(std::string_view name) const
 	{
-		return _shader_uniforms.find(name.data()) != _shader_uniforms.end();
+		return _shader_uniforms.is_set(UniformRegistry::find_id(name));
 	}
 
 	void clear_shader_uniform(std::string_view name)
 	{
-		_shader_uniforms.erase(name.data());
+		_shader_uniforms.clear(UniformRegistry::find_id(name));
 	}
 
 	void clear_shader_uniforms()
@@ -90,40 +177,72 @@ public:
 		_shader_uniforms.clear();
 	}
 
+	uint64_t shader_uniform_block_version(int block) const
+	{
+		return _shader_uniforms.block_version(block);
+	}
+
+	// textures the shader samplers of this device refer to, see TextureTable
+	TextureTable& texture_table();
+
+	const TextureTable& texture_table() const;
+
+	// framebuffers drawn by this device should be created on this pool so their bands match its regions
+	const std::shared_ptr<ThreadPool>& thread_pool() const;
+
 	void shrink_buffer_size();
 
 	RenderStates& render_states();
 
 	const RenderStates& render_states() const;
 
-	void draw(FrameBuffer& framebuffer, VertexArray vertex_array);
+	void draw(FrameBuffer& framebuffer, const VertexArray& vertex_array);
+
+	// draws count copies of vertex_array in one pass, instance_buffer may be empty if the shader only needs the instance index,
+	// every instance then gets the identity model matrix. only as many instances as the buffer holds are drawn otherwise
+	void draw_instanced(FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer& instance_buffer, size_t count);
+
+	// runs the pipeline instantiated for the given shader classes, which must match the bound program.
+	// the depth test, cull face and polygon mode states select one of the precompiled permutations.
+	// defined in pipeline.h
+	template<class VS, class FS, int VARYING_NUM>
+	void draw(FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer = nullptr, size_t instance_count = 1);
+
+	// bins lights into grid on the device's threads against the depth in framebuffer and the current viewport,
+	// see LightGrid::build. call once per frame after the depth prepass and bind grid to "light_grid"
+	void build_light_grid(LightGrid& grid, const std::vector<PointLight>& lights, FrameBuffer& framebuffer, const Mat4& projection);
 
 private:
 
 	RenderStates _render_states;
 
-	std::unordered_map<std::string, std::any> _shader_uniforms;
+	UniformStorage _shader_uniforms;
+
+	TextureTable _texture_table;
 
 	std::unique_ptr<ShaderProgram> _shader_program = std::make_unique<ShaderProgram>();
 
-	std::unique_ptr<FixedThreadPool> _thread_pool;
+	std::shared_ptr<ThreadPool> _thread_pool;
+
+	TaskQueue* _task_queue = nullptr;
 
 	
+	// primitives refer to their vertices by index into _vsout_buffer
 	struct Point
 	{
-		VSOut v;
+		size_t v;
 		bool culled = false;
 	};
 
 	struct Line
 	{
-		VSOut v[2];
+		size_t v[2];
 		bool culled = false;
 	};
 
 	struct Triangle
 	{
-		VSOut v[3];
+		size_t v[3];
 		bool culled = false;
 
 		void reverse_order()
@@ -132,33 +251,68 @@ private:
 		}
 	};
 
+	static constexpr uint32_t NO_PRIMITIVE = UINT32_MAX;
+
 	struct Fragment
 	{
 		Vec4 color;
 		int x, y;
 		float depth;
 		float inv_w;
+		uint32_t primitive = NO_PRIMITIVE;	// triangle whose gradients _gradient_buffer holds
 		bool discarded = false;
 	};
 
 
-	std::vector<VSOut>		_vsout_buffer;
+	IndexBuffer				_identity_indices;
+	VaryingArena			_vsout_buffer;
 	std::vector<Point>		_point_buffer;
 	std::vector<Line>		_line_buffer;
 	std::vector<Triangle>	_triangle_buffer;
-	std::vector<FSIn>		_fsin_buffer;
+	VaryingArena			_fsin_buffer;
 	std::vector<Fragment>   _fragment_buffer;
+
+	// per triangle screen space gradients of varying / w along x, then along y, then of 1 / w as (x, y, 0, 0),
+	// filled only for shaders that use derivatives
+	VaryingArena			_gradient_buffer;
 	
-	std::vector<std::vector<FSIn>>	   _thread_fsin_buffer;
+	std::vector<VaryingArena>		   _thread_fsin_buffer;
 	std::vector<std::vector<Fragment>> _thread_fragment_buffer;
 
-	void _run_vertex_shader(const VertexBuffer& vertices);
+	// fragment indices grouped by framebuffer band, in rasterization order within a band
+	std::vector<uint32_t> _band_fragments;
+	std::vector<uint32_t> _band_offsets;
+	std::vector<uint32_t> _band_histogram;
+	bool _is_banded = false;
+
+	void _draw(FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count);
 
-	void _assemble_points(const IndexBuffer& indices);
+	using Pipeline = void (RenderDevice::*)(FrameBuffer&, const VertexArray&, const InstanceBuffer*, size_t);
 
-	void _assemble_lines(const IndexBuffer& indices);
+	static constexpr size_t PIPELINE_PERMUTATION_NUM = 2 * 3 * 3;
 
-	void _assemble_triangles(const IndexBuffer& indices);
+	template<class VS, class FS, int VARYING_NUM, size_t... I>
+	static constexpr std::array<Pipeline, sizeof...(I)> _pipeline_table(std::index_sequence<I...>);
+
+	size_t _pipeline_permutation() const
+	{
+		return size_t(_render_states.depth_test) * 9 + size_t(_render_states.cull_face_mode) * 3 + size_t(_render_states.polygon_mode);
+	}
+
+	template<int VARYING_NUM>
+	int _varying_num() const;
+
+	template<class VS, class FS, int VARYING_NUM, bool DEPTH_TEST, CullFaceMode CULL_FACE, PolygonMode POLYGON>
+	void _run_pipeline(FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count);
+
+	template<class VS, int VARYING_NUM>
+	void _run_vertex_shader(const VertexBuffer& vertices, const InstanceBuffer* instance_buffer, size_t instance_count);
+
+	void _assemble_points(const IndexBuffer& indices, size_t count, size_t vertex_count, size_t instance_count);
+
+	void _assemble_lines(const IndexBuffer& indices, size_t count, size_t vertex_count, size_t instance_count);
+
+	void _assemble_triangles(const IndexBuffer& indices, size_t count, size_t vertex_count, size_t instance_count);
 
 	void _clipping_points();
 
@@ -166,6 +320,7 @@ private:
 
 	void _clipping_triangles();
 
+	template<CullFaceMode CULL_FACE>
 	void _face_culling();
 
 	void _to_viewport();
@@ -174,13 +329,34 @@ private:
 	
 	void _rasterize_lines();
 	
+	template<PolygonMode POLYGON>
 	void _rasterize_triangles();
 
-	void _early_z_test(FrameBuffer& framebuffer);
+	void _bin_fragments(FrameBuffer& framebuffer);
+
+	template<class F>
+	void _for_each_band(FrameBuffer& framebuffer, F&& fn);
+
+	// where the depth test of a draw runs: EARLY tests and writes before shading, HYBRID rejects
+	// hidden fragments before shading but tests again and writes after it, LATE only runs after it
+	enum class DepthTestStage
+	{
+		EARLY,
+		HYBRID,
+		LATE
+	};
+
+	// picked per draw from the fragment shader's metadata and the alpha test state
+	DepthTestStage _depth_test_stage() const;
+
+	template<bool DEPTH_TEST>
+	void _early_z_test(FrameBuffer& framebuffer, DepthTestStage stage);
 	
+	template<class FS, int VARYING_NUM>
 	void _run_fragment_shader();
 
-	void _fragment_test(FrameBuffer& framebuffer);
+	template<bool DEPTH_TEST>
+	void _fragment_test(FrameBuffer& framebuffer, DepthTestStage stage);
 
 	void _post_processing(FrameBuffer& framebuffer);
 
@@ -198,29 +374,33 @@ private:
 
 	void clear_buffers();
 
-	size_t add_vsout(const VSOut& vertex);
-
 	void add_point(size_t i);
 
 	void add_line(size_t i, size_t j);
 
 	void add_triangle(size_t i, size_t j, size_t k);
 
-	void draw_point(const VSOut& v, std::vector<FSIn>& fsin_buffer, std::vector<Fragment>& fragment_buffer);
+	// vertices are records of _vsout_buffer, position first
+	void draw_point(const Vec4* v, VaryingArena& fsin_buffer, std::vector<Fragment>& fragment_buffer);
 	
-	void draw_line(const VSOut& s, const VSOut& t, std::vector<FSIn>& fsin_buffer, std::vector<Fragment>& fragment_buffer);
+	void draw_line(const Vec4* s, const Vec4* t, VaryingArena& fsin_buffer, std::vector<Fragment>& fragment_buffer);
+
+	void draw_triangle(const Vec4* a, const Vec4* b, const Vec4* c, VaryingArena& fsin_buffer, std::vector<Fragment>& fragment_buffer,
+		uint32_t primitive = NO_PRIMITIVE);
 
-	void draw_triangle(const VSOut& a, const VSOut& b, const VSOut& c, std::vector<FSIn>& fsin_buffer, std::vector<Fragment>& fragment_buffer);
+	void triangle_gradients(const Vec4* a, const Vec4* b, const Vec4* c, Vec4* gradients) const;
+
+	// derivatives of the fragment's varyings, record holds them still multiplied by inv_w
+	void varying_derivatives(const Fragment& fragment, const Vec4* record, Vec4* ddx, Vec4* ddy) const;
 	
 	void clip_lines_by_plane(ClipPlane plane);
 
 	void clip_triangles_by_plane(ClipPlane plane);
 
-	VSOut interpolation_vsout(const VSOut& a, const VSOut& b, float t) const;
-
-	VSOut interpolation_vsout(const VSOut& a, const VSOut& b, const VSOut& c, float t0, float t1, float t2) const;
+	// appends the vertex between vertices a and b to _vsout_buffer and returns its index
+	size_t interpolation_vsout(size_t a, size_t b, float t);
 
-	void vsout_to_viewport(VSOut& vsout);
+	void vsout_to_viewport(Vec4* v);
 
 	float get_clip_interpolation_ratio(const Vec4& a, const Vec4& b, ClipPlane plane) const;
 
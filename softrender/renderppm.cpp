@@ -1,24 +1,33 @@
 #include "renderppm.h"
 #include <fstream>
 
-RenderPpm::RenderPpm(int w, int h) : _w(w), _h(h)
+RenderPpm::RenderPpm(int w, int h, std::shared_ptr<ThreadPool> thread_pool)
+	: RenderTarget(std::move(thread_pool)), _w(w), _h(h)
 {
-	_framebuffer = std::make_unique<FrameBuffer>(w, h, 
+	create_swap_chain(w, h, 
 		FrameBuffer::ColorFormat::LDR_RGB,
 		FrameBuffer::DepthFormat::None);
 }
 
-void RenderPpm::save(std::string_view filename)
+RenderPpm::~RenderPpm()
 {
-	std::ofstream out(filename.data());
-	out << "P3\n" << _w << " " << _h << "\n255\n";
-	for (int y = 0; y < _h; y++)
+	wait_idle();
+}
+
+FrameFence RenderPpm::save(std::string_view filename)
+{
+	return submit([this, filename = std::string(filename)](FrameBuffer& framebuffer)
 	{
-		for (int x = 0; x < _w; x++)
+		std::ofstream out(filename);
+		out << "P3\n" << _w << " " << _h << "\n255\n";
+		for (int y = 0; y < _h; y++)
 		{
-			auto c = _framebuffer->get_color(x, y) * 255.0f;
-			out << int(c.r) << " " << int(c.g) << " " << int(c.b) << " ";
+			for (int x = 0; x < _w; x++)
+			{
+				auto c = framebuffer.get_color(x, y) * 255.0f;
+				out << int(c.r) << " " << int(c.g) << " " << int(c.b) << " ";
+			}
+			out << "\n";
 		}
-		out << "\n";
-	}
+	});
 }
@@ -7,9 +7,11 @@ class RenderPpm : public RenderTarget
 {
 public:
 	
-	RenderPpm(int w, int h);
+	RenderPpm(int w, int h, std::shared_ptr<ThreadPool> thread_pool = nullptr);
+
+	~RenderPpm();
 	
-	void save(std::string_view filename);
+	FrameFence save(std::string_view filename);
 
 private:
 
@@ -56,7 +56,7 @@ struct RenderStates
 	bool depth_test = false;
 	bool alpha_test = true;
 	float alpha_test_threshold = 0.5f;
-	bool eary_z_test = false;
+	bool eary_z_test = true;		// allows the device to test depth before shading when the fragment shader and states make it safe
 	bool depth_mask = false;
 	CullFaceMode cull_face_mode = CullFaceMode::NONE;
 	FrontVertexOrder front_vertex_order = FrontVertexOrder::COUNTER_CLOCKWISE;
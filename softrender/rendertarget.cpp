@@ -1,18 +1,129 @@
 #include "rendertarget.h"
 #include "model.h"
 
+void FrameFence::wait() const
+{
+	if (_future.valid())
+		_future.wait();
+}
+
+bool FrameFence::signaled() const
+{
+	return !_future.valid() || _future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+
+RenderTarget::RenderTarget(std::shared_ptr<ThreadPool> thread_pool)
+	: _thread_pool(std::move(thread_pool))
+{
+	_presenter = std::thread(&RenderTarget::_present_loop, this);
+}
+
+RenderTarget::~RenderTarget()
+{
+	{
+		std::lock_guard<std::mutex> lk(_present_mtx);
+		_is_shutdown = true;
+	}
+	_present_cond.notify_all();
+	_presenter.join();
+}
+
 void RenderTarget::clear(const Color4& color, float depth)
 {
-	_framebuffer->clear_color(color);
-	_framebuffer->clear_depth(std::numeric_limits<float>::max());
+	auto& framebuffer = back_buffer();
+	framebuffer.clear_color(color);
+	framebuffer.clear_depth(std::numeric_limits<float>::max());
 }
 
 void RenderTarget::draw(std::shared_ptr<RenderDevice> device, const VertexArray& vertices)
 {
-	device->draw(*_framebuffer, vertices);
+	device->draw(back_buffer(), vertices);
 }
 
 void RenderTarget::draw(std::shared_ptr<RenderDevice> device, Model& model)
 {
-	model.draw(device, *_framebuffer);
+	model.draw(device, back_buffer());
+}
+
+FrameFence RenderTarget::submit()
+{
+	return submit([this](FrameBuffer& framebuffer) { present(framebuffer); });
+}
+
+void RenderTarget::wait_idle()
+{
+	for (auto& fence : _fences)
+		fence.wait();
+}
+
+FrameBuffer& RenderTarget::back_buffer()
+{
+	assert(!_framebuffers.empty());
+	_fences[_back_index].wait();
+	return *_framebuffers[_back_index];
+}
+
+int RenderTarget::swap_chain_length() const
+{
+	return _framebuffers.size();
+}
+
+void RenderTarget::create_swap_chain(
+	int width,
+	int height,
+	FrameBuffer::ColorFormat color_format,
+	FrameBuffer::DepthFormat depth_format,
+	int length)
+{
+	assert(length > 0);
+	wait_idle();
+	_framebuffers.clear();
+	for (int i = 0; i < length; i++)
+		_framebuffers.push_back(std::make_unique<FrameBuffer>(width, height, color_format, depth_format, _thread_pool));
+	_fences.assign(length, FrameFence());
+	_back_index = 0;
+}
+
+FrameFence RenderTarget::submit(std::function<void(FrameBuffer&)> present)
+{
+	assert(!_framebuffers.empty());
+	auto& framebuffer = *_framebuffers[_back_index];
+	std::packaged_task<void()> task([present = std::move(present), &framebuffer] { present(framebuffer); });
+
+	FrameFence fence;
+	fence._future = task.get_future().share();
+	_fences[_back_index] = fence;
+	{
+		std::lock_guard<std::mutex> lk(_present_mtx);
+		_present_queue.push(std::move(task));
+	}
+	_present_cond.notify_one();
+
+	_back_index = (_back_index + 1) % _framebuffers.size();
+	return fence;
+}
+
+void RenderTarget::_present_loop()
+{
+	std::unique_lock<std::mutex> lk(_present_mtx);
+	while (true)
+	{
+		if (!_present_queue.empty())
+		{
+			auto task = std::move(_present_queue.front());
+			_present_queue.pop();
+			lk.unlock();
+			task();
+			lk.lock();
+		}
+		else if (_is_shutdown)
+		{
+			break;
+		}
+		else
+		{
+			_present_cond.wait(lk);
+		}
+	}
 }
@@ -2,27 +2,93 @@
 #define RENDER_TARGET_H
 
 #include <memory>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
 #include "renderdevice.h"
 #include "framebuffer.h"
 
 class Model;
 
+class FrameFence
+{
+public:
+
+	FrameFence() = default;
+
+	void wait() const;
+
+	bool signaled() const;
+
+private:
+
+	friend class RenderTarget;
+
+	std::shared_future<void> _future;
+
+};
+
 class RenderTarget
 {
 public:
 
-	virtual ~RenderTarget() = default;
-	
+	static constexpr int DEFAULT_SWAP_CHAIN_LENGTH = 2;
+
+	// the swap chain buffers are banded and cleared on thread_pool, pass the pool of the device
+	// that draws into them, see FrameBuffer::band_count
+	explicit RenderTarget(std::shared_ptr<ThreadPool> thread_pool = nullptr);
+
+	virtual ~RenderTarget();
+
 	void clear(const Color4& color, float depth = std::numeric_limits<float>::max());
 
 	void draw(std::shared_ptr<RenderDevice> device, const VertexArray& vertices);
 
 	void draw(std::shared_ptr<RenderDevice> device, Model& model);
 
+	// hands the back buffer to the presenter thread and moves on to the next buffer of the swap chain,
+	// only blocks later if that buffer is still being presented
+	FrameFence submit();
+
+	void wait_idle();
+
+	FrameBuffer& back_buffer();
+
+	int swap_chain_length() const;
+
 protected:
 
-	std::unique_ptr<FrameBuffer> _framebuffer = nullptr;
-	
+	void create_swap_chain(
+		int width,
+		int height,
+		FrameBuffer::ColorFormat color_format = FrameBuffer::ColorFormat::LDR_RGB,
+		FrameBuffer::DepthFormat depth_format = FrameBuffer::DepthFormat::FLOAT32,
+		int length = DEFAULT_SWAP_CHAIN_LENGTH);
+
+	FrameFence submit(std::function<void(FrameBuffer&)> present);
+
+	// runs on the presenter thread
+	virtual void present(FrameBuffer& /*framebuffer*/) { }
+
+private:
+
+	std::shared_ptr<ThreadPool> _thread_pool;
+	std::vector<std::unique_ptr<FrameBuffer>> _framebuffers;
+	std::vector<FrameFence> _fences;
+	int _back_index = 0;
+
+	std::thread _presenter;
+	std::mutex _present_mtx;
+	std::condition_variable _present_cond;
+	std::queue<std::packaged_task<void()>> _present_queue;
+	bool _is_shutdown = false;
+
+	void _present_loop();
+
 };
 
-#endif
\ No newline at end of file
+#endif
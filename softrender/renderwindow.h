@@ -31,7 +31,7 @@ class RenderWindow : public RenderTarget
 {
 public:
 
-	RenderWindow();
+	explicit RenderWindow(std::shared_ptr<ThreadPool> thread_pool = nullptr);
 
 	~RenderWindow();
 
@@ -43,7 +43,7 @@ public:
 
 	bool is_open() const;
 
-	void show();
+	FrameFence show();
 
 	void poll_events();
 	
@@ -55,6 +55,10 @@ public:
 	ScrollCallbackFunc			scroll_callback			= nullptr;
 	UpdateFunc					update_callback			= nullptr;
 
+protected:
+
+	void present(FrameBuffer& framebuffer) override;
+
 private:
 
 	std::unique_ptr<RenderWindowData> _data;
@@ -1,5 +1,6 @@
 #include "renderwindow.h"
 #include <iostream>
+#include <atomic>
 #include <Windows.h>
 
 static constexpr size_t WINDOW_TITLE_MAX_LEN = 128;
@@ -19,7 +20,8 @@ struct RenderWindowData
     int height;
     int bmp_width;
     int bmp_height;
-	bool is_open = false;
+	// read by present on the presenter thread
+	std::atomic<bool> is_open = false;
     HWND handle = NULL;
     HDC memory_dc = NULL;
     unsigned char* surface_buffer;
@@ -102,7 +104,8 @@ static void blit_buffer(unsigned char* surface, unsigned char* src, int width, i
 	}
 }
 
-RenderWindow::RenderWindow()
+RenderWindow::RenderWindow(std::shared_ptr<ThreadPool> thread_pool)
+    : RenderTarget(std::move(thread_pool))
 {
 	_data = std::make_unique<RenderWindowData>();
 }
@@ -180,7 +183,7 @@ bool RenderWindow::open(int width, int height, std::string_view title_sv)
 
     _data->width = width;
     _data->height = height;
-    _framebuffer = std::make_unique<FrameBuffer>(width, height);
+    create_swap_chain(width, height);
     _data->width = width;
     _data->height = height;
 
@@ -206,6 +209,7 @@ void RenderWindow::close()
 {
 	if (_data->is_open)
 	{
+        wait_idle();
         if (_data->memory_dc)
         {
             DeleteDC(_data->memory_dc);
@@ -225,17 +229,25 @@ bool RenderWindow::is_open() const
     return _data->is_open;
 }
 
-void RenderWindow::show()
+FrameFence RenderWindow::show()
 {
+    return submit();
+}
+
+void RenderWindow::present(FrameBuffer& framebuffer)
+{
+    if (!_data->is_open)
+        return;
+
     int width  = _data->width;
     int height = _data->height;
 
     int ind = 0;
     while (ind < width * height * 3)
     {
-        _data->surface_buffer[ind + 0] = _framebuffer->ldr_color_buffer_data()[ind + 2];
-		_data->surface_buffer[ind + 1] = _framebuffer->ldr_color_buffer_data()[ind + 1];
-		_data->surface_buffer[ind + 2] = _framebuffer->ldr_color_buffer_data()[ind + 0];
+        _data->surface_buffer[ind + 0] = framebuffer.ldr_color_buffer_data()[ind + 2];
+		_data->surface_buffer[ind + 1] = framebuffer.ldr_color_buffer_data()[ind + 1];
+		_data->surface_buffer[ind + 2] = framebuffer.ldr_color_buffer_data()[ind + 0];
         ind += 3;
     }
 
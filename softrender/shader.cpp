@@ -3,18 +3,136 @@
 
 void Shader::set_device(std::shared_ptr<RenderDevice> device)
 {
-	_device = device;
+	_device = device.get();
+	_uniform_versions.clear();
+	_is_loaded = false;
 }
 
 std::shared_ptr<RenderDevice> Shader::device() const
 {
-	return _device;
+	return _device ? _device->shared_from_this() : nullptr;
 }
 
-ShaderProgram::ShaderProgram(std::shared_ptr<VertexShader> vs, std::shared_ptr<FragmentShader> fs, int varying_num)
+bool Shader::update_uniforms()
+{
+	assert(_device);
+	if (_is_loaded)
+	{
+		bool changed = false;
+		for (auto& [block, version] : _uniform_versions)
+			changed |= _device->shader_uniform_block_version(block) != version;
+		if (!changed)
+			return false;
+	}
+	_uniform_versions.clear();
+	load_uniforms();
+	_is_loaded = true;
+	return true;
+}
+
+void Shader::_depend_on(int block)
+{
+	if (block < 0)
+		return;
+	for (auto& [dep, version] : _uniform_versions)
+		if (dep == block)
+			return;
+	_uniform_versions.emplace_back(block, _device->shader_uniform_block_version(block));
+}
+
+void VertexShader::run_batch(const VSInBatch& in, VSOutBatch& out)
+{
+	alignas(32) float lanes[MAX_ATTRIBUTE_NUM][4][SIMD_WIDTH];
+	alignas(32) float out_lanes[4][SIMD_WIDTH];
+	for (int a = 0; a < MAX_ATTRIBUTE_NUM; a++)
+		for (int c = 0; c < 4; c++)
+			in.attributes[a][c].store(lanes[a][c]);
+
+	// one record per lane, transposed back once every lane has run
+	int record_size = 1 + out.varying_num;
+	std::vector<Vec4> records(record_size * SIMD_WIDTH);
+	for (int lane = 0; lane < SIMD_WIDTH; lane++)
+	{
+		VSIn vsin;
+		VSOut vsout(&records[lane * record_size]);
+		for (int a = 0; a < MAX_ATTRIBUTE_NUM; a++)
+			for (int c = 0; c < 4; c++)
+				vsin.attributes[a][c] = lanes[a][c][lane];
+		run(vsin, vsout);
+	}
+
+	for (int v = 0; v < record_size; v++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			for (int lane = 0; lane < SIMD_WIDTH; lane++)
+				out_lanes[c][lane] = records[lane * record_size + v][c];
+			(v == 0 ? out.position : out.out_varying[v - 1])[c] = Float8::load(out_lanes[c]);
+		}
+	}
+}
+
+void FragmentShader::run_packet(const FSInPacket& in, FSOutPacket& out)
+{
+	alignas(32) float lanes[4][SIMD_WIDTH];
+	alignas(32) float frag_x[SIMD_WIDTH];
+	alignas(32) float frag_y[SIMD_WIDTH];
+	alignas(32) float depth[SIMD_WIDTH];
+	alignas(32) float color[4][SIMD_WIDTH] = {};
+	int active = movemask(in.active);
+	int discarded = 0;
+	in.frag_coord.x.store(frag_x);
+	in.frag_coord.y.store(frag_y);
+	out.depth.store(depth);
+
+	// the varyings of all lanes, then their x and y derivatives if the packet has them
+	const Vec4x8* streams[] = { in.in_varying, in.ddx_varying, in.ddy_varying };
+	int stream_num = in.ddx_varying ? 3 : 1;
+	size_t stream_size = size_t(in.varying_num) * SIMD_WIDTH;
+	std::vector<Vec4> records(stream_size * stream_num);
+	for (int s = 0; s < stream_num; s++)
+	{
+		for (int v = 0; v < in.varying_num; v++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				streams[s][v][c].store(lanes[c]);
+				for (int lane = 0; lane < SIMD_WIDTH; lane++)
+					records[s * stream_size + lane * in.varying_num + v][c] = lanes[c][lane];
+			}
+		}
+	}
+
+	for (int lane = 0; lane < SIMD_WIDTH; lane++)
+	{
+		if (!(active >> lane & 1))
+			continue;
+		FSOut fsout;
+		fsout.depth = depth[lane];
+		FSIn fsin(records.data() + lane * in.varying_num, Vec2(frag_x[lane], frag_y[lane]));
+		if (stream_num == 3)
+		{
+			fsin.ddx_varying = fsin.in_varying + stream_size;
+			fsin.ddy_varying = fsin.in_varying + stream_size * 2;
+		}
+		run(fsin, fsout);
+		for (int c = 0; c < 4; c++)
+			color[c][lane] = fsout.color[c];
+		discarded |= int(fsout.discarded) << lane;
+		depth[lane] = fsout.depth;
+	}
+
+	for (int c = 0; c < 4; c++)
+		out.color[c] = Float8::load(color[c]);
+	out.depth = Float8::load(depth);
+	out.discarded = mask8(discarded);
+}
+
+ShaderProgram::ShaderProgram(std::shared_ptr<VertexShader> vs, std::shared_ptr<FragmentShader> fs, int varying_num, DrawFunction specialized_draw)
 	: vertex_shader(vs)
 	, fragment_shader(fs)
 	, varying_num(varying_num)
+	, specialized_draw(specialized_draw)
 {
 	
 }
\ No newline at end of file
@@ -3,7 +3,7 @@
 
 #include <memory>
 #include <string>
-#include <any>
+#include <vector>
 #include "maths.h"
 #include "renderdevice.h"
 
@@ -16,26 +16,56 @@ public:
 
 	std::shared_ptr<RenderDevice> device() const;
 
+	// calls load_uniforms if a uniform block it read last time has changed, runs once per draw
+	// on the submitting thread so workers only read the shader's snapshot
+	bool update_uniforms();
+
 	virtual void load_uniforms() { }
 
+	// called by RenderDevice::set_shader_program, shaders that generate code do it here
+	virtual void compile() { }
+
 	virtual ~Shader() = default;
 
 protected:
 
 	template<class T>
-	T get_uniform(std::string_view name, const T& default_val = T()) const
+	T get_uniform(UniformHandle<T> handle, const typename UniformHandle<T>::value_type& default_val = T())
+	{
+		_depend_on(handle.block);
+		return _device->get_shader_uniform(handle, default_val);
+	}
+
+	template<class T>
+	bool has_uniform(UniformHandle<T> handle)
 	{
-		return _device->get_shader_uniform<T>(name, default_val);
+		_depend_on(handle.block);
+		return _device->has_shader_uniform(handle);
 	}
 
-	bool has_shader_uniform(std::string_view name) const
+	// registers the name so the shader is reloaded once the uniform is set later
+	template<class T>
+	T get_uniform(std::string_view name, const T& default_val = T())
+	{
+		return get_uniform(UniformRegistry::register_uniform<T>(name), default_val);
+	}
+
+	bool has_shader_uniform(std::string_view name)
 	{
+		_depend_on(UniformRegistry::find_block(name.substr(0, name.find('.'))));
 		return _device->has_shader_uniform(name);
 	}
 
 private:
 
-	std::shared_ptr<RenderDevice> _device = nullptr;
+	// the device owns its shader copies, so a raw pointer avoids a reference cycle
+	RenderDevice* _device = nullptr;
+
+	// blocks read by the last load_uniforms and their versions at that time
+	std::vector<std::pair<int, uint64_t>> _uniform_versions;
+	bool _is_loaded = false;
+
+	void _depend_on(int block);
 	
 };
 
@@ -44,7 +74,22 @@ class VertexShader : public Shader
 
 public:
 
+	// every device runs its own copy of the shaders it is given
+	virtual std::shared_ptr<VertexShader> clone() const = 0;
+
+	// called on the worker thread before each batch of vertices, per-thread state is reset here
+	virtual void begin_batch() { }
+
+	// called by draw_instanced before the vertices of each instance are run
+	virtual void load_instance(const Instance& /*instance*/, size_t /*instance_id*/) { }
+
 	virtual void run(const VSIn& in, VSOut& out) = 0;
+
+	// number of attributes run_batch reads, 0 if the shader only has the per-vertex path
+	virtual int batch_attribute_num() const { return 0; }
+
+	// shades VS_BATCH_SIZE vertices at once, the default runs each lane through run
+	virtual void run_batch(const VSInBatch& in, VSOutBatch& out);
 	
 	virtual ~VertexShader() = default;
 
@@ -54,7 +99,23 @@ class FragmentShader : public Shader
 {
 public:
 
+	virtual std::shared_ptr<FragmentShader> clone() const = 0;
+
 	virtual void run(const FSIn& in, FSOut& out) = 0;
+
+	virtual bool supports_packet() const { return false; }
+
+	// lets the device test depth before shading, the defaults are safe for any shader.
+	// may_discard is true if run can set discarded, writes_depth if it changes FSOut::depth
+	virtual bool may_discard() const { return true; }
+
+	virtual bool writes_depth() const { return false; }
+
+	// asks the device for FSIn::ddx_varying and ddy_varying, which cost a gradient setup per triangle
+	virtual bool uses_derivatives() const { return false; }
+
+	// shades FS_PACKET_SIZE fragments at once, the default runs each active lane through run
+	virtual void run_packet(const FSInPacket& in, FSOutPacket& out);
 	
 	virtual ~FragmentShader() = default;
 	
@@ -62,12 +123,16 @@ public:
 
 struct ShaderProgram
 {
+	// runs RenderDevice::draw instantiated for the program's own shader classes
+	using DrawFunction = void (*)(RenderDevice& device, FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count);
+
 	std::shared_ptr<VertexShader> vertex_shader	 = nullptr;
 	std::shared_ptr<FragmentShader> fragment_shader = nullptr;
 	int varying_num = 0;
+	DrawFunction specialized_draw = nullptr;
 
 	ShaderProgram() = default;
-	ShaderProgram(std::shared_ptr<VertexShader> vs, std::shared_ptr<FragmentShader> fs, int varying_num);
+	ShaderProgram(std::shared_ptr<VertexShader> vs, std::shared_ptr<FragmentShader> fs, int varying_num, DrawFunction specialized_draw = nullptr);
 };
 
 #endif
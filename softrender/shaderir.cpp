@@ -0,0 +1,228 @@
+#include "shaderir.h"
+#include "shaderjit.h"
+#include <cstring>
+#include <cassert>
+
+namespace ShaderIR
+{
+	Program::Program()
+	{
+		for (int& slot : builtin_slots)
+			slot = -1;
+	}
+
+	Program::~Program() = default;
+
+	void Program::compile() const
+	{
+		std::call_once(_compile_flag, [this] { _code = JitCode::compile(*this); });
+	}
+
+	bool Program::is_native() const
+	{
+		return _code != nullptr;
+	}
+
+	void Program::execute(Float8* registers, const ExecContext& context) const
+	{
+		if (_code)
+		{
+			_code->function()(registers, &context);
+			return;
+		}
+		for (auto& instruction : instructions)
+			execute_instruction(registers, &context, &instruction);
+	}
+
+	void execute_instruction(Float8* registers, const ExecContext* context, const Instruction* instruction)
+	{
+		auto& inst = *instruction;
+		auto& dst = registers[inst.dst];
+		switch (inst.op)
+		{
+		case Op::CONSTANT:	 dst = Float8(context->constants[inst.index]); break;
+		case Op::ADD:		 dst = registers[inst.a] + registers[inst.b]; break;
+		case Op::SUB:		 dst = registers[inst.a] - registers[inst.b]; break;
+		case Op::MUL:		 dst = registers[inst.a] * registers[inst.b]; break;
+		case Op::DIV:		 dst = registers[inst.a] / registers[inst.b]; break;
+		case Op::MIN:		 dst = ::min(registers[inst.a], registers[inst.b]); break;
+		case Op::MAX:		 dst = ::max(registers[inst.a], registers[inst.b]); break;
+		case Op::SQRT:		 dst = ::sqrt(registers[inst.a]); break;
+		case Op::LESS:		 dst = registers[inst.a] < registers[inst.b]; break;
+		case Op::LESS_EQUAL: dst = registers[inst.a] <= registers[inst.b]; break;
+		case Op::SELECT:	 dst = ::select(registers[inst.a], registers[inst.b], registers[inst.c]); break;
+		case Op::POW:		 dst = ::pow(registers[inst.a], registers[inst.b]); break;
+		case Op::EXP:		 dst = ::exp(registers[inst.a]); break;
+		case Op::SAMPLE:
+		{
+			Vec4x8 color = context->samplers[inst.index].sample(Vec2x8(registers[inst.a], registers[inst.b]), context->active);
+			for (int i = 0; i < 4; i++)
+				registers[inst.dst + i] = color[i];
+			break;
+		}
+		}
+	}
+
+
+	Builder::Builder(int input_num, int output_num)
+		: _program(std::make_shared<Program>())
+	{
+		_program->input_num = input_num;
+		_program->output_num = output_num;
+		_program->register_num = input_num * 4;
+		_program->outputs.assign(output_num * 4, -1);
+	}
+
+	Value4 Builder::input(int slot)
+	{
+		assert(slot >= 0 && slot < _program->input_num);
+		return map<4>([&](int i) { return Value{ this, slot * 4 + i }; });
+	}
+
+	void Builder::output(int slot, const Value4& value)
+	{
+		assert(slot >= 0 && slot < _program->output_num);
+		for (int i = 0; i < 4; i++)
+			_program->outputs[slot * 4 + i] = value[i].id;
+	}
+
+	Value Builder::constant(float value)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		auto it = _literals.find(bits);
+		if (it == _literals.end())
+		{
+			it = _literals.emplace(bits, int(_program->constants.size())).first;
+			_program->constants.push_back(value);
+		}
+		return _load(it->second);
+	}
+
+	Value3 Builder::constant(const Vec3& value)
+	{
+		return map<3>([&](int i) { return constant(value[i]); });
+	}
+
+	Value Builder::uniform(UniformHandle<float> handle, float default_val)
+	{
+		int slot = _add_uniform(UniformBinding::Type::FLOAT, handle.id, handle.block, handle.offset, &default_val, 1);
+		return _load(slot);
+	}
+
+	Value3 Builder::uniform(UniformHandle<Vec3> handle, const Vec3& default_val)
+	{
+		float values[3] = { default_val.x, default_val.y, default_val.z };
+		int slot = _add_uniform(UniformBinding::Type::VEC3, handle.id, handle.block, handle.offset, values, 3);
+		return map<3>([&](int i) { return _load(slot + i); });
+	}
+
+	Value4 Builder::uniform(UniformHandle<Color4> handle, const Color4& default_val)
+	{
+		float values[4] = { default_val.x, default_val.y, default_val.z, default_val.w };
+		int slot = _add_uniform(UniformBinding::Type::COLOR4, handle.id, handle.block, handle.offset, values, 4);
+		return map<4>([&](int i) { return _load(slot + i); });
+	}
+
+	Matrix4 Builder::matrix4(Builtin builtin)
+	{
+		int slot = _builtin_slot(builtin, 16);
+		Matrix4 m;
+		for (int j = 0; j < 4; j++)
+			for (int i = 0; i < 4; i++)
+				m.m[j][i] = _load(slot + j * 4 + i);
+		return m;
+	}
+
+	Matrix3 Builder::matrix3(Builtin builtin)
+	{
+		int slot = _builtin_slot(builtin, 9);
+		Matrix3 m;
+		for (int j = 0; j < 3; j++)
+			for (int i = 0; i < 3; i++)
+				m.m[j][i] = _load(slot + j * 3 + i);
+		return m;
+	}
+
+	int Builder::sampler(UniformHandle<TextureSampler> handle, const TextureSampler& default_val, int fallback)
+	{
+		assert(fallback < int(_program->samplers.size()));
+		_program->samplers.push_back({ handle, default_val, fallback });
+		return int(_program->samplers.size()) - 1;
+	}
+
+	Value4 Builder::sample(int sampler, const Value2& texcoord)
+	{
+		assert(sampler >= 0 && sampler < int(_program->samplers.size()));
+		int dst = _program->register_num;
+		_program->register_num += 4;
+		Instruction inst;
+		inst.op = Op::SAMPLE;
+		inst.dst = dst;
+		inst.a = texcoord[0].id;
+		inst.b = texcoord[1].id;
+		inst.index = sampler;
+		_program->instructions.push_back(inst);
+		return map<4>([&](int i) { return Value{ this, dst + i }; });
+	}
+
+	Value Builder::emit(Op op, Value a, Value b, Value c)
+	{
+		Instruction inst;
+		inst.op = op;
+		inst.dst = _program->register_num++;
+		inst.a = a.id;
+		inst.b = b.id;
+		inst.c = c.id;
+		_program->instructions.push_back(inst);
+		return { this, inst.dst };
+	}
+
+	std::shared_ptr<Program> Builder::build()
+	{
+		for (int id : _program->outputs)
+			assert(id >= 0 && "output not written");
+		return std::move(_program);
+	}
+
+	Value Builder::_load(int slot)
+	{
+		// every slot is broadcast into a register once
+		auto it = _loaded_slots.find(slot);
+		if (it != _loaded_slots.end())
+			return { this, it->second };
+		Instruction inst;
+		inst.op = Op::CONSTANT;
+		inst.dst = _program->register_num++;
+		inst.index = slot;
+		_program->instructions.push_back(inst);
+		_loaded_slots.emplace(slot, inst.dst);
+		return { this, inst.dst };
+	}
+
+	int Builder::_add_uniform(UniformBinding::Type type, int id, int block, uint32_t offset, const float* default_val, int size)
+	{
+		for (auto& binding : _program->uniforms)
+			if (binding.id == id)
+				return binding.slot;
+		UniformBinding binding = { type, id, block, offset, int(_program->constants.size()), {} };
+		for (int i = 0; i < size; i++)
+		{
+			binding.default_val[i] = default_val[i];
+			_program->constants.push_back(default_val[i]);
+		}
+		_program->uniforms.push_back(binding);
+		return binding.slot;
+	}
+
+	int Builder::_builtin_slot(Builtin builtin, int size)
+	{
+		int& slot = _program->builtin_slots[int(builtin)];
+		if (slot < 0)
+		{
+			slot = int(_program->constants.size());
+			_program->constants.resize(_program->constants.size() + size, 0.0f);
+		}
+		return slot;
+	}
+}
@@ -0,0 +1,292 @@
+#ifndef SHADER_IR_H
+#define SHADER_IR_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include "maths.h"
+#include "simd.h"
+#include "uniform.h"
+#include "texture.h"
+
+// a small shader IR: straight-line SSA over 8-wide float registers. programs are built with
+// Builder, compiled to native code once per process when the platform has an emitter and
+// interpreted otherwise
+namespace ShaderIR
+{
+	enum class Op : uint8_t
+	{
+		CONSTANT,		// dst = broadcast constants[index]
+		ADD,
+		SUB,
+		MUL,
+		DIV,
+		MIN,
+		MAX,
+		SQRT,			// dst = sqrt(a)
+		LESS,			// dst = mask(a < b)
+		LESS_EQUAL,		// dst = mask(a <= b)
+		SELECT,			// dst = a ? b : c
+		POW,
+		EXP,			// dst = exp(a)
+		SAMPLE,			// dst..dst+3 = samplers[index].sample((a, b))
+	};
+
+	struct Instruction
+	{
+		Op op;
+		int dst;
+		int a = -1;
+		int b = -1;
+		int c = -1;
+		int index = 0;
+	};
+
+	// matrices filled in by the IR shaders from the transform uniforms
+	enum class Builtin
+	{
+		MODELVIEW,
+		PROJECTION,
+		NORMAL_TRANSFORM,
+		NUM
+	};
+
+	struct UniformBinding
+	{
+		enum class Type { FLOAT, VEC3, COLOR4 };
+
+		Type type;
+		int id;
+		int block;
+		uint32_t offset;
+		int slot;
+		float default_val[4];
+	};
+
+	struct SamplerBinding
+	{
+		UniformHandle<TextureSampler> handle;
+		TextureSampler default_val;
+		int fallback = -1;		// sampler used instead when this one is empty
+	};
+
+	// per-call state the instructions read besides the registers
+	struct ExecContext
+	{
+		const float* constants = nullptr;
+		const TextureSampler* samplers = nullptr;
+		Mask8 active;
+	};
+
+	class JitCode;
+
+	class Program
+	{
+	public:
+
+		std::vector<Instruction> instructions;
+		int input_num = 0;
+		int output_num = 0;
+		int register_num = 0;
+
+		// registers holding each output, 4 per output slot
+		std::vector<int> outputs;
+
+		// literal values followed by the uniform slots, which hold their defaults
+		std::vector<float> constants;
+		std::vector<UniformBinding> uniforms;
+		std::vector<SamplerBinding> samplers;
+
+		// first constant slot of each builtin matrix, -1 if the program does not use it
+		int builtin_slots[int(Builtin::NUM)];
+
+		Program();
+
+		~Program();
+
+		// emits native code on the first call, later calls and unsupported platforms do nothing
+		void compile() const;
+
+		bool is_native() const;
+
+		// inputs are read from registers [0, 4 * input_num), outputs are left in their registers
+		void execute(Float8* registers, const ExecContext& context) const;
+
+	private:
+
+		mutable std::once_flag _compile_flag;
+		mutable std::unique_ptr<JitCode> _code;
+
+	};
+
+	// runs one instruction, also called from native code for the ops it does not emit inline
+	void execute_instruction(Float8* registers, const ExecContext* context, const Instruction* instruction);
+
+
+	class Builder;
+
+	struct Value
+	{
+		Builder* builder = nullptr;
+		int id = -1;
+	};
+
+	template<int N>
+	struct Vector
+	{
+		Value v[N];
+
+		Value& operator[](int i)			 { return v[i]; }
+		const Value& operator[](int i) const { return v[i]; }
+	};
+
+	using Value2 = Vector<2>;
+	using Value3 = Vector<3>;
+	using Value4 = Vector<4>;
+
+	struct Matrix3 { Value m[3][3]; };
+	struct Matrix4 { Value m[4][4]; };
+
+	class Builder
+	{
+	public:
+
+		Builder(int input_num, int output_num);
+
+		Value4 input(int slot);
+
+		void output(int slot, const Value4& value);
+
+		Value constant(float value);
+
+		Value3 constant(const Vec3& value);
+
+		Value uniform(UniformHandle<float> handle, float default_val = 0.0f);
+
+		Value3 uniform(UniformHandle<Vec3> handle, const Vec3& default_val = Vec3());
+
+		Value4 uniform(UniformHandle<Color4> handle, const Color4& default_val = Color4());
+
+		// matrices are indexed like the glm ones, m[column][row]
+		Matrix4 matrix4(Builtin builtin);
+
+		Matrix3 matrix3(Builtin builtin);
+
+		// returns the sampler index, fallback is used in place of an empty sampler
+		int sampler(UniformHandle<TextureSampler> handle, const TextureSampler& default_val, int fallback = -1);
+
+		Value4 sample(int sampler, const Value2& texcoord);
+
+		Value emit(Op op, Value a, Value b = Value(), Value c = Value());
+
+		std::shared_ptr<Program> build();
+
+	private:
+
+		std::shared_ptr<Program> _program;
+		std::unordered_map<uint32_t, int> _literals;
+		std::unordered_map<int, int> _loaded_slots;
+
+		Value _load(int slot);
+
+		int _add_uniform(UniformBinding::Type type, int id, int block, uint32_t offset, const float* default_val, int size);
+
+		int _builtin_slot(Builtin builtin, int size);
+
+	};
+
+
+	inline Value operator+(Value a, Value b) { return a.builder->emit(Op::ADD, a, b); }
+	inline Value operator-(Value a, Value b) { return a.builder->emit(Op::SUB, a, b); }
+	inline Value operator*(Value a, Value b) { return a.builder->emit(Op::MUL, a, b); }
+	inline Value operator/(Value a, Value b) { return a.builder->emit(Op::DIV, a, b); }
+	inline Value operator+(Value a, float b) { return a + a.builder->constant(b); }
+	inline Value operator-(Value a, float b) { return a - a.builder->constant(b); }
+	inline Value operator*(Value a, float b) { return a * a.builder->constant(b); }
+	inline Value operator/(Value a, float b) { return a / a.builder->constant(b); }
+	inline Value operator+(float a, Value b) { return b.builder->constant(a) + b; }
+	inline Value operator-(float a, Value b) { return b.builder->constant(a) - b; }
+	inline Value operator*(float a, Value b) { return b.builder->constant(a) * b; }
+	inline Value operator/(float a, Value b) { return b.builder->constant(a) / b; }
+	inline Value operator-(Value a)			 { return 0.0f - a; }
+
+	inline Value operator<(Value a, Value b)  { return a.builder->emit(Op::LESS, a, b); }
+	inline Value operator<=(Value a, Value b) { return a.builder->emit(Op::LESS_EQUAL, a, b); }
+	inline Value operator>(Value a, Value b)  { return b < a; }
+	inline Value operator>=(Value a, Value b) { return b <= a; }
+	inline Value operator>(Value a, float b)  { return a > a.builder->constant(b); }
+
+	inline Value min(Value a, Value b)		  { return a.builder->emit(Op::MIN, a, b); }
+	inline Value max(Value a, Value b)		  { return a.builder->emit(Op::MAX, a, b); }
+	inline Value max(float a, Value b)		  { return max(b.builder->constant(a), b); }
+	inline Value sqrt(Value a)				  { return a.builder->emit(Op::SQRT, a); }
+	inline Value pow(Value a, Value b)		  { return a.builder->emit(Op::POW, a, b); }
+	inline Value exp(Value a)				  { return a.builder->emit(Op::EXP, a); }
+	inline Value select(Value m, Value a, Value b) { return m.builder->emit(Op::SELECT, m, a, b); }
+
+	// x^(2^n) by repeated squaring
+	inline Value pow2n(Value x, int n)
+	{
+		for (int i = 0; i < n; i++)
+			x = x * x;
+		return x;
+	}
+
+	template<int N, class F>
+	Vector<N> map(F&& f)
+	{
+		Vector<N> r;
+		for (int i = 0; i < N; i++)
+			r[i] = f(i);
+		return r;
+	}
+
+	template<int N> Vector<N> operator+(const Vector<N>& a, const Vector<N>& b) { return map<N>([&](int i) { return a[i] + b[i]; }); }
+	template<int N> Vector<N> operator-(const Vector<N>& a, const Vector<N>& b) { return map<N>([&](int i) { return a[i] - b[i]; }); }
+	template<int N> Vector<N> operator*(const Vector<N>& a, const Vector<N>& b) { return map<N>([&](int i) { return a[i] * b[i]; }); }
+	template<int N> Vector<N> operator*(const Vector<N>& a, Value s)			{ return map<N>([&](int i) { return a[i] * s; }); }
+	template<int N> Vector<N> operator*(const Vector<N>& a, float s)			{ return a * a[0].builder->constant(s); }
+	template<int N> Vector<N> operator-(const Vector<N>& a)						{ return map<N>([&](int i) { return -a[i]; }); }
+	template<int N> Vector<N> operator-(float s, const Vector<N>& a)			{ return map<N>([&](int i) { return s - a[i]; }); }
+	template<int N> Vector<N> min(const Vector<N>& a, const Vector<N>& b)		{ return map<N>([&](int i) { return min(a[i], b[i]); }); }
+	template<int N> Vector<N> max(const Vector<N>& a, const Vector<N>& b)		{ return map<N>([&](int i) { return max(a[i], b[i]); }); }
+	template<int N> Vector<N> pow(const Vector<N>& a, Value e)					{ return map<N>([&](int i) { return pow(a[i], e); }); }
+	template<int N> Vector<N> exp(const Vector<N>& a)							{ return map<N>([&](int i) { return exp(a[i]); }); }
+	template<int N> Vector<N> select(Value m, const Vector<N>& a, const Vector<N>& b) { return map<N>([&](int i) { return select(m, a[i], b[i]); }); }
+
+	template<int N>
+	Value dot(const Vector<N>& a, const Vector<N>& b)
+	{
+		Value r = a[0] * b[0];
+		for (int i = 1; i < N; i++)
+			r = r + a[i] * b[i];
+		return r;
+	}
+
+	template<int N>
+	Vector<N> normalize(const Vector<N>& a)
+	{
+		return a * (1.0f / sqrt(dot(a, a)));
+	}
+
+	inline Value2 vec2(const Value4& v) { return { { v[0], v[1] } }; }
+	inline Value3 vec3(const Value4& v) { return { { v[0], v[1], v[2] } }; }
+	inline Value4 vec4(const Value3& v, Value w) { return { { v[0], v[1], v[2], w } }; }
+	inline Value4 vec4(const Value3& v, float w = 1.0f) { return vec4(v, v[0].builder->constant(w)); }
+
+	// row vector times matrix, same convention as vec4 * Mat4
+	inline Value4 operator*(const Value4& v, const Matrix4& m)
+	{
+		return map<4>([&](int j) { return v[0] * m.m[j][0] + v[1] * m.m[j][1] + v[2] * m.m[j][2] + v[3] * m.m[j][3]; });
+	}
+
+	// matrix times column vector, same convention as Mat3 * vec3
+	inline Value3 operator*(const Matrix3& m, const Value3& v)
+	{
+		return map<3>([&](int i) { return v[0] * m.m[0][i] + v[1] * m.m[1][i] + v[2] * m.m[2][i]; });
+	}
+}
+
+#endif
@@ -0,0 +1,330 @@
+#include "shaderjit.h"
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <initializer_list>
+#include <utility>
+
+#if defined(SHADER_JIT)
+#if defined(_WIN32)
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#endif
+
+namespace ShaderIR
+{
+#if defined(SHADER_JIT)
+
+	namespace
+	{
+		enum Gpr : uint8_t
+		{
+			RAX = 0,
+			RBX = 3,		// registers
+			RBP = 5,		// context
+		};
+
+		enum SseOpcode : uint8_t
+		{
+			MOVSS	= 0x10,
+			MOVAPS	= 0x28,
+			MOVAPS_STORE = 0x29,
+			SQRTPS	= 0x51,
+			ANDPS	= 0x54,
+			ANDNPS	= 0x55,
+			ORPS	= 0x56,
+			ADDPS	= 0x58,
+			MULPS	= 0x59,
+			SUBPS	= 0x5C,
+			MINPS	= 0x5D,
+			DIVPS	= 0x5E,
+			MAXPS	= 0x5F,
+			CMPPS	= 0xC2,
+			SHUFPS	= 0xC6,
+		};
+
+		enum CmpPredicate : uint8_t
+		{
+			CMP_LT = 1,
+			CMP_LE = 2,
+		};
+
+		bool is_inline(Op op)
+		{
+			return op != Op::POW && op != Op::EXP && op != Op::SAMPLE;
+		}
+
+		bool is_commutative(Op op)
+		{
+			return op == Op::ADD || op == Op::MUL;
+		}
+
+		// plain SSE and general purpose registers without REX extensions, every 8-wide register is
+		// handled as two 4-wide halves in xmm0 and xmm1, xmm2 and xmm3 are scratch
+		class Emitter
+		{
+		public:
+
+			std::vector<uint8_t> code;
+
+			void bytes(std::initializer_list<uint8_t> values)
+			{
+				code.insert(code.end(), values);
+			}
+
+			void imm32(uint32_t value)
+			{
+				for (int i = 0; i < 4; i++)
+					code.push_back(uint8_t(value >> (i * 8)));
+			}
+
+			void imm64(uint64_t value)
+			{
+				for (int i = 0; i < 8; i++)
+					code.push_back(uint8_t(value >> (i * 8)));
+			}
+
+			// op xmm, [base + disp32]
+			void sse_mem(uint8_t opcode, int xmm, Gpr base, int32_t disp, uint8_t prefix = 0)
+			{
+				if (prefix)
+					code.push_back(prefix);
+				bytes({ 0x0F, opcode, uint8_t(0x80 | xmm << 3 | base) });
+				imm32(uint32_t(disp));
+			}
+
+			// op dst, src
+			void sse_reg(uint8_t opcode, int dst, int src)
+			{
+				bytes({ 0x0F, opcode, uint8_t(0xC0 | dst << 3 | src) });
+			}
+
+			void prologue()
+			{
+				bytes({ 0x53 });						// push rbx
+				bytes({ 0x55 });						// push rbp
+				bytes({ 0x48, 0x83, 0xEC, 0x28 });		// sub rsp, 40 (aligns rsp and leaves the win64 shadow space)
+#if defined(_WIN32)
+				bytes({ 0x48, 0x89, 0xCB });			// mov rbx, rcx
+				bytes({ 0x48, 0x89, 0xD5 });			// mov rbp, rdx
+#else
+				bytes({ 0x48, 0x89, 0xFB });			// mov rbx, rdi
+				bytes({ 0x48, 0x89, 0xF5 });			// mov rbp, rsi
+#endif
+			}
+
+			void epilogue()
+			{
+				bytes({ 0x48, 0x83, 0xC4, 0x28 });		// add rsp, 40
+				bytes({ 0x5D });						// pop rbp
+				bytes({ 0x5B });						// pop rbx
+				bytes({ 0xC3 });						// ret
+			}
+
+			// execute_instruction(registers, context, instruction)
+			void call_instruction(const Instruction* instruction)
+			{
+#if defined(_WIN32)
+				bytes({ 0x48, 0x89, 0xD9 });			// mov rcx, rbx
+				bytes({ 0x48, 0x89, 0xEA });			// mov rdx, rbp
+				bytes({ 0x49, 0xB8 });					// mov r8, imm64
+#else
+				bytes({ 0x48, 0x89, 0xDF });			// mov rdi, rbx
+				bytes({ 0x48, 0x89, 0xEE });			// mov rsi, rbp
+				bytes({ 0x48, 0xBA });					// mov rdx, imm64
+#endif
+				imm64(reinterpret_cast<uint64_t>(instruction));
+				bytes({ 0x48, 0xB8 });					// mov rax, imm64
+				imm64(reinterpret_cast<uint64_t>(&execute_instruction));
+				bytes({ 0xFF, 0xD0 });					// call rax
+			}
+
+			// broadcasts constants[index] into xmm0 and xmm1
+			void load_constant(int index)
+			{
+				bytes({ 0x48, 0x8B, 0x85 });			// mov rax, [rbp + offsetof(constants)]
+				imm32(uint32_t(offsetof(ExecContext, constants)));
+				sse_mem(MOVSS, 0, RAX, index * int(sizeof(float)), 0xF3);
+				sse_reg(SHUFPS, 0, 0);
+				code.push_back(0x00);
+				sse_reg(MOVAPS, 1, 0);
+			}
+		};
+
+		int32_t disp(int reg, int half)
+		{
+			return int32_t(reg * sizeof(Float8) + half * sizeof(Float8) / 2);
+		}
+
+		std::vector<uint8_t> emit(const Program& program)
+		{
+			auto& instructions = program.instructions;
+
+			std::vector<int> uses(program.register_num, 0);
+			for (auto& inst : instructions)
+				for (int r : { inst.a, inst.b, inst.c })
+					if (r >= 0)
+						uses[r]++;
+			for (int r : program.outputs)
+				uses[r]++;
+
+			Emitter e;
+			e.prologue();
+
+			// the register whose halves are still in xmm0 and xmm1
+			int cached = -1;
+
+			for (size_t i = 0; i < instructions.size(); i++)
+			{
+				auto& inst = instructions[i];
+				if (!is_inline(inst.op))
+				{
+					e.call_instruction(&inst);
+					cached = -1;
+					continue;
+				}
+
+				int a = inst.a, b = inst.b;
+				if (is_commutative(inst.op) && b == cached && a != cached)
+					std::swap(a, b);
+
+				// a value only read by the next instruction as its first operand never goes to memory
+				bool store = true;
+				if (i + 1 < instructions.size() && uses[inst.dst] == 1)
+				{
+					auto& next = instructions[i + 1];
+					bool next_reads_cached = next.a == inst.dst || (is_commutative(next.op) && next.b == inst.dst);
+					store = !(is_inline(next.op) && next_reads_cached);
+				}
+
+				if (inst.op == Op::CONSTANT)
+					e.load_constant(inst.index);
+
+				for (int h = 0; h < 2; h++)
+				{
+					if (inst.op == Op::CONSTANT)
+						break;
+
+					if (a != cached && inst.op != Op::SQRT)
+						e.sse_mem(MOVAPS, h, RBX, disp(a, h));
+
+					switch (inst.op)
+					{
+					case Op::ADD: e.sse_mem(ADDPS, h, RBX, disp(b, h)); break;
+					case Op::SUB: e.sse_mem(SUBPS, h, RBX, disp(b, h)); break;
+					case Op::MUL: e.sse_mem(MULPS, h, RBX, disp(b, h)); break;
+					case Op::DIV: e.sse_mem(DIVPS, h, RBX, disp(b, h)); break;
+					case Op::MIN: e.sse_mem(MINPS, h, RBX, disp(b, h)); break;
+					case Op::MAX: e.sse_mem(MAXPS, h, RBX, disp(b, h)); break;
+					case Op::SQRT:
+						if (a == cached)
+							e.sse_reg(SQRTPS, h, h);
+						else
+							e.sse_mem(SQRTPS, h, RBX, disp(a, h));
+						break;
+					case Op::LESS:
+						e.sse_mem(CMPPS, h, RBX, disp(b, h));
+						e.code.push_back(CMP_LT);
+						break;
+					case Op::LESS_EQUAL:
+						e.sse_mem(CMPPS, h, RBX, disp(b, h));
+						e.code.push_back(CMP_LE);
+						break;
+					case Op::SELECT:
+						e.sse_reg(MOVAPS, 2 + h, h);
+						e.sse_mem(ANDPS, h, RBX, disp(b, h));
+						e.sse_mem(ANDNPS, 2 + h, RBX, disp(inst.c, h));
+						e.sse_reg(ORPS, h, 2 + h);
+						break;
+					default:
+						break;
+					}
+				}
+
+				if (store)
+					for (int h = 0; h < 2; h++)
+						e.sse_mem(MOVAPS_STORE, h, RBX, disp(inst.dst, h));
+				cached = inst.dst;
+			}
+
+			e.epilogue();
+			return std::move(e.code);
+		}
+
+		void* alloc_executable(const std::vector<uint8_t>& code, size_t& size)
+		{
+#if defined(_WIN32)
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			size_t page = info.dwPageSize;
+#else
+			size_t page = size_t(sysconf(_SC_PAGESIZE));
+#endif
+			size = (code.size() + page - 1) / page * page;
+
+#if defined(_WIN32)
+			void* memory = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+			if (!memory)
+				return nullptr;
+			std::memcpy(memory, code.data(), code.size());
+			DWORD old_protect;
+			if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &old_protect))
+			{
+				VirtualFree(memory, 0, MEM_RELEASE);
+				return nullptr;
+			}
+			FlushInstructionCache(GetCurrentProcess(), memory, size);
+			return memory;
+#else
+			void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (memory == MAP_FAILED)
+				return nullptr;
+			std::memcpy(memory, code.data(), code.size());
+			if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+			{
+				munmap(memory, size);
+				return nullptr;
+			}
+			return memory;
+#endif
+		}
+	}
+
+	std::unique_ptr<JitCode> JitCode::compile(const Program& program)
+	{
+		auto code = emit(program);
+		size_t size = 0;
+		void* memory = alloc_executable(code, size);
+		if (!memory)
+			return nullptr;
+		std::unique_ptr<JitCode> jit(new JitCode());
+		jit->_memory = memory;
+		jit->_size = size;
+		return jit;
+	}
+
+	JitCode::~JitCode()
+	{
+#if defined(_WIN32)
+		VirtualFree(_memory, 0, MEM_RELEASE);
+#else
+		munmap(_memory, _size);
+#endif
+	}
+
+#else
+
+	std::unique_ptr<JitCode> JitCode::compile(const Program& program)
+	{
+		return nullptr;
+	}
+
+	JitCode::~JitCode() = default;
+
+#endif
+}
@@ -0,0 +1,45 @@
+#ifndef SHADER_JIT_H
+#define SHADER_JIT_H
+
+#include <memory>
+#include <cstddef>
+#include "shaderir.h"
+
+// the native emitter targets x86-64 with SSE, define SHADER_NO_JIT to always interpret
+#if (defined(_M_X64) || defined(__x86_64__)) && !defined(SHADER_NO_JIT)
+#define SHADER_JIT
+#endif
+
+namespace ShaderIR
+{
+	using JitFunction = void (*)(Float8* registers, const ExecContext* context);
+
+	// native code of one program in executable memory
+	class JitCode
+	{
+	public:
+
+		// returns nullptr if the platform has no emitter or executable memory can not be allocated
+		static std::unique_ptr<JitCode> compile(const Program& program);
+
+		JitCode(const JitCode&) = delete;
+
+		JitCode& operator=(const JitCode&) = delete;
+
+		~JitCode();
+
+		JitFunction function() const { return reinterpret_cast<JitFunction>(_memory); }
+
+		size_t size() const { return _size; }
+
+	private:
+
+		void* _memory = nullptr;
+		size_t _size = 0;
+
+		JitCode() = default;
+
+	};
+}
+
+#endif
@@ -0,0 +1,315 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include "maths.h"
+
+// 8-wide float vectors for the batched shader paths: one AVX register when the compiler targets AVX,
+// two SSE2 registers on any other x86/x64 target, plain arrays elsewhere
+#if defined(__AVX__)
+#define SIMD_AVX 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// half float conversions, part of every AVX2 target. MSVC defines no __F16C__ but implies it with /arch:AVX2
+#if defined(__F16C__) || defined(__AVX2__)
+#define SIMD_F16C 1
+#include <immintrin.h>
+#endif
+
+constexpr int SIMD_WIDTH = 8;
+
+struct alignas(32) Float8
+{
+#if defined(SIMD_AVX)
+	__m256 v;
+	Float8(__m256 v) : v(v) {}
+#elif defined(SIMD_SSE2)
+	__m128 lo, hi;
+	Float8(__m128 lo, __m128 hi) : lo(lo), hi(hi) {}
+#else
+	float v[SIMD_WIDTH];
+#endif
+
+	Float8() : Float8(0.0f) {}
+
+	Float8(float x)
+#if defined(SIMD_AVX)
+		: v(_mm256_set1_ps(x)) {}
+#elif defined(SIMD_SSE2)
+		: lo(_mm_set1_ps(x)), hi(_mm_set1_ps(x)) {}
+#else
+	{
+		for (int i = 0; i < SIMD_WIDTH; i++) v[i] = x;
+	}
+#endif
+
+	static Float8 load(const float* ptr)
+	{
+#if defined(SIMD_AVX)
+		return _mm256_loadu_ps(ptr);
+#elif defined(SIMD_SSE2)
+		return Float8(_mm_loadu_ps(ptr), _mm_loadu_ps(ptr + 4));
+#else
+		Float8 r;
+		std::memcpy(r.v, ptr, sizeof(r.v));
+		return r;
+#endif
+	}
+
+	void store(float* ptr) const
+	{
+#if defined(SIMD_AVX)
+		_mm256_storeu_ps(ptr, v);
+#elif defined(SIMD_SSE2)
+		_mm_storeu_ps(ptr, lo);
+		_mm_storeu_ps(ptr + 4, hi);
+#else
+		std::memcpy(ptr, v, sizeof(v));
+#endif
+	}
+
+	float operator[](int i) const
+	{
+		alignas(32) float lanes[SIMD_WIDTH];
+		store(lanes);
+		return lanes[i];
+	}
+};
+
+// comparisons return lanes with all bits set or cleared
+using Mask8 = Float8;
+
+#if defined(SIMD_AVX)
+#define SIMD_OP1(f, a)		Float8(f(a.v))
+#define SIMD_OP2(f, a, b)	Float8(f(a.v, b.v))
+#elif defined(SIMD_SSE2)
+#define SIMD_OP1(f, a)		Float8(f(a.lo), f(a.hi))
+#define SIMD_OP2(f, a, b)	Float8(f(a.lo, b.lo), f(a.hi, b.hi))
+#endif
+
+namespace simd_detail
+{
+	inline uint32_t bits(float x)		{ uint32_t u; std::memcpy(&u, &x, 4); return u; }
+	inline float from_bits(uint32_t u)	{ float x; std::memcpy(&x, &u, 4); return x; }
+	inline float mask(bool b)			{ return from_bits(b ? 0xffffffffu : 0u); }
+
+	template<class F>
+	inline Float8 map(const Float8& a, F&& f)
+	{
+		alignas(32) float lanes[SIMD_WIDTH];
+		a.store(lanes);
+		for (int i = 0; i < SIMD_WIDTH; i++)
+			lanes[i] = f(lanes[i]);
+		return Float8::load(lanes);
+	}
+
+	template<class F>
+	inline Float8 map(const Float8& a, const Float8& b, F&& f)
+	{
+		alignas(32) float la[SIMD_WIDTH], lb[SIMD_WIDTH];
+		a.store(la);
+		b.store(lb);
+		for (int i = 0; i < SIMD_WIDTH; i++)
+			la[i] = f(la[i], lb[i]);
+		return Float8::load(la);
+	}
+}
+
+#if defined(SIMD_AVX) || defined(SIMD_SSE2)
+
+#if defined(SIMD_AVX)
+#define SIMD_FN(name) _mm256_##name
+#else
+#define SIMD_FN(name) _mm_##name
+#endif
+
+inline Float8 operator+(const Float8& a, const Float8& b) { return SIMD_OP2(SIMD_FN(add_ps), a, b); }
+inline Float8 operator-(const Float8& a, const Float8& b) { return SIMD_OP2(SIMD_FN(sub_ps), a, b); }
+inline Float8 operator*(const Float8& a, const Float8& b) { return SIMD_OP2(SIMD_FN(mul_ps), a, b); }
+inline Float8 operator/(const Float8& a, const Float8& b) { return SIMD_OP2(SIMD_FN(div_ps), a, b); }
+inline Float8 operator&(const Float8& a, const Float8& b) { return SIMD_OP2(SIMD_FN(and_ps), a, b); }
+inline Float8 operator|(const Float8& a, const Float8& b) { return SIMD_OP2(SIMD_FN(or_ps), a, b); }
+inline Float8 operator^(const Float8& a, const Float8& b) { return SIMD_OP2(SIMD_FN(xor_ps), a, b); }
+inline Float8 andnot(const Float8& a, const Float8& b)	  { return SIMD_OP2(SIMD_FN(andnot_ps), a, b); }	// ~a & b
+inline Float8 min(const Float8& a, const Float8& b)		  { return SIMD_OP2(SIMD_FN(min_ps), a, b); }
+inline Float8 max(const Float8& a, const Float8& b)		  { return SIMD_OP2(SIMD_FN(max_ps), a, b); }
+inline Float8 sqrt(const Float8& a)						  { return SIMD_OP1(SIMD_FN(sqrt_ps), a); }
+
+#if defined(SIMD_AVX)
+inline Mask8 operator<(const Float8& a, const Float8& b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline Mask8 operator<=(const Float8& a, const Float8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline Mask8 operator>(const Float8& a, const Float8& b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline Mask8 operator>=(const Float8& a, const Float8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline Mask8 operator==(const Float8& a, const Float8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline Float8 floor(const Float8& a)					  { return _mm256_floor_ps(a.v); }
+inline Float8 select(const Mask8& m, const Float8& a, const Float8& b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+inline int movemask(const Mask8& m)						  { return _mm256_movemask_ps(m.v); }
+#else
+inline Mask8 operator<(const Float8& a, const Float8& b)  { return SIMD_OP2(_mm_cmplt_ps, a, b); }
+inline Mask8 operator<=(const Float8& a, const Float8& b) { return SIMD_OP2(_mm_cmple_ps, a, b); }
+inline Mask8 operator>(const Float8& a, const Float8& b)  { return SIMD_OP2(_mm_cmpgt_ps, a, b); }
+inline Mask8 operator>=(const Float8& a, const Float8& b) { return SIMD_OP2(_mm_cmpge_ps, a, b); }
+inline Mask8 operator==(const Float8& a, const Float8& b) { return SIMD_OP2(_mm_cmpeq_ps, a, b); }
+inline Float8 select(const Mask8& m, const Float8& a, const Float8& b) { return (m & a) | andnot(m, b); }
+inline int movemask(const Mask8& m)						  { return _mm_movemask_ps(m.lo) | (_mm_movemask_ps(m.hi) << 4); }
+
+// SSE2 has no rounding instruction, truncate and step down where truncation rounded up
+inline Float8 floor(const Float8& a)
+{
+	Float8 t(_mm_cvtepi32_ps(_mm_cvttps_epi32(a.lo)), _mm_cvtepi32_ps(_mm_cvttps_epi32(a.hi)));
+	return t - ((t > a) & Float8(1.0f));
+}
+#endif
+
+#undef SIMD_FN
+
+#else
+
+inline Float8 operator+(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return x + y; }); }
+inline Float8 operator-(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return x - y; }); }
+inline Float8 operator*(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return x * y; }); }
+inline Float8 operator/(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return x / y; }); }
+inline Float8 operator&(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return simd_detail::from_bits(simd_detail::bits(x) & simd_detail::bits(y)); }); }
+inline Float8 operator|(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return simd_detail::from_bits(simd_detail::bits(x) | simd_detail::bits(y)); }); }
+inline Float8 operator^(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return simd_detail::from_bits(simd_detail::bits(x) ^ simd_detail::bits(y)); }); }
+inline Float8 andnot(const Float8& a, const Float8& b)	  { return simd_detail::map(a, b, [](float x, float y) { return simd_detail::from_bits(~simd_detail::bits(x) & simd_detail::bits(y)); }); }
+inline Float8 min(const Float8& a, const Float8& b)		  { return simd_detail::map(a, b, [](float x, float y) { return x < y ? x : y; }); }
+inline Float8 max(const Float8& a, const Float8& b)		  { return simd_detail::map(a, b, [](float x, float y) { return x > y ? x : y; }); }
+inline Float8 sqrt(const Float8& a)						  { return simd_detail::map(a, [](float x) { return std::sqrt(x); }); }
+inline Float8 floor(const Float8& a)					  { return simd_detail::map(a, [](float x) { return std::floor(x); }); }
+inline Mask8 operator<(const Float8& a, const Float8& b)  { return simd_detail::map(a, b, [](float x, float y) { return simd_detail::mask(x < y); }); }
+inline Mask8 operator<=(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return simd_detail::mask(x <= y); }); }
+inline Mask8 operator>(const Float8& a, const Float8& b)  { return simd_detail::map(a, b, [](float x, float y) { return simd_detail::mask(x > y); }); }
+inline Mask8 operator>=(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return simd_detail::mask(x >= y); }); }
+inline Mask8 operator==(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return simd_detail::mask(x == y); }); }
+inline Float8 select(const Mask8& m, const Float8& a, const Float8& b) { return (m & a) | andnot(m, b); }
+
+inline int movemask(const Mask8& m)
+{
+	int result = 0;
+	for (int i = 0; i < SIMD_WIDTH; i++)
+		result |= int(simd_detail::bits(m.v[i]) >> 31) << i;
+	return result;
+}
+
+#endif
+
+#undef SIMD_OP1
+#undef SIMD_OP2
+
+inline Float8 operator-(const Float8& a)					{ return Float8(0.0f) - a; }
+inline Float8& operator+=(Float8& a, const Float8& b)		{ return a = a + b; }
+inline Float8& operator-=(Float8& a, const Float8& b)		{ return a = a - b; }
+inline Float8& operator*=(Float8& a, const Float8& b)		{ return a = a * b; }
+inline Float8& operator/=(Float8& a, const Float8& b)		{ return a = a / b; }
+inline Float8& operator&=(Float8& a, const Float8& b)		{ return a = a & b; }
+inline Float8& operator|=(Float8& a, const Float8& b)		{ return a = a | b; }
+inline Float8 clamp(const Float8& x, const Float8& l, const Float8& r) { return min(r, max(l, x)); }
+inline Float8 abs(const Float8& a)							{ return andnot(Float8(-0.0f), a); }
+
+inline bool any(const Mask8& m)  { return movemask(m) != 0; }
+inline bool all(const Mask8& m)  { return movemask(m) == 0xff; }
+inline bool none(const Mask8& m) { return movemask(m) == 0; }
+
+inline Mask8 mask8(int bits)
+{
+	alignas(32) float lanes[SIMD_WIDTH];
+	for (int i = 0; i < SIMD_WIDTH; i++)
+		lanes[i] = simd_detail::mask(bits >> i & 1);
+	return Float8::load(lanes);
+}
+
+// lane-wise libm calls, exact but not vectorized
+inline Float8 pow(const Float8& a, const Float8& b) { return simd_detail::map(a, b, [](float x, float y) { return std::pow(x, y); }); }
+inline Float8 exp(const Float8& a)					 { return simd_detail::map(a, [](float x) { return std::exp(x); }); }
+
+// x^(2^n) by repeated squaring
+inline Float8 pow2n(const Float8& x, int n)
+{
+	Float8 r = x;
+	for (int i = 0; i < n; i++)
+		r *= r;
+	return r;
+}
+
+
+struct Vec2x8
+{
+	Float8 x, y;
+
+	Vec2x8() = default;
+	Vec2x8(const Float8& x, const Float8& y) : x(x), y(y) {}
+	Vec2x8(const Vec2& v) : x(v.x), y(v.y) {}
+};
+
+struct Vec3x8
+{
+	Float8 x, y, z;
+
+	Vec3x8() = default;
+	Vec3x8(const Float8& s) : x(s), y(s), z(s) {}
+	Vec3x8(const Float8& x, const Float8& y, const Float8& z) : x(x), y(y), z(z) {}
+	Vec3x8(const Vec3& v) : x(v.x), y(v.y), z(v.z) {}
+};
+
+struct Vec4x8
+{
+	Float8 x, y, z, w;
+
+	Vec4x8() = default;
+	Vec4x8(const Float8& x, const Float8& y, const Float8& z, const Float8& w) : x(x), y(y), z(z), w(w) {}
+	Vec4x8(const Vec3x8& v, const Float8& w) : x(v.x), y(v.y), z(v.z), w(w) {}
+	Vec4x8(const Vec4& v) : x(v.x), y(v.y), z(v.z), w(v.w) {}
+
+	Float8& operator[](int i)			  { return (&x)[i]; }
+	const Float8& operator[](int i) const { return (&x)[i]; }
+};
+
+inline Vec2x8 vec2(const Vec4x8& v) { return Vec2x8(v.x, v.y); }
+inline Vec3x8 vec3(const Vec4x8& v) { return Vec3x8(v.x, v.y, v.z); }
+inline Vec4x8 vec4(const Vec3x8& v, const Float8& w = 1.0f) { return Vec4x8(v, w); }
+
+inline Vec3x8 operator+(const Vec3x8& a, const Vec3x8& b) { return Vec3x8(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline Vec3x8 operator-(const Vec3x8& a, const Vec3x8& b) { return Vec3x8(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline Vec3x8 operator*(const Vec3x8& a, const Vec3x8& b) { return Vec3x8(a.x * b.x, a.y * b.y, a.z * b.z); }
+inline Vec3x8 operator*(const Vec3x8& a, const Float8& s) { return Vec3x8(a.x * s, a.y * s, a.z * s); }
+inline Vec3x8 operator-(const Vec3x8& a)				   { return Vec3x8(-a.x, -a.y, -a.z); }
+
+inline Float8 dot(const Vec3x8& a, const Vec3x8& b)		   { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline Vec3x8 normalize(const Vec3x8& a)				   { return a * (Float8(1.0f) / sqrt(dot(a, a))); }
+inline Vec3x8 min(const Vec3x8& a, const Vec3x8& b)		   { return Vec3x8(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z)); }
+inline Vec3x8 max(const Vec3x8& a, const Vec3x8& b)		   { return Vec3x8(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z)); }
+inline Vec3x8 pow(const Vec3x8& a, const Float8& e)		   { return Vec3x8(pow(a.x, e), pow(a.y, e), pow(a.z, e)); }
+inline Vec3x8 exp(const Vec3x8& a)						   { return Vec3x8(exp(a.x), exp(a.y), exp(a.z)); }
+inline Vec3x8 select(const Mask8& m, const Vec3x8& a, const Vec3x8& b) { return Vec3x8(select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z)); }
+
+inline Vec4x8 select(const Mask8& m, const Vec4x8& a, const Vec4x8& b)
+{
+	return Vec4x8(select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z), select(m, a.w, b.w));
+}
+
+// row vector times matrix, same convention as vec4 * Mat4
+inline Vec4x8 operator*(const Vec4x8& v, const Mat4& m)
+{
+	Vec4x8 r;
+	for (int j = 0; j < 4; j++)
+		r[j] = v.x * m[j][0] + v.y * m[j][1] + v.z * m[j][2] + v.w * m[j][3];
+	return r;
+}
+
+// matrix times column vector, same convention as Mat3 * vec3
+inline Vec3x8 operator*(const Mat3& m, const Vec3x8& v)
+{
+	return Vec3x8(
+		v.x * m[0][0] + v.y * m[1][0] + v.z * m[2][0],
+		v.x * m[0][1] + v.y * m[1][1] + v.z * m[2][1],
+		v.x * m[0][2] + v.y * m[1][2] + v.z * m[2][2]);
+}
+
+#endif
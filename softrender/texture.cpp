@@ -1,9 +1,340 @@
 #include "texture.h"
+#include "threadpool.h"
+#include "fastmath.h"
+#include "blockcompression.h"
+#include "packedcolor.h"
+#include "virtualtexture.h"
+#include "texturetable.h"
+#include "mappedfile.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 #include <iostream>
+#include <fstream>
+#include <cmath>
+#include <type_traits>
+#include <cstring>
+#include <atomic>
+#include <limits>
+
+namespace
+{
+	// ThreadPool::grain_size cost of filtering one texel of a mip level
+	constexpr double MIP_TEXEL_COST = 4.0;
+
+	// ThreadPool::grain_size cost of encoding one block, mostly the endpoint fit and the palette search
+	constexpr double BLOCK_ENCODE_COST = 2000.0;
+
+	std::atomic<uint64_t> block_generations{ 0 };
+
+	// header of a cooked texture file, the color buffer follows at texels_offset. fields are in the byte order
+	// of the machine that cooked the file
+	struct CookedHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t color_format;
+		uint32_t layout;
+		uint32_t width;
+		uint32_t height;
+		uint32_t level_num;
+		uint32_t reserved;
+		uint64_t texels_offset;
+		uint64_t texels_size;
+	};
+
+	constexpr char COOKED_MAGIC[4] = { 'S', 'R', 'T', 'X' };
+	constexpr uint32_t COOKED_VERSION = 1;
+	// the texels start on a cache line, mappings are page aligned so the buffer is as aligned as an allocated one
+	constexpr uint64_t COOKED_TEXELS_OFFSET = 64;
+	// larger cooked textures are rejected before their dimensions reach the int texel math
+	constexpr uint32_t MAX_COOKED_SIZE = 1 << 16;
+
+	// the header's dimensions and level count describe a mip chain whose byte size fits a size_t
+	bool cooked_levels_valid(const CookedHeader& header)
+	{
+		if (!header.width || !header.height || header.width > MAX_COOKED_SIZE || header.height > MAX_COOKED_SIZE)
+			return false;
+		uint32_t full_level_num = 1;
+		while (std::max(header.width, header.height) >> full_level_num)
+			full_level_num++;
+		if (!header.level_num || header.level_num > full_level_num)
+			return false;
+		// every level takes at most the tile padded texels of level 0 at 16 bytes each, no uint64 overflow below 2^16
+		uint64_t tiles_x = (header.width + Texture::TILE_SIZE - 1) / Texture::TILE_SIZE;
+		uint64_t tiles_y = (header.height + Texture::TILE_SIZE - 1) / Texture::TILE_SIZE;
+		uint64_t max_bytes = header.level_num * tiles_x * tiles_y * Texture::TILE_SIZE * Texture::TILE_SIZE * 4 * sizeof(float);
+		return max_bytes <= std::numeric_limits<size_t>::max();
+	}
+
+	constexpr size_t block_bytes(Texture::ColorFormat format)
+	{
+		return format == Texture::ColorFormat::BC1 ? bc::BC1_BLOCK_BYTES
+			: format == Texture::ColorFormat::BC3 ? bc::BC3_BLOCK_BYTES : bc::BC7_BLOCK_BYTES;
+	}
+
+	void encode_block(Texture::ColorFormat format, const uint32_t* texels, unsigned char* block)
+	{
+		if (format == Texture::ColorFormat::BC1)
+			bc::encode_bc1(texels, block);
+		else if (format == Texture::ColorFormat::BC3)
+			bc::encode_bc3(texels, block);
+		else
+			bc::encode_bc7(texels, block);
+	}
+
+	template<Texture::ColorFormat FORMAT>
+	inline void decode_block(const unsigned char* block, uint32_t* texels)
+	{
+		if constexpr (FORMAT == Texture::ColorFormat::BC1)
+			bc::decode_bc1(block, texels);
+		else if constexpr (FORMAT == Texture::ColorFormat::BC3)
+			bc::decode_bc3(block, texels);
+		else
+			bc::decode_bc7(block, texels);
+	}
+
+	void decode_block(Texture::ColorFormat format, const unsigned char* block, uint32_t* texels)
+	{
+		if (format == Texture::ColorFormat::BC1)
+			decode_block<Texture::ColorFormat::BC1>(block, texels);
+		else if (format == Texture::ColorFormat::BC3)
+			decode_block<Texture::ColorFormat::BC3>(block, texels);
+		else
+			decode_block<Texture::ColorFormat::BC7>(block, texels);
+	}
+
+	// zero initialized per thread, generations start at 1 so no entry matches before it is filled
+	struct DecodedBlock
+	{
+		const unsigned char* block;
+		uint64_t generation;
+		uint32_t texels[bc::BLOCK_TEXELS];
+	};
+
+	// entries of the block cache, the top 6 bits of the hash
+	constexpr size_t BLOCK_CACHE_SIZE = 64;
+
+	// the texel at index of an LDR_RGBA or block compressed buffer as RGBA8 with red in the lowest byte. blocks are
+	// decoded into a direct mapped cache, the block address is hashed so the blocks of neighbouring tile rows,
+	// a power of 2 apart for power of 2 textures, do not evict each other
+	template<Texture::ColorFormat FORMAT>
+	inline uint32_t rgba8_texel(const unsigned char* data, size_t index, uint64_t generation)
+	{
+		if constexpr (FORMAT == Texture::ColorFormat::LDR_RGBA)
+		{
+			uint32_t t;
+			std::memcpy(&t, data + index * 4, 4);
+			return t;
+		}
+		else
+		{
+			constexpr size_t BYTES = block_bytes(FORMAT);
+			thread_local DecodedBlock cache[BLOCK_CACHE_SIZE];
+			const unsigned char* block = data + (index >> 4) * BYTES;
+			uint64_t hash = uint64_t(reinterpret_cast<uintptr_t>(block) / BYTES) * 0x9e3779b97f4a7c15ull;
+			DecodedBlock& entry = cache[hash >> 58];
+			if (entry.block != block || entry.generation != generation)
+			{
+				decode_block<FORMAT>(block, entry.texels);
+				entry.block = block;
+				entry.generation = generation;
+			}
+			return entry.texels[index & 15];
+		}
+	}
+
+	// texel index of footprint taps outside a CLAMP_TO_BORDER texture
+	constexpr size_t NO_TEXEL = SIZE_MAX;
+
+	// coordinate x of a texture size texels wide after the warp mode, -1 for the border
+	template<Texture::WarpMode WARP>
+	inline int wrap(int x, int size)
+	{
+		if (x >= 0 && x < size)
+			return x;
+		if constexpr (WARP == Texture::WarpMode::REPEAT)
+		{
+			x %= size;
+			return x < 0 ? x + size : x;
+		}
+		else if constexpr (WARP == Texture::WarpMode::MIRRORED_REPEAT)
+		{
+			x %= size * 2;
+			x = x < 0 ? x + size * 2 : x;
+			return x >= size ? size * 2 - x - 1 : x;
+		}
+		else if constexpr (WARP == Texture::WarpMode::CLAMP_TO_EDGE)
+			return clamp(x, 0, size - 1);
+		else
+			return -1;
+	}
+
+	// linear weights for 2 taps, Catmull-Rom weights for 4, t is the position past the second last tap
+	template<int TAPS>
+	inline void filter_weights(float t, float* w)
+	{
+		if constexpr (TAPS == 2)
+		{
+			w[0] = 1.0f - t;
+			w[1] = t;
+		}
+		else
+		{
+			w[0] = 0.5f * (-t + 2.0f * t * t + -t * t * t);
+			w[1] = 0.5f * (2.0f - 5.0f * t * t + 3.0f * t * t * t);
+			w[2] = 0.5f * (t + 4.0f * t * t - 3.0f * t * t * t);
+			w[3] = 0.5f * (-t * t + t * t * t);
+		}
+	}
+
+	// LDR_RGBA and the block formats, filtered in fixed point
+	constexpr bool is_rgba8(Texture::ColorFormat format)
+	{
+		return format != Texture::ColorFormat::HDR_RGBA && format != Texture::ColorFormat::HDR_RGBA16F
+			&& format != Texture::ColorFormat::HDR_RGB9E5;
+	}
+
+	template<Texture::ColorFormat FORMAT>
+	inline Color4 load_texel(const void* data, size_t index, uint64_t generation)
+	{
+		if constexpr (FORMAT == Texture::ColorFormat::HDR_RGBA)
+		{
+			auto* c = static_cast<const float*>(data) + index * 4;
+			return Color4(c[0], c[1], c[2], c[3]);
+		}
+		else if constexpr (FORMAT == Texture::ColorFormat::HDR_RGBA16F)
+		{
+			Color4 color;
+			packed::half4_to_float4(static_cast<const uint16_t*>(data) + index * 4, &color.r);
+			return color;
+		}
+		else if constexpr (FORMAT == Texture::ColorFormat::HDR_RGB9E5)
+		{
+			Color4 color = Color4(1.0f);
+			packed::rgb9e5_to_float3(static_cast<const uint32_t*>(data)[index], &color.r);
+			return color;
+		}
+		else
+		{
+			uint32_t t = rgba8_texel<FORMAT>(static_cast<const unsigned char*>(data), index, generation);
+			return Color4(float(t & 0xff), float(t >> 8 & 0xff), float(t >> 16 & 0xff), float(t >> 24)) * (1.0f / 255.0f);
+		}
+	}
+
+	// RGBA8 footprints are filtered in fixed point along x: the weights are rounded to 1/256 with their sum
+	// kept at exactly 256, so a row sum fits the 16 bit lanes of pmaddwd. rows are blended with float weights
+	constexpr int WEIGHT_ONE = 256;
+
+	template<int TAPS>
+	inline void fixed_weights(const float* w, int* q)
+	{
+		int sum = 0, largest = 0;
+		for (int i = 0; i < TAPS; i++)
+		{
+			q[i] = int(std::floor(w[i] * WEIGHT_ONE + 0.5f));
+			sum += q[i];
+			if (q[i] > q[largest])
+				largest = i;
+		}
+		q[largest] += WEIGHT_ONE - sum;
+	}
+
+#if defined(SIMD_AVX) || defined(SIMD_SSE2)
+	// per channel sums of two RGBA8 texels times their weights
+	inline __m128i madd_texels(__m128i sum, uint32_t t0, uint32_t t1, int w0, int w1)
+	{
+		__m128i bytes = _mm_unpacklo_epi8(_mm_cvtsi32_si128(int(t0)), _mm_cvtsi32_si128(int(t1)));
+		__m128i texels = _mm_unpacklo_epi8(bytes, _mm_setzero_si128());
+		__m128i weights = _mm_set1_epi32(int((uint32_t(w0) & 0xffff) | uint32_t(w1) << 16));
+		return _mm_add_epi32(sum, _mm_madd_epi16(texels, weights));
+	}
+#endif
+
+	// weighted sum of the TAPS x TAPS footprint, index(i, j) is the texel of column i and row j or NO_TEXEL
+	template<Texture::ColorFormat FORMAT, int TAPS, class F>
+	inline Color4 filter_footprint(const void* data, uint64_t generation, F&& index, const float* wx, const float* wy)
+	{
+		if constexpr (is_rgba8(FORMAT))
+		{
+			int qx[TAPS];
+			fixed_weights<TAPS>(wx, qx);
+			auto* texels = static_cast<const unsigned char*>(data);
+			auto texel = [&](int i, int j) {
+				size_t k = index(i, j);
+				return k != NO_TEXEL ? rgba8_texel<FORMAT>(texels, k, generation) : 0u;
+			};
+#if defined(SIMD_AVX) || defined(SIMD_SSE2)
+			__m128 sum = _mm_setzero_ps();
+			for (int j = 0; j < TAPS; j++)
+			{
+				__m128i row = _mm_setzero_si128();
+				for (int i = 0; i < TAPS; i += 2)
+					row = madd_texels(row, texel(i, j), texel(i + 1, j), qx[i], qx[i + 1]);
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(row), _mm_set1_ps(wy[j])));
+			}
+			alignas(16) float c[4];
+			_mm_store_ps(c, _mm_mul_ps(sum, _mm_set1_ps(1.0f / (WEIGHT_ONE * 255.0f))));
+			return Color4(c[0], c[1], c[2], c[3]);
+#else
+			Color4 sum = Color4(0.0f);
+			for (int j = 0; j < TAPS; j++)
+			{
+				int32_t row[4] = {};
+				for (int i = 0; i < TAPS; i++)
+				{
+					uint32_t t = texel(i, j);
+					for (int c = 0; c < 4; c++)
+						row[c] += int32_t(t >> (c * 8) & 0xff) * qx[i];
+				}
+				sum += Color4(float(row[0]), float(row[1]), float(row[2]), float(row[3])) * wy[j];
+			}
+			return sum * (1.0f / (WEIGHT_ONE * 255.0f));
+#endif
+		}
+		else
+		{
+			Color4 sum = Color4(0.0f);
+			for (int j = 0; j < TAPS; j++)
+				for (int i = 0; i < TAPS; i++)
+				{
+					size_t k = index(i, j);
+					if (k != NO_TEXEL)
+						sum += load_texel<FORMAT>(data, k, generation) * (wx[i] * wy[j]);
+				}
+			return sum;
+		}
+	}
+}
+
+// row y of dst from src, every texel averages the box of src texels it covers. a box is 2x2 for even
+// sizes, odd sizes give the last texel of a row or column a 3 texel wide box so no source texel is dropped
+template<class T>
+void Texture::_filter_mip_row(std::vector<T>& buffer, const Level& src, const Level& dst, int y)
+{
+	int y0 = y * src.height / dst.height;
+	int y1 = std::max((y + 1) * src.height / dst.height, y0 + 1);
+	for (int x = 0; x < dst.width; x++)
+	{
+		int x0 = x * src.width / dst.width;
+		int x1 = std::max((x + 1) * src.width / dst.width, x0 + 1);
+		float sum[4] = {};
+		for (int sy = y0; sy < y1; sy++)
+			for (int sx = x0; sx < x1; sx++)
+				for (int c = 0; c < 4; c++)
+					sum[c] += buffer[_texel_index(src, sx, sy) * 4 + c];
+		float inv_count = 1.0f / float((x1 - x0) * (y1 - y0));
+		size_t index = _texel_index(dst, x, y) * 4;
+		for (int c = 0; c < 4; c++)
+		{
+			if constexpr (std::is_same_v<T, unsigned char>)
+				buffer[index + c] = (unsigned char)(sum[c] * inv_count + 0.5f);
+			else
+				buffer[index + c] = sum[c] * inv_count;
+		}
+	}
+}
 
 Texture::Texture()
 {
@@ -23,13 +354,19 @@ void Texture::clear()
 {
 	_width = 0;
 	_height = 0;
+	_mapped_file = nullptr;
+	_mapped_texels = nullptr;
+	_mapped_size = 0;
 	_ldr_color_buffer.clear();
 	_hdr_color_buffer.clear();
+	_half_color_buffer.clear();
+	_rgb9e5_color_buffer.clear();
+	_levels.clear();
 }
 
 bool Texture::empty()
 {
-	return _ldr_color_buffer.empty() && _hdr_color_buffer.empty();
+	return _levels.empty();
 }
 
 void Texture::create(int w, int h, ColorFormat format)
@@ -38,18 +375,124 @@ void Texture::create(int w, int h, ColorFormat format)
 	_width = w;
 	_height = h;
 	_color_format = format;
-	if(_color_format == ColorFormat::LDR_RGBA)
-		_ldr_color_buffer.resize(_width * _height * 4);
-	else if(_color_format == ColorFormat::HDR_RGBA)
-		_hdr_color_buffer.resize(_width * _height * 4);
+	if (is_block_format(format))
+	{
+		_layout = Layout::TILED;
+		_block_generation = ++block_generations;
+	}
+	_allocate_levels(1);
+}
+
+void Texture::_allocate_levels(int level_num)
+{
+	size_t bytes = _layout_levels(level_num);
+	if (_color_format == ColorFormat::HDR_RGBA)
+		_hdr_color_buffer.resize(bytes / sizeof(float));
+	else if (_color_format == ColorFormat::HDR_RGBA16F)
+		_half_color_buffer.resize(bytes / sizeof(uint16_t));
+	else if (_color_format == ColorFormat::HDR_RGB9E5)
+		_rgb9e5_color_buffer.resize(bytes / sizeof(uint32_t));
+	else
+		_ldr_color_buffer.resize(bytes);
+}
+
+size_t Texture::_layout_levels(int level_num)
+{
+	_levels.clear();
+	size_t size = 0;
+	for (int i = 0, w = _width, h = _height; i < level_num; i++)
+	{
+		int tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+		int tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+		_levels.push_back(Level{ w, h, tiles_x, size });
+		size += _layout == Layout::TILED ? size_t(tiles_x) * tiles_y * TILE_SIZE * TILE_SIZE : size_t(w) * h;
+		w = std::max(w / 2, 1);
+		h = std::max(h / 2, 1);
+	}
+	if (_color_format == ColorFormat::LDR_RGBA)
+		return size * 4;
+	if (_color_format == ColorFormat::HDR_RGBA)
+		return size * 4 * sizeof(float);
+	if (_color_format == ColorFormat::HDR_RGBA16F)
+		return size * 4 * sizeof(uint16_t);
+	if (_color_format == ColorFormat::HDR_RGB9E5)
+		return size * sizeof(uint32_t);
+	return size / (TILE_SIZE * TILE_SIZE) * block_bytes(_color_format);
+}
+
+const void* Texture::_color_data() const
+{
+	if (_mapped_texels)
+		return _mapped_texels;
+	if (_color_format == ColorFormat::HDR_RGBA)
+		return _hdr_color_buffer.data();
+	if (_color_format == ColorFormat::HDR_RGBA16F)
+		return _half_color_buffer.data();
+	if (_color_format == ColorFormat::HDR_RGB9E5)
+		return _rgb9e5_color_buffer.data();
+	return _ldr_color_buffer.data();
+}
+
+size_t Texture::_color_data_size() const
+{
+	if (_mapped_texels)
+		return _mapped_size;
+	if (_color_format == ColorFormat::HDR_RGBA)
+		return _hdr_color_buffer.size() * sizeof(float);
+	if (_color_format == ColorFormat::HDR_RGBA16F)
+		return _half_color_buffer.size() * sizeof(uint16_t);
+	if (_color_format == ColorFormat::HDR_RGB9E5)
+		return _rgb9e5_color_buffer.size() * sizeof(uint32_t);
+	return _ldr_color_buffer.size();
+}
+
+void Texture::_detach()
+{
+	if (!_mapped_texels)
+		return;
+	auto copy = [this](auto& buffer) {
+		buffer.resize(_mapped_size / sizeof(buffer[0]));
+		std::memcpy(buffer.data(), _mapped_texels, _mapped_size);
+	};
+	if (_color_format == ColorFormat::HDR_RGBA)
+		copy(_hdr_color_buffer);
+	else if (_color_format == ColorFormat::HDR_RGBA16F)
+		copy(_half_color_buffer);
+	else if (_color_format == ColorFormat::HDR_RGB9E5)
+		copy(_rgb9e5_color_buffer);
+	else
+		copy(_ldr_color_buffer);
+	_mapped_file = nullptr;
+	_mapped_texels = nullptr;
+	_mapped_size = 0;
+	// the color buffer may sit where blocks of the mapping were cached
+	_block_generation = ++block_generations;
 }
 
 bool Texture::load(std::string_view path, bool flip, ColorFormat format)
 {
+	if (path.size() >= COOKED_EXTENSION.size() && path.substr(path.size() - COOKED_EXTENSION.size()) == COOKED_EXTENSION)
+		return load_cooked(path);
+	if (is_block_format(format))
+	{
+		if (!load(path, flip, ColorFormat::LDR_RGBA))
+			return false;
+		compress(format);
+		return true;
+	}
+	if (format == ColorFormat::HDR_RGBA16F || format == ColorFormat::HDR_RGB9E5)
+	{
+		if (!load(path, flip, ColorFormat::HDR_RGBA))
+			return false;
+		convert_hdr(format);
+		return true;
+	}
+
 	clear();
 	_color_format = format;
 
-	stbi_set_flip_vertically_on_load(flip);
+	// rows are flipped while copying, stb's own flip flag is process wide and textures load on several threads
+	auto row = [this, flip](int k) { return flip ? _height - 1 - k / _width : k / _width; };
 
 	if (_color_format == ColorFormat::LDR_RGBA)
 	{
@@ -62,15 +505,15 @@ bool Texture::load(std::string_view path, bool flip, ColorFormat format)
 			return false;
 		}
 
-		_ldr_color_buffer.resize(_width * _height * 4);
-		int i = 0, j = 0;
+		_allocate_levels(1);
+		int j = 0;
 		for (int k = 0; k < _width * _height; k++)
 		{
+			size_t i = _texel_index(_levels[0], k % _width, row(k)) * 4;
 			_ldr_color_buffer[i + 0] = channel > 0 ? data[j + 0] : 0;
 			_ldr_color_buffer[i + 1] = channel > 1 ? data[j + 1] : 0;
 			_ldr_color_buffer[i + 2] = channel > 2 ? data[j + 2] : 0;
 			_ldr_color_buffer[i + 3] = channel > 3 ? data[j + 3] : 255;
-			i += 4;
 			j += channel;
 		}
 		stbi_image_free(data);
@@ -86,15 +529,15 @@ bool Texture::load(std::string_view path, bool flip, ColorFormat format)
 			return false;
 		}
 		
-		_hdr_color_buffer.resize(_width * _height * 4);
-		int i = 0, j = 0;
+		_allocate_levels(1);
+		int j = 0;
 		for (int k = 0; k < _width * _height; k++)
 		{
+			size_t i = _texel_index(_levels[0], k % _width, row(k)) * 4;
 			_hdr_color_buffer[i + 0] = channel > 0 ? data[j + 0] : 0.0f;
 			_hdr_color_buffer[i + 1] = channel > 1 ? data[j + 1] : 0.0f;
 			_hdr_color_buffer[i + 2] = channel > 2 ? data[j + 2] : 0.0f;
 			_hdr_color_buffer[i + 3] = channel > 3 ? data[j + 3] : 1.0f;
-			i += 4;
 			j += channel;
 		}
 		stbi_image_free(data);
@@ -105,36 +548,388 @@ bool Texture::load(std::string_view path, bool flip, ColorFormat format)
 
 void Texture::save(std::string_view path) const
 {
+	if (_levels.empty())
+		return;
+
+	if (is_block_format(_color_format) || _color_format == ColorFormat::HDR_RGBA16F || _color_format == ColorFormat::HDR_RGB9E5 || _mapped_texels)
+	{
+		Texture texture = *this;
+		texture._detach();
+		texture.decompress();
+		texture.convert_hdr(ColorFormat::HDR_RGBA);
+		texture.save(path);
+		return;
+	}
+
+	// level 0 back to rows
+	auto linear = [this](auto& buffer) {
+		std::remove_const_t<std::remove_reference_t<decltype(buffer)>> rows(size_t(_width) * _height * 4);
+		for (int y = 0; y < _height; y++)
+			for (int x = 0; x < _width; x++)
+				std::copy_n(&buffer[_texel_index(_levels[0], x, y) * 4], 4, &rows[(size_t(y) * _width + x) * 4]);
+		return rows;
+	};
+
 	if (_color_format == ColorFormat::LDR_RGBA)
 	{
-		stbi_write_png(path.data(), _width, _height, 4, _ldr_color_buffer.data(), _width * 4);
+		auto rows = linear(_ldr_color_buffer);
+		stbi_write_png(path.data(), _width, _height, 4, rows.data(), _width * 4);
+	}
+	else if (_color_format == ColorFormat::HDR_RGBA)
+	{
+		auto rows = linear(_hdr_color_buffer);
+		stbi_write_hdr(path.data(), _width, _height, 4, rows.data());
+	}
+}
+
+bool Texture::save_cooked(std::string_view path) const
+{
+	if (_levels.empty())
+		return false;
+
+	std::ofstream file(std::string(path), std::ios::binary);
+	if (!file)
+	{
+		std::cerr << "failed to write cooked texture: " << path << std::endl;
+		return false;
+	}
+
+	CookedHeader header = {};
+	std::memcpy(header.magic, COOKED_MAGIC, sizeof(COOKED_MAGIC));
+	header.version = COOKED_VERSION;
+	header.color_format = uint32_t(_color_format);
+	header.layout = uint32_t(_layout);
+	header.width = uint32_t(_width);
+	header.height = uint32_t(_height);
+	header.level_num = uint32_t(_levels.size());
+	header.texels_offset = COOKED_TEXELS_OFFSET;
+	header.texels_size = _color_data_size();
+
+	char padding[COOKED_TEXELS_OFFSET - sizeof(CookedHeader)] = {};
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(padding, sizeof(padding));
+	file.write(static_cast<const char*>(_color_data()), std::streamsize(header.texels_size));
+	return bool(file);
+}
+
+bool Texture::load_cooked(std::string_view path)
+{
+	clear();
+
+	auto mapped = std::make_shared<MappedFile>();
+	if (!mapped->open(path))
+		return false;
+
+	CookedHeader header;
+	bool valid = mapped->size() >= sizeof(header);
+	if (valid)
+	{
+		std::memcpy(&header, mapped->data(), sizeof(header));
+		valid = std::memcmp(header.magic, COOKED_MAGIC, sizeof(COOKED_MAGIC)) == 0 && header.version == COOKED_VERSION
+			&& header.color_format <= uint32_t(ColorFormat::HDR_RGB9E5) && header.layout <= uint32_t(Layout::TILED)
+			&& (!is_block_format(ColorFormat(header.color_format)) || header.layout == uint32_t(Layout::TILED))
+			&& cooked_levels_valid(header)
+			&& header.texels_offset % alignof(float) == 0 && header.texels_offset <= mapped->size()
+			&& header.texels_size <= mapped->size() - header.texels_offset;
+	}
+	if (valid)
+	{
+		_width = int(header.width);
+		_height = int(header.height);
+		_color_format = ColorFormat(header.color_format);
+		_layout = Layout(header.layout);
+		valid = _layout_levels(int(header.level_num)) == header.texels_size;
+	}
+	if (!valid)
+	{
+		clear();
+		std::cerr << "invalid cooked texture: " << path << std::endl;
+		return false;
 	}
+
+	_mapped_texels = mapped->data() + header.texels_offset;
+	_mapped_size = size_t(header.texels_size);
+	_mapped_file = std::move(mapped);
+	_block_generation = ++block_generations;
+	return true;
+}
+
+bool Texture::cook(std::string_view image_path, std::string_view cooked_path, bool flip, ColorFormat format, ThreadPool* thread_pool)
+{
+	Texture texture;
+	bool hdr = is_hdr_format(format);
+	if (!texture.load(image_path, flip, hdr ? ColorFormat::HDR_RGBA : ColorFormat::LDR_RGBA))
+		return false;
+	texture.set_layout(Layout::TILED);
+	texture.generate_mipmaps(thread_pool);
+	if (hdr)
+		texture.convert_hdr(format);
+	else
+		texture.compress(format, thread_pool);
+	return texture.save_cooked(cooked_path);
+}
+
+bool Texture::is_mapped() const
+{
+	return _mapped_texels != nullptr;
+}
+
+void Texture::set_layout(Layout layout)
+{
+	if (layout == _layout || is_block_format(_color_format))
+		return;
+	_detach();
+
+	auto old_levels = _levels;
+	auto old_ldr = std::move(_ldr_color_buffer);
+	auto old_hdr = std::move(_hdr_color_buffer);
+	auto old_half = std::move(_half_color_buffer);
+	auto old_rgb9e5 = std::move(_rgb9e5_color_buffer);
+	Layout old_layout = _layout;
+	_ldr_color_buffer.clear();
+	_hdr_color_buffer.clear();
+	_half_color_buffer.clear();
+	_rgb9e5_color_buffer.clear();
+
+	_layout = layout;
+	if (old_levels.empty())
+		return;
+	_allocate_levels(int(old_levels.size()));
+
+	// n elements per texel
+	auto convert = [&](const auto& src, auto& dst, size_t n) {
+		for (size_t i = 0; i < _levels.size(); i++)
+			for (int y = 0; y < _levels[i].height; y++)
+				for (int x = 0; x < _levels[i].width; x++)
+					std::copy_n(&src[_texel_index(old_levels[i], x, y, old_layout) * n], n, &dst[_texel_index(_levels[i], x, y) * n]);
+	};
+	if (_color_format == ColorFormat::LDR_RGBA)
+		convert(old_ldr, _ldr_color_buffer, 4);
 	else if (_color_format == ColorFormat::HDR_RGBA)
+		convert(old_hdr, _hdr_color_buffer, 4);
+	else if (_color_format == ColorFormat::HDR_RGBA16F)
+		convert(old_half, _half_color_buffer, 4);
+	else if (_color_format == ColorFormat::HDR_RGB9E5)
+		convert(old_rgb9e5, _rgb9e5_color_buffer, 1);
+}
+
+Texture::Layout Texture::layout() const
+{
+	return _layout;
+}
+
+void Texture::generate_mipmaps(ThreadPool* thread_pool, TaskQueue* queue)
+{
+	if (_levels.empty())
+		return;
+	_detach();
+
+	// levels are filtered from decoded texels and encoded again
+	if (is_block_format(_color_format))
+	{
+		ColorFormat format = _color_format;
+		decompress();
+		generate_mipmaps(thread_pool, queue);
+		compress(format, thread_pool, queue);
+		return;
+	}
+	if (_color_format == ColorFormat::HDR_RGBA16F || _color_format == ColorFormat::HDR_RGB9E5)
+	{
+		ColorFormat format = _color_format;
+		convert_hdr(ColorFormat::HDR_RGBA);
+		generate_mipmaps(thread_pool, queue);
+		convert_hdr(format);
+		return;
+	}
+
+	// level 0 keeps its place at the start of the buffer
+	int level_num = 1;
+	while (std::max(_width, _height) >> level_num)
+		level_num++;
+	_allocate_levels(level_num);
+
+	// every level reads the one before it
+	for (size_t i = 1; i < _levels.size(); i++)
+	{
+		auto& src = _levels[i - 1];
+		auto& dst = _levels[i];
+		auto filter_rows = [this, &src, &dst](size_t l, size_t r) {
+			for (size_t y = l; y < r; y++)
+			{
+				if (_color_format == ColorFormat::LDR_RGBA)
+					_filter_mip_row(_ldr_color_buffer, src, dst, int(y));
+				else if (_color_format == ColorFormat::HDR_RGBA)
+					_filter_mip_row(_hdr_color_buffer, src, dst, int(y));
+			}
+		};
+		if (thread_pool)
+			thread_pool->parallel_for(0, dst.height, ThreadPool::grain_size(MIP_TEXEL_COST * dst.width), filter_rows, queue);
+		else
+			filter_rows(0, dst.height);
+	}
+}
+
+int Texture::mip_level_num() const
+{
+	return int(_levels.size());
+}
+
+void Texture::compress(ColorFormat format, ThreadPool* thread_pool, TaskQueue* queue)
+{
+	if (!is_block_format(format) || _levels.empty() || is_hdr_format(_color_format))
+		return;
+	_detach();
+
+	decompress();
+	set_layout(Layout::TILED);
+	auto texels = std::move(_ldr_color_buffer);
+	_ldr_color_buffer.clear();
+	_color_format = format;
+	_block_generation = ++block_generations;
+	_allocate_levels(int(_levels.size()));
+
+	size_t bytes = block_bytes(format);
+	for (auto& level : _levels)
+	{
+		int tiles_y = (level.height + TILE_SIZE - 1) / TILE_SIZE;
+		auto encode_tiles = [&](size_t l, size_t r) {
+			for (size_t tile = l; tile < r; tile++)
+			{
+				int x0 = int(tile % level.tiles_x) * TILE_SIZE;
+				int y0 = int(tile / level.tiles_x) * TILE_SIZE;
+				uint32_t block[bc::BLOCK_TEXELS];
+				for (int i = 0; i < bc::BLOCK_TEXELS; i++)
+				{
+					int x = std::min(x0 + i % TILE_SIZE, level.width - 1);
+					int y = std::min(y0 + i / TILE_SIZE, level.height - 1);
+					std::memcpy(&block[i], &texels[_texel_index(level, x, y) * 4], 4);
+				}
+				encode_block(format, block, &_ldr_color_buffer[(_texel_index(level, x0, y0) >> 4) * bytes]);
+			}
+		};
+		size_t tile_num = size_t(level.tiles_x) * tiles_y;
+		if (thread_pool)
+			thread_pool->parallel_for(0, tile_num, ThreadPool::grain_size(BLOCK_ENCODE_COST), encode_tiles, queue);
+		else
+			encode_tiles(0, tile_num);
+	}
+}
+
+void Texture::decompress()
+{
+	if (!is_block_format(_color_format))
+		return;
+	_detach();
+
+	auto blocks = std::move(_ldr_color_buffer);
+	_ldr_color_buffer.clear();
+	ColorFormat format = _color_format;
+	_color_format = ColorFormat::LDR_RGBA;
+	_allocate_levels(int(_levels.size()));
+
+	size_t bytes = block_bytes(format);
+	for (size_t b = 0; b * bytes < blocks.size(); b++)
+	{
+		uint32_t texels[bc::BLOCK_TEXELS];
+		decode_block(format, &blocks[b * bytes], texels);
+		std::memcpy(&_ldr_color_buffer[b * bc::BLOCK_TEXELS * 4], texels, sizeof(texels));
+	}
+}
+
+bool Texture::is_block_format(ColorFormat format)
+{
+	return format == ColorFormat::BC1 || format == ColorFormat::BC3 || format == ColorFormat::BC7;
+}
+
+void Texture::convert_hdr(ColorFormat format)
+{
+	if (!is_hdr_format(format) || !is_hdr_format(_color_format) || format == _color_format)
+		return;
+	_detach();
+
+	// through HDR_RGBA, the packed buffers are released as they are converted
+	if (_color_format == ColorFormat::HDR_RGBA16F)
+	{
+		auto half = std::move(_half_color_buffer);
+		_half_color_buffer.clear();
+		_hdr_color_buffer.resize(half.size());
+		for (size_t i = 0; i < half.size(); i += 4)
+			packed::half4_to_float4(&half[i], &_hdr_color_buffer[i]);
+	}
+	else if (_color_format == ColorFormat::HDR_RGB9E5)
+	{
+		auto rgb9e5 = std::move(_rgb9e5_color_buffer);
+		_rgb9e5_color_buffer.clear();
+		_hdr_color_buffer.resize(rgb9e5.size() * 4);
+		for (size_t i = 0; i < rgb9e5.size(); i++)
+		{
+			packed::rgb9e5_to_float3(rgb9e5[i], &_hdr_color_buffer[i * 4]);
+			_hdr_color_buffer[i * 4 + 3] = 1.0f;
+		}
+	}
+
+	_color_format = format;
+	if (format == ColorFormat::HDR_RGBA)
+		return;
+
+	auto hdr = std::move(_hdr_color_buffer);
+	_hdr_color_buffer.clear();
+	if (format == ColorFormat::HDR_RGBA16F)
+	{
+		_half_color_buffer.resize(hdr.size());
+		for (size_t i = 0; i < hdr.size(); i += 4)
+			packed::float4_to_half4(&hdr[i], &_half_color_buffer[i]);
+	}
+	else
 	{
-		stbi_write_hdr(path.data(), _width, _height, 4, _hdr_color_buffer.data());
+		_rgb9e5_color_buffer.resize(hdr.size() / 4);
+		for (size_t i = 0; i < _rgb9e5_color_buffer.size(); i++)
+			_rgb9e5_color_buffer[i] = packed::float3_to_rgb9e5(&hdr[i * 4]);
 	}
 }
 
-int Texture::width() const
+bool Texture::is_hdr_format(ColorFormat format)
 {
-	return _width;
+	return format == ColorFormat::HDR_RGBA || format == ColorFormat::HDR_RGBA16F || format == ColorFormat::HDR_RGB9E5;
 }
 
-int Texture::height() const
+int Texture::width(int level) const
 {
-	return _height;
+	return level < int(_levels.size()) ? _levels[level].width : _width;
+}
+
+int Texture::height(int level) const
+{
+	return level < int(_levels.size()) ? _levels[level].height : _height;
 }
 
 unsigned char* Texture::ldr_color_buffer_data()
 {
+	_detach();
+	// the caller may rewrite blocks, drop what the block cache decoded from them
+	if (is_block_format(_color_format))
+		_block_generation = ++block_generations;
 	return _ldr_color_buffer.data();
 }
 
 float* Texture::hdr_color_buffer_data()
 {
+	_detach();
 	return _hdr_color_buffer.data();
 }
 
+uint16_t* Texture::half_color_buffer_data()
+{
+	_detach();
+	return _half_color_buffer.data();
+}
+
+uint32_t* Texture::rgb9e5_color_buffer_data()
+{
+	_detach();
+	return _rgb9e5_color_buffer.data();
+}
+
 Texture::ColorFormat Texture::color_format() const
 {
 	return _color_format;
@@ -142,9 +937,12 @@ Texture::ColorFormat Texture::color_format() const
 
 void Texture::set_color(int x, int y, const Color4& color)
 {
+	if (is_block_format(_color_format))
+		return;
+	_detach();
+	size_t index = _texel_index(_levels[0], x, y) * 4;
 	if(_color_format == ColorFormat::LDR_RGBA)
 	{
-		int index = (y * _width + x) * 4;
 		_ldr_color_buffer[index + 0] = clamp<int>(color.r * 255.0f, 0, 255);
 		_ldr_color_buffer[index + 1] = clamp<int>(color.g * 255.0f, 0, 255);
 		_ldr_color_buffer[index + 2] = clamp<int>(color.b * 255.0f, 0, 255);
@@ -152,24 +950,25 @@ void Texture::set_color(int x, int y, const Color4& color)
 	}
 	else if(_color_format == ColorFormat::HDR_RGBA)
 	{
-		int index = (y * _width + x) * 4;
 		_hdr_color_buffer[index + 0] = color.r;
 		_hdr_color_buffer[index + 1] = color.g;
 		_hdr_color_buffer[index + 2] = color.b;
 		_hdr_color_buffer[index + 3] = color.a;
 	}
+	else if (_color_format == ColorFormat::HDR_RGBA16F)
+		packed::float4_to_half4(&color.r, &_half_color_buffer[index]);
+	else if (_color_format == ColorFormat::HDR_RGB9E5)
+		_rgb9e5_color_buffer[index / 4] = packed::float3_to_rgb9e5(&color.r);
 }
 
-Color4 Texture::get_color(int x, int y) const
+Color4 Texture::get_color(int x, int y, int level) const
 {
 	if (!_width || !_height)
 		return Color::TRANSPARENT;
-	int tx = x;
-	int ty = y;
-	if (x < 0 || y < 0 || x >= _width || y >= _height)
+	int w = _levels[level].width;
+	int h = _levels[level].height;
+	if (x < 0 || y < 0 || x >= w || y >= h)
 	{
-		int w = _width;
-		int h = _height;
 		if (warpMode == WarpMode::REPEAT)
 		{
 			x = (x % w + w) % w;
@@ -193,94 +992,272 @@ Color4 Texture::get_color(int x, int y) const
 		}
 	}
 	
+	size_t index = _texel_index(_levels[level], x, y) * 4;
+	const void* data = _color_data();
 	if(_color_format == ColorFormat::LDR_RGBA)
 	{
-		int index = (y * _width + x) * 4;
-		return Color4(
-			_ldr_color_buffer[index + 0] / 255.0f, 
-			_ldr_color_buffer[index + 1] / 255.0f, 
-			_ldr_color_buffer[index + 2] / 255.0f, 
-			_ldr_color_buffer[index + 3] / 255.0f);
+		auto* c = static_cast<const unsigned char*>(data) + index;
+		return Color4(c[0] / 255.0f, c[1] / 255.0f, c[2] / 255.0f, c[3] / 255.0f);
 	}
 	else if(_color_format == ColorFormat::HDR_RGBA)
 	{
-		int index = (y * _width + x) * 4;
-		return Color4(
-			_hdr_color_buffer[index + 0], 
-			_hdr_color_buffer[index + 1], 
-			_hdr_color_buffer[index + 2], 
-			_hdr_color_buffer[index + 3]);
+		auto* c = static_cast<const float*>(data) + index;
+		return Color4(c[0], c[1], c[2], c[3]);
+	}
+	else if (_color_format == ColorFormat::HDR_RGBA16F)
+	{
+		Color4 color;
+		packed::half4_to_float4(static_cast<const uint16_t*>(data) + index, &color.r);
+		return color;
+	}
+	else if (_color_format == ColorFormat::HDR_RGB9E5)
+	{
+		Color4 color = Color4(1.0f);
+		packed::rgb9e5_to_float3(static_cast<const uint32_t*>(data)[index / 4], &color.r);
+		return color;
+	}
+	else
+	{
+		uint32_t texels[bc::BLOCK_TEXELS];
+		decode_block(_color_format, static_cast<const unsigned char*>(data) + index / 64 * block_bytes(_color_format), texels);
+		uint32_t t = texels[index / 4 % 16];
+		return Color4(float(t & 0xff), float(t >> 8 & 0xff), float(t >> 16 & 0xff), float(t >> 24)) * (1.0f / 255.0f);
 	}
-	return Color4();
 }
 
-Color4 Texture::sample(float x, float y) const
+Color4 Texture::sample(float x, float y, float lod) const
 {
-	x *= _width;
-	y *= _height;
-	
-	if (sampleMode == SampleMode::NEAREST)
+	return sample(x, y, lod, sampleMode, warpMode);
+}
+
+Color4 Texture::sample(float x, float y, float lod, SampleMode mode, WarpMode warp) const
+{
+	if (_levels.empty())
+		return Color::TRANSPARENT;
+
+	float l = clamp(lod, 0.0f, float(_levels.size() - 1));
+	if (mode == SampleMode::TRILINEAR)
 	{
-		return get_color(floor(x), floor(y));
+		int l0 = int(l);
+		Color4 color = _sample_level(x, y, l0, SampleMode::BILINEAR, warp);
+		if (l > float(l0))
+			color = lerp(color, _sample_level(x, y, l0 + 1, SampleMode::BILINEAR, warp), l - float(l0));
+		return color;
 	}
-	else if (sampleMode == SampleMode::BILINEAR)
+	return _sample_level(x, y, int(l + 0.5f), mode, warp);
+}
+
+Color4 Texture::_sample_level(float x, float y, int level, SampleMode mode, WarpMode warp) const
+{
+	Color4 color;
+	float l = float(level);
+	_kernel(mode, warp)(*this, &x, &y, &l, 1, &color);
+	return color;
+}
+
+Vec4x8 Texture::sample(const Vec2x8& texcoord, const Mask8& active, const Float8& lod) const
+{
+	return sample(texcoord, active, lod, sampleMode, warpMode);
+}
+
+Vec4x8 Texture::sample(const Vec2x8& texcoord, const Mask8& active, const Float8& lod, SampleMode mode, WarpMode warp) const
+{
+	if (_levels.empty())
+		return Vec4x8(Color::TRANSPARENT);
+
+	int mask = movemask(active);
+	float top = float(_levels.size() - 1);
+	Float8 l = clamp(lod, Float8(0.0f), Float8(top));
+	alignas(32) float level[SIMD_WIDTH];
+	if (mode == SampleMode::TRILINEAR)
 	{
-		int lbx = floor(x - 0.5f);
-		int lby = floor(y - 0.5f);
-		float tx = x - (lbx + 0.5f);
-		float ty = y - (lby + 0.5f);
-		Color4 c0 = lerp(get_color(lbx, lby    ), get_color(lbx + 1, lby    ), tx);
-		Color4 c1 = lerp(get_color(lbx, lby + 1), get_color(lbx + 1, lby + 1), tx);
-		return lerp(c0, c1, ty);
+		Float8 l0 = floor(l);
+		Float8 t = l - l0;
+		l0.store(level);
+		Vec4x8 color = _sample_levels(texcoord, mask, level, SampleMode::BILINEAR, warp);
+		// lanes sitting exactly on a level skip the second one
+		int blend = mask & movemask(t > Float8(0.0f));
+		if (!blend)
+			return color;
+		min(l0 + 1.0f, Float8(top)).store(level);
+		Vec4x8 next = _sample_levels(texcoord, blend, level, SampleMode::BILINEAR, warp);
+		for (int c = 0; c < 4; c++)
+			color[c] += (next[c] - color[c]) * t;
+		return color;
 	}
-	else if (sampleMode == SampleMode::BICUBIC)
+	floor(l + 0.5f).store(level);
+	return _sample_levels(texcoord, mask, level, mode, warp);
+}
+
+Vec4x8 Texture::_sample_levels(const Vec2x8& texcoord, int mask, const float* level, SampleMode mode, WarpMode warp) const
+{
+	alignas(32) float u[SIMD_WIDTH], v[SIMD_WIDTH];
+	alignas(32) float lanes[4][SIMD_WIDTH];
+	Color4 colors[SIMD_WIDTH] = {};
+	texcoord.x.store(u);
+	texcoord.y.store(v);
+	_kernel(mode, warp)(*this, u, v, level, mask, colors);
+	for (int lane = 0; lane < SIMD_WIDTH; lane++)
+		for (int c = 0; c < 4; c++)
+			lanes[c][lane] = colors[lane][c];
+	return Vec4x8(Float8::load(lanes[0]), Float8::load(lanes[1]), Float8::load(lanes[2]), Float8::load(lanes[3]));
+}
+
+template<Texture::ColorFormat FORMAT, Texture::Layout LAYOUT, Texture::WarpMode WARP, Texture::SampleMode FILTER>
+void Texture::_sample_kernel(const Texture& texture, const float* u, const float* v, const float* level, int mask, Color4* out)
+{
+	const void* data = texture._ldr_color_buffer.data();
+	if constexpr (FORMAT == ColorFormat::HDR_RGBA)
+		data = texture._hdr_color_buffer.data();
+	else if constexpr (FORMAT == ColorFormat::HDR_RGBA16F)
+		data = texture._half_color_buffer.data();
+	else if constexpr (FORMAT == ColorFormat::HDR_RGB9E5)
+		data = texture._rgb9e5_color_buffer.data();
+	if (texture._mapped_texels)
+		data = texture._mapped_texels;
+	uint64_t generation = texture._block_generation;
+	for (int lane = 0; lane < SIMD_WIDTH; lane++)
 	{
-		int lbx = floor(x - 0.5f);
-		int lby = floor(y - 0.5f);
-		float tx = x - (lbx + 0.5f);
-		float ty = y - (lby + 0.5f);
+		if (!(mask >> lane & 1))
+			continue;
+		const Level& lv = texture._levels[int(level[lane])];
+		float x = u[lane] * lv.width;
+		float y = v[lane] * lv.height;
 
-		float wx[] =
+		if constexpr (FILTER == SampleMode::NEAREST)
 		{
-			0.5f * (-tx + 2.0f * tx * tx + -tx * tx * tx),
-			0.5f * (2.0f - 5.0f * tx * tx + 3.0f * tx * tx * tx),
-			0.5f * (tx + 4.0f * tx * tx - 3.0f * tx * tx * tx),
-			0.5f * (-tx * tx + tx * tx * tx)
-		};
-		float wy[] = 
+			int tx = wrap<WARP>(int(std::floor(x)), lv.width);
+			int ty = wrap<WARP>(int(std::floor(y)), lv.height);
+			out[lane] = tx < 0 || ty < 0 ? Color4(0.0f) : load_texel<FORMAT>(data, _texel_index(lv, tx, ty, LAYOUT), generation);
+		}
+		else
 		{
-			0.5f * (-ty + 2.0f * ty * ty + -ty * ty * ty),
-			0.5f * (2.0f - 5.0f * ty * ty + 3.0f * ty * ty * ty),
-			0.5f * (ty + 4.0f * ty * ty - 3.0f * ty * ty * ty),
-			0.5f * (-ty * ty + ty * ty * ty)
-		};
+			constexpr int TAPS = FILTER == SampleMode::BILINEAR ? 2 : 4;
+			float fx = std::floor(x - 0.5f);
+			float fy = std::floor(y - 0.5f);
+			int bx = int(fx) - (TAPS / 2 - 1);
+			int by = int(fy) - (TAPS / 2 - 1);
 
-		Color4 cx[4];
-		for (int i = 0; i < 4; i++)
-		{
-			cx[i] = vec4(0.0f, 0.0f, 0.0f, 0.0f);
-			for (int j = 0; j < 4; j++)
-				cx[i] += get_color(lbx + j - 1, lby + i - 1) * wx[j];
+			// footprints fully inside the level skip the warp mode
+			int xs[TAPS], ys[TAPS];
+			if (bx >= 0 && by >= 0 && bx + TAPS <= lv.width && by + TAPS <= lv.height)
+			{
+				for (int i = 0; i < TAPS; i++)
+				{
+					xs[i] = bx + i;
+					ys[i] = by + i;
+				}
+			}
+			else
+			{
+				for (int i = 0; i < TAPS; i++)
+				{
+					xs[i] = wrap<WARP>(bx + i, lv.width);
+					ys[i] = wrap<WARP>(by + i, lv.height);
+				}
+			}
+
+			float wx[TAPS], wy[TAPS];
+			filter_weights<TAPS>(x - 0.5f - fx, wx);
+			filter_weights<TAPS>(y - 0.5f - fy, wy);
+			out[lane] = filter_footprint<FORMAT, TAPS>(data, generation, [&](int i, int j) {
+				return xs[i] < 0 || ys[j] < 0 ? NO_TEXEL : _texel_index(lv, xs[i], ys[j], LAYOUT);
+			}, wx, wy);
 		}
-		Color4 cy = vec4(0.0f, 0.0f, 0.0f, 0.0f);
-		for (int i = 0; i < 4; i++)
-			cy += cx[i] * wy[i];
-		return cy;
 	}
-	return Color::BLACK;
+}
+
+template<size_t... I>
+constexpr std::array<Texture::Kernel, sizeof...(I)> Texture::_kernel_table(std::index_sequence<I...>)
+{
+	return { { &Texture::_sample_kernel<ColorFormat(I / 24), Layout(I / 12 % 2), WarpMode(I / 3 % 4), SampleMode(I % 3)>... } };
+}
+
+Texture::Kernel Texture::_kernel(SampleMode filter, WarpMode warp) const
+{
+	static constexpr auto kernels = _kernel_table(std::make_index_sequence<KERNEL_NUM>());
+	return kernels[((size_t(_color_format) * 2 + size_t(_layout)) * 4 + size_t(warp)) * 3 + size_t(filter)];
+}
+
+float Texture::lod(const Vec2& ddx, const Vec2& ddy) const
+{
+	Vec2 size = Vec2(float(_width), float(_height));
+	Vec2 dx = ddx * size;
+	Vec2 dy = ddy * size;
+	return 0.5f * std::log2(std::max(glm::dot(dx, dx), glm::dot(dy, dy)));
+}
+
+Float8 Texture::lod(const Vec2x8& ddx, const Vec2x8& ddy) const
+{
+	Float8 w = float(_width);
+	Float8 h = float(_height);
+	Float8 dx = ddx.x * ddx.x * w * w + ddx.y * ddx.y * h * h;
+	Float8 dy = ddy.x * ddy.x * w * w + ddy.y * ddy.y * h * h;
+	// zero derivatives only need a lod below 0
+	return fastmath::log2(max(max(dx, dy), Float8(1e-8f))) * 0.5f;
+}
+
+template<class R, class F>
+R TextureSampler::_visit(const R& fallback, F&& f) const
+{
+	if (!_table)
+		return fallback;
+	const SamplerState* state = _table->sampler_state(_sampler_state);
+	if (const Texture* texture = _table->texture(_handle))
+		return state ? f(*texture, state->sampleMode, state->warpMode) : f(*texture, texture->sampleMode, texture->warpMode);
+	if (const VirtualTexture* texture = _table->virtual_texture(_handle))
+		return state ? f(*texture, state->sampleMode, state->warpMode) : f(*texture, texture->sampleMode, texture->warpMode);
+	return fallback;
 }
 
 Color4 TextureSampler::sample(float x, float y) const
 {
-	return _texture ? _texture->sample(x, y) : _default_color;
+	return _visit(_default_color, [&](const auto& texture, Texture::SampleMode mode, Texture::WarpMode warp) {
+		return texture.sample(x, y, 0.0f, mode, warp);
+	});
 }
 
 Color4 TextureSampler::sample(const Vec2& texcoord) const
 {
-	return _texture ? sample(texcoord.x, texcoord.y) : _default_color;
+	return sample(texcoord.x, texcoord.y);
+}
+
+Vec4x8 TextureSampler::sample(const Vec2x8& texcoord, const Mask8& active) const
+{
+	return _visit(Vec4x8(_default_color), [&](const auto& texture, Texture::SampleMode mode, Texture::WarpMode warp) {
+		return texture.sample(texcoord, active, Float8(0.0f), mode, warp);
+	});
+}
+
+Color4 TextureSampler::sample(const Vec2& texcoord, const Vec2& ddx, const Vec2& ddy) const
+{
+	return _visit(_default_color, [&](const auto& texture, Texture::SampleMode mode, Texture::WarpMode warp) {
+		return texture.sample(texcoord.x, texcoord.y, texture.lod(ddx, ddy), mode, warp);
+	});
+}
+
+Vec4x8 TextureSampler::sample(const Vec2x8& texcoord, const Vec2x8& ddx, const Vec2x8& ddy, const Mask8& active) const
+{
+	return _visit(Vec4x8(_default_color), [&](const auto& texture, Texture::SampleMode mode, Texture::WarpMode warp) {
+		return texture.sample(texcoord, active, texture.lod(ddx, ddy), mode, warp);
+	});
+}
+
+Color4 TextureSampler::sample_lod(const Vec2& texcoord, float lod) const
+{
+	return _visit(_default_color, [&](const auto& texture, Texture::SampleMode mode, Texture::WarpMode warp) {
+		return texture.sample(texcoord.x, texcoord.y, lod, mode, warp);
+	});
+}
+
+Vec4x8 TextureSampler::sample_lod(const Vec2x8& texcoord, const Float8& lod, const Mask8& active) const
+{
+	return _visit(Vec4x8(_default_color), [&](const auto& texture, Texture::SampleMode mode, Texture::WarpMode warp) {
+		return texture.sample(texcoord, active, lod, mode, warp);
+	});
 }
 
 bool TextureSampler::empty() const
 {
-	return !_texture;
+	return !_table || (!_table->texture(_handle) && !_table->virtual_texture(_handle));
 }
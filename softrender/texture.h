@@ -4,23 +4,41 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <array>
+#include <utility>
+#include <cstdint>
 #include "maths.h"
+#include "simd.h"
+
+class ThreadPool;
+class TaskQueue;
+class VirtualTexture;
+class TextureTable;
+class MappedFile;
 
 class Texture
 {
 public:
 	
+	// the BC formats store every TILE_SIZE tile as one compressed block and always use the TILED layout.
+	// sampling decodes blocks on demand through a small per-thread cache of decoded blocks
 	enum class ColorFormat
 	{
 		LDR_RGBA,
-		HDR_RGBA
+		HDR_RGBA,
+		BC1,			// 0.5 byte per texel, RGB and 1 bit alpha
+		BC3,			// 1 byte per texel, BC1 colors and interpolated alpha
+		BC7,			// 1 byte per texel, RGBA of higher quality than BC3
+		HDR_RGBA16F,	// half floats, 8 bytes per texel
+		HDR_RGB9E5		// 4 bytes per texel, 9 bit RGB with a shared exponent, no alpha and nothing negative
 	};
 
 	enum class SampleMode
 	{
 		NEAREST,
 		BILINEAR,
-		BICUBIC
+		BICUBIC,
+		TRILINEAR		// bilinear on the two mip levels around the lod, blended
 	};
 
 	enum class WarpMode
@@ -31,6 +49,20 @@ public:
 		CLAMP_TO_BORDER
 	};
 
+	// order of the texels in the color buffers. TILED stores TILE_SIZE x TILE_SIZE blocks of texels one
+	// after another, row-major inside and across blocks, so a filter footprint crossing rows stays in one
+	// block (one cache line for LDR_RGBA). levels are padded to whole tiles
+	enum class Layout
+	{
+		LINEAR,
+		TILED
+	};
+
+	static constexpr int TILE_SIZE = 4;
+
+	// extension of the files written by save_cooked, load maps them with load_cooked
+	static constexpr std::string_view COOKED_EXTENSION = ".srtex";
+
 	
 	SampleMode sampleMode = SampleMode::NEAREST;
 	WarpMode warpMode = WarpMode::REPEAT;
@@ -49,58 +81,242 @@ public:
 
 	void create(int w, int h, ColorFormat format = ColorFormat::LDR_RGBA);
 
+	// block formats are loaded as LDR_RGBA and compressed, HDR_RGBA16F and HDR_RGB9E5 as HDR_RGBA and converted.
+	// cooked files are mapped with load_cooked, flip and format are ignored for them
 	bool load(std::string_view path, bool flip = true, ColorFormat format = ColorFormat::LDR_RGBA);
 
 	void save(std::string_view path) const;
+
+	// writes every level as it is stored, in the current format and layout, for load_cooked
+	bool save_cooked(std::string_view path) const;
+
+	// maps a file written by save_cooked and samples its texels in place, nothing is decoded or copied.
+	// the texture takes the format, layout and mip chain the file was cooked with. editing the texture copies
+	// the texels out of the mapping first
+	bool load_cooked(std::string_view path);
+
+	// loads an image, tiles it, generates its mip chain and compresses it when format is a block format,
+	// then writes it to cooked_path with save_cooked
+	static bool cook(std::string_view image_path, std::string_view cooked_path, bool flip = true,
+		ColorFormat format = ColorFormat::LDR_RGBA, ThreadPool* thread_pool = nullptr);
+
+	// true while the texels are read from a cooked file
+	bool is_mapped() const;
+
+	// rebuilds levels 1.. of the mip chain from level 0 with a 2x2 box filter, rows of a level are filtered
+	// in parallel when thread_pool is given. call again after editing level 0
+	void generate_mipmaps(ThreadPool* thread_pool = nullptr, TaskQueue* queue = nullptr);
+
+	// 1 until generate_mipmaps is called
+	int mip_level_num() const;
+
+	// encodes every level of an LDR_RGBA or block compressed texture into block format, tiles are encoded in
+	// parallel when thread_pool is given. edge tiles are padded with their edge texels. HDR formats are left as is
+	void compress(ColorFormat format, ThreadPool* thread_pool = nullptr, TaskQueue* queue = nullptr);
+
+	// decodes a block compressed texture back to LDR_RGBA, keeping the TILED layout
+	void decompress();
+
+	static bool is_block_format(ColorFormat format);
+
+	// converts between HDR_RGBA, HDR_RGBA16F and HDR_RGB9E5 in place, other formats are left as is
+	void convert_hdr(ColorFormat format);
+
+	static bool is_hdr_format(ColorFormat format);
 	
 
-	int width() const;
+	int width(int level = 0) const;
 
-	int height() const;
+	int height(int level = 0) const;
 	
+	// texels in layout() order, or one block per tile for the block formats. copies mapped texels out first,
+	// each call drops the decoded blocks cached for sample(), so fetch it again before rewriting blocks already sampled
 	unsigned char* ldr_color_buffer_data();
 
 	float* hdr_color_buffer_data();
 
+	// 4 halves per texel
+	uint16_t* half_color_buffer_data();
+
+	uint32_t* rgb9e5_color_buffer_data();
+
 	ColorFormat color_format() const;
 
+	// converts the texels in place. create and load keep the current layout, save always writes rows.
+	// block formats stay TILED
+	void set_layout(Layout layout);
+
+	Layout layout() const;
+
 
+	// ignored for block formats, decompress first
 	void set_color(int x, int y, const Color4& color);
 
-	Color4 get_color(int x, int y) const;
+	Color4 get_color(int x, int y, int level = 0) const;
 
-	Color4 sample(float x, float y) const;
+	// lod is the mip level to read, fractional for TRILINEAR. the other modes read the nearest level
+	Color4 sample(float x, float y, float lod = 0.0f) const;
+
+	// filter weights and addresses are computed for all lanes at once, texels of inactive lanes are not fetched
+	Vec4x8 sample(const Vec2x8& texcoord, const Mask8& active, const Float8& lod = Float8(0.0f)) const;
+
+	// same as above with the filter and warp mode given in place of sampleMode and warpMode
+	Color4 sample(float x, float y, float lod, SampleMode mode, WarpMode warp) const;
+
+	Vec4x8 sample(const Vec2x8& texcoord, const Mask8& active, const Float8& lod, SampleMode mode, WarpMode warp) const;
+
+	// level of detail of a footprint given the texcoord derivatives along screen x and y
+	float lod(const Vec2& ddx, const Vec2& ddy) const;
+
+	Float8 lod(const Vec2x8& ddx, const Vec2x8& ddy) const;
 
 	
 private:
 
+	struct Level
+	{
+		int width;
+		int height;
+		int tiles_x;		// tiles per row in the TILED layout
+		size_t offset;		// index of the level's first texel in the color buffer
+	};
+
 	int _width = 0;
 	int _height = 0;
 
+	// every level of the mip chain one after another, level 0 first
 	std::vector<unsigned char> _ldr_color_buffer;
 	std::vector<float>		   _hdr_color_buffer;
+	std::vector<uint16_t>	   _half_color_buffer;
+	std::vector<uint32_t>	   _rgb9e5_color_buffer;
+	std::vector<Level>		   _levels;
+
+	// the mapped cooked file the texels are read from in place of the color buffer, shared by copies
+	std::shared_ptr<const MappedFile> _mapped_file = nullptr;
+	const void* _mapped_texels = nullptr;
+	size_t _mapped_size = 0;
 
 	ColorFormat _color_format = ColorFormat::LDR_RGBA;
+	Layout _layout = Layout::LINEAR;
+
+	// renewed whenever the blocks are rewritten, tells decoded blocks of an old buffer at the same
+	// address apart in the block cache
+	uint64_t _block_generation = 0;
+
+	// lays out level_num levels from _width and _height and sizes the color buffer for them
+	void _allocate_levels(int level_num);
+
+	// lays out level_num levels from _width and _height, returns the bytes of color buffer they take
+	size_t _layout_levels(int level_num);
+
+	// the color buffer of the current format or the mapped texels
+	const void* _color_data() const;
+
+	size_t _color_data_size() const;
+
+	// moves mapped texels into the color buffer and releases the mapping, called before every edit
+	void _detach();
+
+	// index of texel (x, y) of a level in the color buffer, 4 channels per texel except the single word of
+	// HDR_RGB9E5. for the block formats index / 16 is the block and index % 16 the texel inside it
+	static size_t _texel_index(const Level& level, int x, int y, Layout layout)
+	{
+		// 2 bits of x and y address a texel inside a TILE_SIZE 4 tile
+		if (layout == Layout::TILED)
+			return level.offset + ((size_t(y >> 2) * level.tiles_x + (x >> 2)) << 4 | (y & 3) << 2 | (x & 3));
+		return level.offset + size_t(y) * level.width + x;
+	}
+
+	size_t _texel_index(const Level& level, int x, int y) const
+	{
+		return _texel_index(level, x, y, _layout);
+	}
+
+	template<class T>
+	void _filter_mip_row(std::vector<T>& buffer, const Level& src, const Level& dst, int y);
+
+	Color4 _sample_level(float x, float y, int level, SampleMode mode, WarpMode warp) const;
+
+	Vec4x8 _sample_levels(const Vec2x8& texcoord, int mask, const float* level, SampleMode mode, WarpMode warp) const;
+
+	// samples the lanes of mask at texcoord (u, v), each from its own level, and writes one color per lane to out.
+	// instantiated per storage format, layout, warp mode and filter so the texel addressing and weighting
+	// compile without branches on the texture's state
+	using Kernel = void (*)(const Texture& texture, const float* u, const float* v, const float* level, int mask, Color4* out);
+
+	static constexpr size_t KERNEL_NUM = 7 * 2 * 4 * 3;
+
+	template<ColorFormat FORMAT, Layout LAYOUT, WarpMode WARP, SampleMode FILTER>
+	static void _sample_kernel(const Texture& texture, const float* u, const float* v, const float* level, int mask, Color4* out);
+
+	template<size_t... I>
+	static constexpr std::array<Kernel, sizeof...(I)> _kernel_table(std::index_sequence<I...>);
+
+	// filter is NEAREST, BILINEAR or BICUBIC
+	Kernel _kernel(SampleMode filter, WarpMode warp) const;
 	
 };
 
+// index of a texture in a TextureTable, 0 is no texture
+struct TextureHandle
+{
+	uint32_t id = 0;
+
+	bool valid() const { return id != 0; }
+
+	bool operator==(const TextureHandle& other) const { return id == other.id; }
+};
+
+// a texture of a TextureTable and the index of the sampler state to filter it with, or only a default color.
+// a plain value, copying and binding it touches no reference count. the table must outlive it
 struct TextureSampler
 {
-	TextureSampler(std::shared_ptr<Texture> texture = nullptr) : _texture(texture) {}
+	TextureSampler() = default;
 
 	TextureSampler(const Color4& default_color) : _default_color(default_color) {}
 
+	TextureSampler(const TextureTable* table, TextureHandle handle, uint32_t sampler_state = 0, const Color4& default_color = Color::TRANSPARENT)
+		: _table(table), _handle(handle), _sampler_state(sampler_state), _default_color(default_color) {}
+
 	Color4 sample(float x, float y) const;
 
 	Color4 sample(const Vec2& texcoord) const;
 
+	Vec4x8 sample(const Vec2x8& texcoord, const Mask8& active) const;
+
+	// the lod comes from the texcoord derivatives along screen x and y, see FSIn::ddx_varying
+	Color4 sample(const Vec2& texcoord, const Vec2& ddx, const Vec2& ddy) const;
+
+	Vec4x8 sample(const Vec2x8& texcoord, const Vec2x8& ddx, const Vec2x8& ddy, const Mask8& active) const;
+
+	Color4 sample_lod(const Vec2& texcoord, float lod) const;
+
+	Vec4x8 sample_lod(const Vec2x8& texcoord, const Float8& lod, const Mask8& active) const;
+
+	// true when the handle names no texture of the table, also after the texture was removed
 	bool empty() const;
 
+	TextureHandle handle() const { return _handle; }
+
+	uint32_t sampler_state() const { return _sampler_state; }
+
+	bool operator==(const TextureSampler& other) const
+	{
+		return _table == other._table && _handle == other._handle && _sampler_state == other._sampler_state && _default_color == other._default_color;
+	}
+
 private:
 
-	std::shared_ptr<Texture> _texture = nullptr;
+	const TextureTable* _table = nullptr;
+	TextureHandle _handle;
+	uint32_t _sampler_state = 0;
 
 	Color4 _default_color = Color::TRANSPARENT;
+
+	// calls f with the bound texture or virtual texture and the filter and warp mode of the sampler state,
+	// returns fallback when nothing is bound
+	template<class R, class F>
+	R _visit(const R& fallback, F&& f) const;
 	
 };
 
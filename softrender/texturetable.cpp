@@ -0,0 +1,104 @@
+#include "texturetable.h"
+#include "virtualtexture.h"
+#include <algorithm>
+#include <atomic>
+
+namespace
+{
+	std::atomic<uint64_t> table_generations{ 0 };
+}
+
+TextureTable::TextureTable()
+{
+	_entries.resize(1);
+	_sampler_states.resize(1);
+	_generation = ++table_generations;
+}
+
+TextureHandle TextureTable::add(std::shared_ptr<Texture> texture)
+{
+	if (!texture)
+		return {};
+	const void* key = texture.get();
+	return _add(key, { std::move(texture), nullptr });
+}
+
+TextureHandle TextureTable::add(std::shared_ptr<VirtualTexture> texture)
+{
+	if (!texture)
+		return {};
+	const void* key = texture.get();
+	return _add(key, { nullptr, std::move(texture) });
+}
+
+TextureHandle TextureTable::_add(const void* key, Entry&& entry)
+{
+	auto it = _ids.find(key);
+	if (it != _ids.end())
+	{
+		_entries[it->second].add_count++;
+		return { it->second };
+	}
+	entry.add_count = 1;
+
+	uint32_t id;
+	if (!_free_ids.empty())
+	{
+		id = _free_ids.back();
+		_free_ids.pop_back();
+		_entries[id] = std::move(entry);
+	}
+	else
+	{
+		id = uint32_t(_entries.size());
+		_entries.push_back(std::move(entry));
+	}
+	_ids[key] = id;
+	return { id };
+}
+
+void TextureTable::remove(TextureHandle handle)
+{
+	if (!handle.valid() || handle.id >= _entries.size())
+		return;
+	auto& entry = _entries[handle.id];
+	if (!entry.texture && !entry.virtual_texture)
+		return;
+	if (--entry.add_count)
+		return;
+	_ids.erase(entry.texture ? static_cast<const void*>(entry.texture.get()) : entry.virtual_texture.get());
+	entry = Entry();
+	_free_ids.push_back(handle.id);
+}
+
+void TextureTable::clear()
+{
+	_entries.assign(1, Entry());
+	_free_ids.clear();
+	_ids.clear();
+	_generation = ++table_generations;
+}
+
+uint64_t TextureTable::generation() const
+{
+	return _generation;
+}
+
+size_t TextureTable::size() const
+{
+	return _ids.size();
+}
+
+uint32_t TextureTable::add_sampler_state(const SamplerState& state)
+{
+	auto it = std::find(_sampler_states.begin() + 1, _sampler_states.end(), state);
+	if (it != _sampler_states.end())
+		return uint32_t(it - _sampler_states.begin());
+	_sampler_states.push_back(state);
+	return uint32_t(_sampler_states.size() - 1);
+}
+
+TextureSampler TextureTable::sampler(TextureHandle handle, uint32_t sampler_state, const Color4& default_color) const
+{
+	return TextureSampler(this, handle, sampler_state, default_color);
+}
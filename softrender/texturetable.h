@@ -0,0 +1,100 @@
+#ifndef TEXTURE_TABLE_H
+#define TEXTURE_TABLE_H
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include "texture.h"
+
+struct SamplerState
+{
+	Texture::SampleMode sampleMode = Texture::SampleMode::NEAREST;
+	Texture::WarpMode warpMode = Texture::WarpMode::REPEAT;
+
+	bool operator==(const SamplerState& other) const
+	{
+		return sampleMode == other.sampleMode && warpMode == other.warpMode;
+	}
+};
+
+// the textures a device's shaders sample, kept alive by the table and named by stable integer handles so a
+// TextureSampler only carries a handle and a sampler state index. sampler state 0 filters with the texture's
+// own sampleMode and warpMode, the others override them.
+// adding and removing is not thread safe against drawing, do it between draws
+class TextureTable
+{
+public:
+
+	static constexpr uint32_t TEXTURE_SAMPLER_STATE = 0;
+
+
+	TextureTable();
+
+	TextureTable(const TextureTable&) = delete;
+	TextureTable& operator=(const TextureTable&) = delete;
+
+	// a texture that is already in the table keeps its handle. every add needs a remove
+	TextureHandle add(std::shared_ptr<Texture> texture);
+
+	TextureHandle add(std::shared_ptr<VirtualTexture> texture);
+
+	// the texture is dropped once it was removed as often as it was added. samplers of a dropped handle
+	// sample their default color until the handle is handed out again
+	void remove(TextureHandle handle);
+
+	// drops every texture and renews generation(), the sampler states stay
+	void clear();
+
+	// unique among all tables and renewed by clear, tells whether handles taken from a table are still valid
+	uint64_t generation() const;
+
+	// textures in the table
+	size_t size() const;
+
+	// returns the index of an equal state when there is one
+	uint32_t add_sampler_state(const SamplerState& state);
+
+	TextureSampler sampler(TextureHandle handle, uint32_t sampler_state = TEXTURE_SAMPLER_STATE, const Color4& default_color = Color::TRANSPARENT) const;
+
+
+	const Texture* texture(TextureHandle handle) const
+	{
+		return handle.id < _entries.size() ? _entries[handle.id].texture.get() : nullptr;
+	}
+
+	const VirtualTexture* virtual_texture(TextureHandle handle) const
+	{
+		return handle.id < _entries.size() ? _entries[handle.id].virtual_texture.get() : nullptr;
+	}
+
+	// nullptr for TEXTURE_SAMPLER_STATE
+	const SamplerState* sampler_state(uint32_t index) const
+	{
+		return index ? &_sampler_states[index] : nullptr;
+	}
+
+private:
+
+	struct Entry
+	{
+		std::shared_ptr<Texture> texture = nullptr;
+		std::shared_ptr<VirtualTexture> virtual_texture = nullptr;
+		uint32_t add_count = 0;
+	};
+
+	uint64_t _generation = 0;
+
+	// entry 0 stays empty for the null handle
+	std::vector<Entry> _entries;
+	std::vector<uint32_t> _free_ids;
+	std::unordered_map<const void*, uint32_t> _ids;
+
+	// state 0 is a placeholder for TEXTURE_SAMPLER_STATE
+	std::vector<SamplerState> _sampler_states;
+
+	TextureHandle _add(const void* key, Entry&& entry);
+
+};
+
+#endif
@@ -0,0 +1,118 @@
+#include "threadaffinity.h"
+#include <thread>
+
+#if defined(_WIN32)
+
+#include <Windows.h>
+
+int numa_node_count()
+{
+	ULONG highest = 0;
+	if (!GetNumaHighestNodeNumber(&highest))
+		return 1;
+	return highest + 1;
+}
+
+std::vector<int> numa_node_cpus(int node)
+{
+	std::vector<int> cpus;
+	GROUP_AFFINITY affinity = {};
+	if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity))
+		return cpus;
+	for (int i = 0; i < 64; i++)
+		if (affinity.Mask >> i & 1)
+			cpus.push_back(affinity.Group * 64 + i);
+	return cpus;
+}
+
+bool set_current_thread_affinity(const std::vector<int>& cpus)
+{
+	if (cpus.empty())
+		return false;
+	// a thread can only run inside one processor group, cpus outside the first one's group are dropped
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = WORD(cpus[0] / 64);
+	for (int cpu : cpus)
+		if (cpu / 64 == affinity.Group)
+			affinity.Mask |= KAFFINITY(1) << (cpu % 64);
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+}
+
+#elif defined(__linux__)
+
+#include <pthread.h>
+#include <sched.h>
+#include <fstream>
+#include <string>
+#include <sstream>
+
+int numa_node_count()
+{
+	int count = 0;
+	while (std::ifstream("/sys/devices/system/node/node" + std::to_string(count) + "/cpulist"))
+		count++;
+	return count ? count : 1;
+}
+
+std::vector<int> numa_node_cpus(int node)
+{
+	std::vector<int> cpus;
+	std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	if (!in)
+	{
+		if (node == 0)
+			for (unsigned i = 0; i < std::thread::hardware_concurrency(); i++)
+				cpus.push_back(i);
+		return cpus;
+	}
+	// cpulist looks like "0-7,16-23"
+	std::string range;
+	while (std::getline(in, range, ','))
+	{
+		int first = 0, last = 0;
+		char dash = 0;
+		std::istringstream ss(range);
+		ss >> first;
+		last = first;
+		if (ss >> dash >> last; dash != '-')
+			last = first;
+		for (int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+bool set_current_thread_affinity(const std::vector<int>& cpus)
+{
+	if (cpus.empty())
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+		if (cpu >= 0 && cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+#else
+
+int numa_node_count()
+{
+	return 1;
+}
+
+std::vector<int> numa_node_cpus(int node)
+{
+	std::vector<int> cpus;
+	if (node == 0)
+		for (unsigned i = 0; i < std::thread::hardware_concurrency(); i++)
+			cpus.push_back(i);
+	return cpus;
+}
+
+bool set_current_thread_affinity(const std::vector<int>& cpus)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef THREAD_AFFINITY_H
+#define THREAD_AFFINITY_H
+
+#include <vector>
+
+// number of NUMA nodes, 1 when the platform does not report any
+int numa_node_count();
+
+// logical cpus that belong to a NUMA node
+std::vector<int> numa_node_cpus(int node);
+
+// restricts the calling thread to the given logical cpus, returns false if the platform refused
+bool set_current_thread_affinity(const std::vector<int>& cpus);
+
+#endif
@@ -3,97 +3,708 @@
 
 #include <mutex>
 #include <condition_variable>
-#include <functional>
-#include <queue>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
 #include <thread>
-#include <future>
-#include <condition_variable>
+#include <new>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+#include "utils.h"
+#include "threadaffinity.h"
 
-class FixedThreadPool 
+// move-only void() callable, small callables are stored inline without heap allocation
+class Task
 {
 public:
-    FixedThreadPool(size_t thread_count)
-        : _data(std::make_shared<Data>()) 
+
+    static constexpr size_t INLINE_SIZE = 64;
+
+    Task() = default;
+
+    template<class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f)
     {
-        _data->thread_count = thread_count;
-        for (size_t i = 0; i < thread_count; ++i) 
+        using Fn = std::decay_t<F>;
+        if constexpr (sizeof(Fn) <= INLINE_SIZE
+            && alignof(Fn) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<Fn>)
         {
-            std::thread([data = _data] {
-                std::unique_lock<std::mutex> lk(data->mtx);
-                while(true)
-                {
-                    if (!data->tasks.empty()) 
-                    {
-                        auto [task, prom] = std::move(data->tasks.front());
-                        data->tasks.pop();
-                        lk.unlock();
-                        task();
-                        prom.set_value();
-                        lk.lock();
-                    }
-                    else if (data->is_shutdown_) 
-                    {
-                        break;
-                    }
-                    else 
-                    {
-                        data->cond.wait(lk);
-                    }
-                }
-            }).detach();
+            new (_storage) Fn(std::forward<F>(f));
+            _manage = &_manage_inline<Fn>;
+        }
+        else
+        {
+            *reinterpret_cast<Fn**>(_storage) = new Fn(std::forward<F>(f));
+            _manage = &_manage_heap<Fn>;
+        }
+    }
+
+    Task(Task&& other) noexcept
+    {
+        _move_from(other);
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            _move_from(other);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        reset();
+    }
+
+    void operator()()
+    {
+        _manage(Op::INVOKE, this, nullptr);
+    }
+
+    explicit operator bool() const
+    {
+        return _manage != nullptr;
+    }
+
+    void reset()
+    {
+        if (_manage)
+        {
+            _manage(Op::DESTROY, this, nullptr);
+            _manage = nullptr;
+        }
+    }
+
+private:
+
+    enum class Op
+    {
+        INVOKE,
+        MOVE,
+        DESTROY
+    };
+
+    using ManageFunc = void(*)(Op op, Task* self, Task* other);
+
+    alignas(std::max_align_t) unsigned char _storage[INLINE_SIZE];
+
+    ManageFunc _manage = nullptr;
+
+    void _move_from(Task& other)
+    {
+        if (other._manage)
+        {
+            other._manage(Op::MOVE, &other, this);
+            _manage = other._manage;
+            other._manage = nullptr;
+        }
+    }
+
+    template<class Fn>
+    static void _manage_inline(Op op, Task* self, Task* other)
+    {
+        Fn* fn = std::launder(reinterpret_cast<Fn*>(self->_storage));
+        switch (op)
+        {
+        case Op::INVOKE:
+            (*fn)();
+            break;
+        case Op::MOVE:
+            new (other->_storage) Fn(std::move(*fn));
+            fn->~Fn();
+            break;
+        case Op::DESTROY:
+            fn->~Fn();
+            break;
+        }
+    }
+
+    template<class Fn>
+    static void _manage_heap(Op op, Task* self, Task* other)
+    {
+        Fn*& fn = *reinterpret_cast<Fn**>(self->_storage);
+        switch (op)
+        {
+        case Op::INVOKE:
+            (*fn)();
+            break;
+        case Op::MOVE:
+            *reinterpret_cast<Fn**>(other->_storage) = fn;
+            fn = nullptr;
+            break;
+        case Op::DESTROY:
+            delete fn;
+            break;
+        }
+    }
+
+};
+
+// counts outstanding tasks, ThreadPool::wait returns once it drops to zero
+class TaskCounter
+{
+public:
+
+    TaskCounter() = default;
+
+    TaskCounter(const TaskCounter&) = delete;
+
+    TaskCounter& operator=(const TaskCounter&) = delete;
+
+    void add(int n = 1)
+    {
+        _count.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // returns true for the call that brings the count to zero
+    bool done()
+    {
+        return _count.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    bool is_zero() const
+    {
+        return _count.load(std::memory_order_acquire) == 0;
+    }
+
+private:
+
+    std::atomic<int> _count = 0;
+
+};
+
+class SpinLock
+{
+public:
+
+    void lock()
+    {
+        while (_flag.test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+
+    void unlock()
+    {
+        _flag.clear(std::memory_order_release);
+    }
+
+private:
+
+    std::atomic_flag _flag = ATOMIC_FLAG_INIT;
+
+};
+
+// submission queue owned by one client of the pool (e.g. a RenderDevice),
+// workers serve the queues round-robin so concurrent clients get a fair share
+class TaskQueue
+{
+private:
+
+    friend class ThreadPool;
+
+    SpinLock lock;
+    std::deque<Task> tasks;
+    bool in_use = false;
+
+};
+
+struct ThreadPoolConfig
+{
+    // 0 uses one worker per cpu of the selected NUMA nodes, or per hardware thread
+    size_t thread_count = 0;
+
+    // explicit cpu set for every worker, worker i uses affinity[i % affinity.size()], overrides numa_nodes
+    std::vector<std::vector<int>> affinity;
+
+    // NUMA nodes the workers are spread over in contiguous blocks, empty leaves placement to the OS
+    std::vector<int> numa_nodes;
+
+    // pins each worker to a single cpu so the screen region it owns stays in that core's cache between frames
+    bool pin_workers = false;
+};
+
+// work-stealing pool: every worker owns a deque and pops its own tasks from the back,
+// then takes work from the submission queues and finally steals from the front of the other workers
+class ThreadPool
+{
+public:
+
+    static constexpr size_t MAX_QUEUE_NUM = 1024;
+
+    explicit ThreadPool(size_t thread_count) : ThreadPool(_thread_count_config(thread_count))
+    {
+    }
+
+    explicit ThreadPool(const ThreadPoolConfig& config)
+    {
+        auto worker_cpus = _assign_cpus(config);
+        for (size_t i = 0; i < worker_cpus.size(); ++i)
+        {
+            _workers.push_back(std::make_unique<Worker>());
+            _workers[i]->cpus = std::move(worker_cpus[i]);
+        }
+        for (size_t i = 0; i < _workers.size(); ++i)
+            _workers[i]->thread = std::thread(&ThreadPool::_worker_loop, this, i);
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(_sleep_mtx);
+            _is_shutdown = true;
         }
+        _sleep_cond.notify_all();
+        for (auto& worker : _workers)
+            worker->thread.join();
+    }
+
+    // process-wide pool shared by all devices, created on first use from the config given to configure_shared
+    static std::shared_ptr<ThreadPool> shared()
+    {
+        static std::shared_ptr<ThreadPool> pool = std::make_shared<ThreadPool>(_claim_shared_config());
+        return pool;
     }
 
-    FixedThreadPool() = default;
-	
-    FixedThreadPool(FixedThreadPool&&) = default;
+    // returns false if the shared pool is already running
+    static bool configure_shared(const ThreadPoolConfig& config)
+    {
+        std::lock_guard<std::mutex> lk(_shared_mtx());
+        if (_shared_created())
+            return false;
+        _shared_config() = config;
+        return true;
+    }
 
-    ~FixedThreadPool() 
+    // returns nullptr when all queue slots are taken, tasks then go straight to the workers
+    TaskQueue* create_queue()
     {
-        if (_data) 
+        std::lock_guard<std::mutex> lk(_queue_mtx);
+        size_t count = _queue_count.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < count; i++)
         {
+            if (!_queues[i]->in_use)
             {
-                std::lock_guard<std::mutex> lk(_data->mtx);
-                _data->is_shutdown_ = true;
+                _queues[i]->in_use = true;
+                return _queues[i].get();
             }
-            _data->cond.notify_all();
         }
+        if (count == MAX_QUEUE_NUM)
+            return nullptr;
+        _queues[count] = std::make_unique<TaskQueue>();
+        _queues[count]->in_use = true;
+        _queue_count.store(count + 1, std::memory_order_release);
+        return _queues[count].get();
+    }
+
+    // the queue must be empty, its slot is kept alive and reused by later create_queue calls
+    void release_queue(TaskQueue* queue)
+    {
+        if (!queue)
+            return;
+        std::lock_guard<std::mutex> lk(_queue_mtx);
+        queue->in_use = false;
     }
 
     template <class F>
-    std::future<void> execute(F&& task) 
+    void execute(F&& task, TaskCounter& counter, TaskQueue* queue = nullptr)
     {
-        std::future<void> fut;
+        counter.add();
+        _push(Task([this, task = std::forward<F>(task), &counter]() mutable
         {
-            std::lock_guard<std::mutex> lk(_data->mtx);
-            std::promise<void> p;
-			fut = p.get_future();
-            _data->tasks.emplace(std::forward<F>(task), std::move(p));
+            task();
+            if (counter.done())
+            {
+                std::lock_guard<std::mutex> lk(_wait_mtx);
+                _wait_cond.notify_all();
+            }
+        }), queue);
+    }
+
+    // the calling thread runs queued tasks while it waits and only blocks when there is nothing to help with,
+    // threads outside the pool only help with tasks of their own queue
+    void wait(TaskCounter& counter, TaskQueue* queue = nullptr)
+    {
+        while (!counter.is_zero())
+        {
+            Task task;
+            if (_is_worker_thread() ? _try_acquire(task) : _try_pop_front(queue, task))
+            {
+                task();
+                continue;
+            }
+            // a blocked worker still has to run the region tasks pinned to it, or their owner would wait forever
+            Worker* worker = _is_worker_thread() ? _workers[_current_index].get() : nullptr;
+            std::unique_lock<std::mutex> lk(_wait_mtx);
+            _wait_cond.wait(lk, [&counter, worker] { return counter.is_zero() || (worker && worker->pinned_pending.load() > 0); });
         }
-        _data->cond.notify_one();
-        return fut;
     }
 
     size_t thread_count() const
     {
-        return _data->thread_count;
+        return _workers.size();
+    }
+
+    // screen regions are owned by workers, region i always runs on worker i % thread_count()
+    size_t region_count() const
+    {
+        return _workers.size();
+    }
+
+    // runs fn(region) for every region on the worker that owns it, these tasks are never stolen
+    template <class F>
+    void for_each_region(size_t count, F&& fn, TaskQueue* queue = nullptr)
+    {
+        if (count == 0)
+            return;
+        if (count == 1)
+        {
+            fn(size_t(0));
+            return;
+        }
+        TaskCounter counter;
+        for (size_t i = 0; i < count; i++)
+        {
+            counter.add();
+            _push_pinned(Task([this, &fn, i, &counter]
+            {
+                fn(i);
+                if (counter.done())
+                {
+                    std::lock_guard<std::mutex> lk(_wait_mtx);
+                    _wait_cond.notify_all();
+                }
+            }), i % _workers.size());
+        }
+        wait(counter, queue);
+    }
+
+    // target run time of a single parallel_for chunk, long enough to hide the scheduling overhead
+    static constexpr double CHUNK_TARGET_NS = 50000.0;
+
+    // minimum items per chunk for a stage whose items cost roughly item_cost_ns each
+    static size_t grain_size(double item_cost_ns)
+    {
+        return std::max<size_t>(1, size_t(CHUNK_TARGET_NS / std::max(item_cost_ns, 1.0)));
+    }
+
+    size_t chunk_count(size_t n, size_t grain) const
+    {
+        grain = std::max<size_t>(grain, 1);
+        return std::clamp<size_t>((n + grain - 1) / grain, 1, thread_count() * 8);
+    }
+
+    // splits [begin, end) into chunk_count(end - begin, grain) chunks and calls fn(l, r) or fn(l, r, chunk_index)
+    // for each of them, a range that fits in one chunk runs inline on the calling thread
+    template <class F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F&& fn, TaskQueue* queue = nullptr)
+    {
+        if (end <= begin)
+            return;
+        size_t n = end - begin;
+        size_t chunks = chunk_count(n, grain);
+        if (chunks == 1)
+        {
+            _invoke_chunk(fn, begin, end, 0);
+            return;
+        }
+
+        TaskCounter counter;
+        size_t l = begin;
+        for (size_t i = 0; i + 1 < chunks; i++)
+        {
+            size_t r = l + get_batch_size(n, chunks, i);
+            execute([&fn, l, r, i] { _invoke_chunk(fn, l, r, i); }, counter, queue);
+            l = r;
+        }
+        _invoke_chunk(fn, l, end, chunks - 1);
+        wait(counter, queue);
     }
 
 private:
 
-    struct Data 
+    struct Worker
     {
-        size_t thread_count;
-        std::mutex mtx;
-        std::condition_variable cond;
-        bool is_shutdown_ = false;
-        std::queue<
-            std::pair<std::function<void()>, std::promise<void>>,
-            std::list<std::pair<std::function<void()>, std::promise<void>>>
-        > tasks;
+        SpinLock lock;
+        std::deque<Task> tasks;
+        std::deque<Task> pinned_tasks;
+        std::atomic<size_t> pinned_pending = 0;
+        std::vector<int> cpus;
+        std::thread thread;
     };
-	
-    std::shared_ptr<Data> _data;
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+
+    std::unique_ptr<TaskQueue> _queues[MAX_QUEUE_NUM];
+    std::atomic<size_t> _queue_count = 0;
+    std::mutex _queue_mtx;
+
+    std::atomic<size_t> _pending = 0;
+    std::atomic<size_t> _sleeping = 0;
+    std::atomic<size_t> _next_worker = 0;
+    std::atomic<size_t> _next_queue = 0;
+
+    std::mutex _sleep_mtx;
+    std::condition_variable _sleep_cond;
+    bool _is_shutdown = false;
+
+    std::mutex _wait_mtx;
+    std::condition_variable _wait_cond;
+
+    inline static thread_local ThreadPool* _current_pool = nullptr;
+    inline static thread_local size_t _current_index = 0;
+
+
+    static ThreadPoolConfig _thread_count_config(size_t thread_count)
+    {
+        ThreadPoolConfig config;
+        config.thread_count = thread_count;
+        return config;
+    }
+
+    static ThreadPoolConfig& _shared_config()
+    {
+        static ThreadPoolConfig config;
+        return config;
+    }
+
+    // guarded by _shared_mtx, set before the shared pool is constructed
+    static bool& _shared_created()
+    {
+        static bool created = false;
+        return created;
+    }
+
+    static std::mutex& _shared_mtx()
+    {
+        static std::mutex mtx;
+        return mtx;
+    }
+
+    // the config the shared pool is built with, configure_shared fails from here on
+    static ThreadPoolConfig _claim_shared_config()
+    {
+        std::lock_guard<std::mutex> lk(_shared_mtx());
+        _shared_created() = true;
+        return _shared_config();
+    }
+
+    static std::vector<std::vector<int>> _assign_cpus(const ThreadPoolConfig& config)
+    {
+        std::vector<std::vector<int>> node_cpus;
+        for (int node : config.numa_nodes)
+            if (auto cpus = numa_node_cpus(node); !cpus.empty())
+                node_cpus.push_back(std::move(cpus));
+
+        size_t thread_count = config.thread_count;
+        if (thread_count == 0)
+        {
+            for (auto& cpus : node_cpus)
+                thread_count += cpus.size();
+            if (thread_count == 0)
+                thread_count = std::thread::hardware_concurrency();
+        }
+        thread_count = std::max<size_t>(thread_count, 1);
+
+        std::vector<std::vector<int>> result(thread_count);
+        if (!config.affinity.empty())
+        {
+            for (size_t i = 0; i < thread_count; i++)
+                result[i] = config.affinity[i % config.affinity.size()];
+            return result;
+        }
+
+        if (node_cpus.empty() && config.pin_workers)
+            node_cpus.push_back(numa_node_cpus(0));
+        if (node_cpus.empty())
+            return result;
+
+        // contiguous blocks of workers share a node, so neighbouring screen regions stay on the same socket
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            size_t node = i * node_cpus.size() / thread_count;
+            size_t first = (node * thread_count + node_cpus.size() - 1) / node_cpus.size();
+            auto& cpus = node_cpus[node];
+            if (config.pin_workers)
+                result[i] = { cpus[(i - first) % cpus.size()] };
+            else
+                result[i] = cpus;
+        }
+        return result;
+    }
+
+    template <class F>
+    static void _invoke_chunk(F& fn, size_t l, size_t r, size_t chunk)
+    {
+        if constexpr (std::is_invocable_v<F&, size_t, size_t, size_t>)
+            fn(l, r, chunk);
+        else
+            fn(l, r);
+    }
+
+    bool _is_worker_thread() const
+    {
+        return _current_pool == this;
+    }
+
+    void _push(Task&& task, TaskQueue* queue)
+    {
+        _pending.fetch_add(1);
+        if (queue && !_is_worker_thread())
+        {
+            std::lock_guard<SpinLock> lk(queue->lock);
+            queue->tasks.push_back(std::move(task));
+        }
+        else
+        {
+            size_t index = _is_worker_thread()
+                ? _current_index
+                : _next_worker.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+            std::lock_guard<SpinLock> lk(_workers[index]->lock);
+            _workers[index]->tasks.push_back(std::move(task));
+        }
+        if (_sleeping.load() > 0)
+        {
+            std::lock_guard<std::mutex> lk(_sleep_mtx);
+            _sleep_cond.notify_one();
+        }
+    }
+
+    void _push_pinned(Task&& task, size_t index)
+    {
+        auto& worker = *_workers[index];
+        worker.pinned_pending.fetch_add(1);
+        {
+            std::lock_guard<SpinLock> lk(worker.lock);
+            worker.pinned_tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lk(_wait_mtx);
+            _wait_cond.notify_all();
+        }
+        if (_sleeping.load() > 0)
+        {
+            std::lock_guard<std::mutex> lk(_sleep_mtx);
+            _sleep_cond.notify_all();
+        }
+    }
+
+    bool _try_pop_pinned(size_t index, Task& task)
+    {
+        auto& worker = *_workers[index];
+        if (worker.pinned_pending.load() == 0)
+            return false;
+        std::lock_guard<SpinLock> lk(worker.lock);
+        if (worker.pinned_tasks.empty())
+            return false;
+        task = std::move(worker.pinned_tasks.front());
+        worker.pinned_tasks.pop_front();
+        worker.pinned_pending.fetch_sub(1);
+        return true;
+    }
+
+    bool _try_pop_back(size_t index, Task& task)
+    {
+        auto& worker = *_workers[index];
+        std::lock_guard<SpinLock> lk(worker.lock);
+        if (worker.tasks.empty())
+            return false;
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        _pending.fetch_sub(1);
+        return true;
+    }
+
+    bool _try_steal(size_t index, Task& task)
+    {
+        auto& worker = *_workers[index];
+        std::lock_guard<SpinLock> lk(worker.lock);
+        if (worker.tasks.empty())
+            return false;
+        task = std::move(worker.tasks.front());
+        worker.tasks.pop_front();
+        _pending.fetch_sub(1);
+        return true;
+    }
+
+    bool _try_pop_front(TaskQueue* queue, Task& task)
+    {
+        if (!queue)
+            return false;
+        std::lock_guard<SpinLock> lk(queue->lock);
+        if (queue->tasks.empty())
+            return false;
+        task = std::move(queue->tasks.front());
+        queue->tasks.pop_front();
+        _pending.fetch_sub(1);
+        return true;
+    }
+
+    bool _try_acquire(Task& task)
+    {
+        if (_try_pop_pinned(_current_index, task))
+            return true;
+
+        if (_pending.load() == 0)
+            return false;
+
+        if (_try_pop_back(_current_index, task))
+            return true;
+
+        size_t queue_count = _queue_count.load(std::memory_order_acquire);
+        size_t start = _next_queue.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < queue_count; i++)
+        {
+            if (_try_pop_front(_queues[(start + i) % queue_count].get(), task))
+                return true;
+        }
+
+        size_t n = _workers.size();
+        for (size_t i = 1; i < n; i++)
+        {
+            if (_try_steal((_current_index + i) % n, task))
+                return true;
+        }
+        return false;
+    }
+
+    void _worker_loop(size_t index)
+    {
+        _current_pool = this;
+        _current_index = index;
+        auto& worker = *_workers[index];
+        if (!worker.cpus.empty())
+            set_current_thread_affinity(worker.cpus);
+        while (true)
+        {
+            Task task;
+            if (_try_acquire(task))
+            {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(_sleep_mtx);
+            _sleeping.fetch_add(1);
+            _sleep_cond.wait(lk, [this, &worker] { return _pending.load() > 0 || worker.pinned_pending.load() > 0 || _is_shutdown; });
+            _sleeping.fetch_sub(1);
+            if (_is_shutdown && _pending.load() == 0 && worker.pinned_pending.load() == 0)
+                break;
+        }
+    }
+
 };
 
-#endif 
\ No newline at end of file
+#endif
@@ -0,0 +1,133 @@
+#include "uniform.h"
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+
+namespace
+{
+	struct Registry
+	{
+		std::mutex mtx;
+		std::deque<UniformInfo> infos;
+		std::unordered_map<std::string, int> ids;
+		std::unordered_map<std::string, int> blocks;
+		size_t block_size = 0;
+	};
+
+	Registry& registry()
+	{
+		static Registry instance;
+		return instance;
+	}
+}
+
+int UniformRegistry::find_id(std::string_view name)
+{
+	auto& reg = registry();
+	std::lock_guard<std::mutex> lk(reg.mtx);
+	auto it = reg.ids.find(std::string(name));
+	return it != reg.ids.end() ? it->second : -1;
+}
+
+int UniformRegistry::find_block(std::string_view block_name)
+{
+	auto& reg = registry();
+	std::lock_guard<std::mutex> lk(reg.mtx);
+	auto it = reg.blocks.find(std::string(block_name));
+	return it != reg.blocks.end() ? it->second : -1;
+}
+
+size_t UniformRegistry::block_count()
+{
+	auto& reg = registry();
+	std::lock_guard<std::mutex> lk(reg.mtx);
+	return reg.blocks.size();
+}
+
+const UniformInfo& UniformRegistry::get_info(int id)
+{
+	auto& reg = registry();
+	std::lock_guard<std::mutex> lk(reg.mtx);
+	assert(id >= 0 && size_t(id) < reg.infos.size());
+	return reg.infos[id];
+}
+
+size_t UniformRegistry::count()
+{
+	auto& reg = registry();
+	std::lock_guard<std::mutex> lk(reg.mtx);
+	return reg.infos.size();
+}
+
+size_t UniformRegistry::block_size()
+{
+	auto& reg = registry();
+	std::lock_guard<std::mutex> lk(reg.mtx);
+	return reg.block_size;
+}
+
+int UniformRegistry::_register(UniformInfo&& info)
+{
+	auto& reg = registry();
+	std::lock_guard<std::mutex> lk(reg.mtx);
+	auto it = reg.ids.find(info.name);
+	if (it != reg.ids.end())
+		return it->second;
+
+	std::string block_name = info.name.substr(0, info.name.find('.'));
+	auto block = reg.blocks.emplace(block_name, int(reg.blocks.size())).first;
+	info.block = block->second;
+
+	info.offset = (reg.block_size + info.align - 1) / info.align * info.align;
+	reg.block_size = info.offset + info.size;
+
+	int id = reg.infos.size();
+	reg.ids[info.name] = id;
+	reg.infos.push_back(std::move(info));
+	return id;
+}
+
+
+UniformStorage::~UniformStorage()
+{
+	clear();
+}
+
+void UniformStorage::clear(int id)
+{
+	if (!is_set(id))
+		return;
+	auto& info = UniformRegistry::get_info(id);
+	info.destroy(_data() + info.offset);
+	_is_set[id] = false;
+	_block_versions[info.block] = ++_version;
+}
+
+void UniformStorage::clear()
+{
+	for (size_t id = 0; id < _is_set.size(); id++)
+		clear(id);
+}
+
+void UniformStorage::_grow()
+{
+	size_t count = UniformRegistry::count();
+	size_t size = UniformRegistry::block_size();
+	size_t elems = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+	std::unique_ptr<std::max_align_t[]> storage(new std::max_align_t[std::max<size_t>(elems, 1)]);
+
+	std::byte* data = reinterpret_cast<std::byte*>(storage.get());
+	for (size_t id = 0; id < _is_set.size(); id++)
+	{
+		if (!_is_set[id])
+			continue;
+		auto& info = UniformRegistry::get_info(id);
+		info.move_construct(data + info.offset, _data() + info.offset);
+		info.destroy(_data() + info.offset);
+	}
+
+	_storage = std::move(storage);
+	_is_set.resize(count, false);
+	_block_versions.resize(UniformRegistry::block_count(), 0);
+}
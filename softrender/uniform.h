@@ -0,0 +1,198 @@
+#ifndef UNIFORM_H
+#define UNIFORM_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+// uniforms are registered once per process by name and type, the handle holds the slot offset
+// so reading a uniform is a bounds check and a load from the device's flat uniform storage.
+// the part of the name before the first '.' selects the uniform block, e.g. "transform.model"
+// belongs to "transform", names without a '.' share the unnamed block
+template<class T>
+struct UniformHandle
+{
+	using value_type = T;
+
+	int id = -1;
+	int block = -1;
+	uint32_t offset = 0;
+
+	bool valid() const { return id >= 0; }
+};
+
+struct UniformInfo
+{
+	std::string name;
+	const void* type = nullptr;
+	size_t size = 0;
+	size_t align = 0;
+	uint32_t offset = 0;
+	int block = -1;
+
+	void (*copy_construct)(void* dst, const void* src) = nullptr;
+	void (*move_construct)(void* dst, void* src) = nullptr;
+	void (*copy_assign)(void* dst, const void* src) = nullptr;
+	void (*destroy)(void* ptr) = nullptr;
+};
+
+// unique address per type, RTTI is disabled in release builds
+template<class T>
+const void* uniform_type_id()
+{
+	static const char id = 0;
+	return &id;
+}
+
+template<class T, class = void>
+struct is_uniform_comparable : std::false_type { };
+
+template<class T>
+struct is_uniform_comparable<T, std::void_t<decltype(bool(std::declval<const T&>() == std::declval<const T&>()))>> : std::true_type { };
+
+class UniformRegistry
+{
+public:
+
+	// returns the existing handle if name is already registered with the same type, an invalid handle if it is
+	// registered with another one
+	template<class T>
+	static UniformHandle<T> register_uniform(std::string_view name)
+	{
+		static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned uniform type");
+
+		UniformInfo info;
+		info.name = name;
+		info.type = uniform_type_id<T>();
+		info.size = sizeof(T);
+		info.align = alignof(T);
+		info.copy_construct = [](void* dst, const void* src) { new (dst) T(*static_cast<const T*>(src)); };
+		info.move_construct = [](void* dst, void* src) { new (dst) T(std::move(*static_cast<T*>(src))); };
+		info.copy_assign	= [](void* dst, const void* src) { *static_cast<T*>(dst) = *static_cast<const T*>(src); };
+		info.destroy		= [](void* ptr) { static_cast<T*>(ptr)->~T(); };
+
+		int id = _register(std::move(info));
+		auto& registered = get_info(id);
+		assert(registered.type == uniform_type_id<T>() && "uniform registered with another type");
+		if (registered.type != uniform_type_id<T>())
+			return {};
+		return { id, registered.block, registered.offset };
+	}
+
+	// returns an invalid handle if no uniform with this name was registered or it has another type
+	template<class T>
+	static UniformHandle<T> find(std::string_view name)
+	{
+		int id = find_id(name);
+		if (id < 0)
+			return {};
+		auto& registered = get_info(id);
+		assert(registered.type == uniform_type_id<T>() && "uniform registered with another type");
+		if (registered.type != uniform_type_id<T>())
+			return {};
+		return { id, registered.block, registered.offset };
+	}
+
+	static int find_id(std::string_view name);
+
+	// returns -1 if no uniform of this block was registered
+	static int find_block(std::string_view block_name);
+
+	static size_t block_count();
+
+	static const UniformInfo& get_info(int id);
+
+	static size_t count();
+
+	static size_t block_size();
+
+private:
+
+	static int _register(UniformInfo&& info);
+
+};
+
+// flat storage for the values of every registered uniform, each slot remembers whether it was set
+// so shaders can still fall back to per-call defaults. every block has a version that changes
+// whenever one of its uniforms is set to a different value or cleared
+class UniformStorage
+{
+public:
+
+	UniformStorage() = default;
+
+	UniformStorage(const UniformStorage&) = delete;
+
+	UniformStorage& operator=(const UniformStorage&) = delete;
+
+	~UniformStorage();
+
+	// ignores invalid handles, e.g. of a name registered with another type
+	template<class T>
+	void set(UniformHandle<T> handle, const T& value)
+	{
+		if (!handle.valid())
+			return;
+		if (size_t(handle.id) >= _is_set.size())
+			_grow();
+		T* ptr = std::launder(reinterpret_cast<T*>(_data() + handle.offset));
+		if (_is_set[handle.id])
+		{
+			if constexpr (is_uniform_comparable<T>::value)
+				if (*ptr == value)
+					return;
+			*ptr = value;
+		}
+		else
+		{
+			new (ptr) T(value);
+			_is_set[handle.id] = true;
+		}
+		_block_versions[handle.block] = ++_version;
+	}
+
+	// returns nullptr if the uniform is not set on this block
+	template<class T>
+	const T* get(UniformHandle<T> handle) const
+	{
+		if (!is_set(handle.id))
+			return nullptr;
+		return std::launder(reinterpret_cast<const T*>(_data() + handle.offset));
+	}
+
+	bool is_set(int id) const
+	{
+		return id >= 0 && size_t(id) < _is_set.size() && _is_set[id];
+	}
+
+	void clear(int id);
+
+	void clear();
+
+	uint64_t block_version(int block) const
+	{
+		return block >= 0 && size_t(block) < _block_versions.size() ? _block_versions[block] : 0;
+	}
+
+private:
+
+	std::unique_ptr<std::max_align_t[]> _storage;
+	std::vector<uint8_t> _is_set;
+	std::vector<uint64_t> _block_versions;
+	uint64_t _version = 0;
+
+	std::byte* _data() const { return reinterpret_cast<std::byte*>(_storage.get()); }
+
+	// resizes to the current registry layout, set slots are moved over
+	void _grow();
+
+};
+
+#endif
@@ -1,19 +1,46 @@
 #include "unlit.h"
+#include "pipeline.h"
+#include "irshader.h"
+#include "fastmath.h"
 
+namespace Uniform
+{
+	static const auto transform_model			= UniformRegistry::register_uniform<Mat4>("transform.model");
+	static const auto transform_view			= UniformRegistry::register_uniform<Mat4>("transform.view");
+	static const auto transform_projection		= UniformRegistry::register_uniform<Mat4>("transform.projection");
+	static const auto gamma						= UniformRegistry::register_uniform<float>("gamma");
+	static const auto exposure					= UniformRegistry::register_uniform<float>("exposure");
+	static const auto material_color_ambient	= UniformRegistry::register_uniform<Color4>("material.color_ambient");
+	static const auto material_color_diffuse	= UniformRegistry::register_uniform<Color4>("material.color_diffuse");
+	static const auto material_texture_ambient0	= UniformRegistry::register_uniform<TextureSampler>("material.texture_ambient0");
+	static const auto material_texture_diffuse0	= UniformRegistry::register_uniform<TextureSampler>("material.texture_diffuse0");
+};
+
+// the transform the current thread runs with, either the shader's snapshot or the current instance's
 namespace Transform
 {
-	static thread_local Mat4 model;
-	static thread_local Mat4 view;
-	static thread_local Mat4 projection;
-	static thread_local Mat4 modelview;
+	static thread_local const Mat4* modelview;
+	static thread_local Mat4 instance_modelview;
 };
 
 void Unlit::VS::load_uniforms()
 {
-	Transform::model			= get_uniform<Mat4>("transform.model");
-	Transform::view				= get_uniform<Mat4>("transform.view");
-	Transform::projection		= get_uniform<Mat4>("transform.projection");
-	Transform::modelview		= Transform::model * Transform::view;
+	_projection			= get_uniform(Uniform::transform_projection);
+	_modelview			= get_uniform(Uniform::transform_model) * get_uniform(Uniform::transform_view);
+}
+
+void Unlit::VS::begin_batch()
+{
+	Transform::modelview = &_modelview;
+}
+
+void Unlit::VS::load_instance(const Instance& instance, size_t /*instance_id*/)
+{
+	Mat4 instance_model;
+	for (int i = 0; i < 4; i++)
+		instance_model[i] = instance.attributes[INST_model + i];
+	Transform::instance_modelview	= instance_model * _modelview;
+	Transform::modelview			= &Transform::instance_modelview;
 }
 
 void Unlit::VS::run(const VSIn& in, VSOut& out)
@@ -24,51 +51,150 @@ void Unlit::VS::run(const VSIn& in, VSOut& out)
 	auto& out_position	= out.out_varying[VARY_position];
 	auto& out_texcoord	= out.out_varying[VARY_texcoord];
 
-	out.position = vec4(in_position) * Transform::modelview * Transform::projection;
+	out.position = vec4(in_position) * *Transform::modelview * _projection;
 
-	out_position = vec4(in_position) * Transform::modelview;
+	out_position = vec4(in_position) * *Transform::modelview;
 	out_texcoord = vec4(in_texcoord);
 }
 
-static thread_local Vec3 camera_pos;
-static thread_local float gamma;
-static thread_local float exposure;
-namespace Material
+void Unlit::VS::run_batch(const VSInBatch& in, VSOutBatch& out)
 {
-	static Color3 color_ambient;
-	static Color3 color_diffuse;
-	static thread_local TextureSampler texture_ambient0;
-	static thread_local TextureSampler texture_diffuse0;
-};
+	Vec3x8 in_position	= vec3(in.attributes[ATTR_position]);
+	Vec2x8 in_texcoord	= vec2(in.attributes[ATTR_texcoord]);
+
+	auto& out_position	= out.out_varying[VARY_position];
+	auto& out_texcoord	= out.out_varying[VARY_texcoord];
+
+	out_position = vec4(in_position) * *Transform::modelview;
+	out.position = out_position * _projection;
+
+	out_texcoord = Vec4x8(in_texcoord.x, in_texcoord.y, 0.0f, 1.0f);
+}
 
 void Unlit::FS::load_uniforms()
 {
-	camera_pos = get_uniform<Vec3>("camera_pos");
-	gamma = get_uniform<float>("gamma", 2.2f);
-	exposure = get_uniform<float>("exposure", 1.0f);
-	Material::color_ambient		= vec3(get_uniform<Color4>("material.color_ambient", Color::BLACK));
-	Material::color_diffuse		= vec3(get_uniform<Color4>("material.color_diffuse", Color::BLACK));
-	Material::texture_ambient0	= get_uniform<TextureSampler>("material.texture_ambient0", TextureSampler(Color::BLACK));
-	Material::texture_diffuse0	= get_uniform<TextureSampler>("material.texture_diffuse0", TextureSampler(Color::BLACK));
+	_gamma				= get_uniform(Uniform::gamma, 2.2f);
+	_exposure			= get_uniform(Uniform::exposure, 1.0f);
+	_color_ambient		= vec3(get_uniform(Uniform::material_color_ambient, Color::BLACK));
+	_color_diffuse		= vec3(get_uniform(Uniform::material_color_diffuse, Color::BLACK));
+	_texture_ambient0	= get_uniform(Uniform::material_texture_ambient0, TextureSampler(Color::BLACK));
+	_texture_diffuse0	= get_uniform(Uniform::material_texture_diffuse0, TextureSampler(Color::BLACK));
 }
 
 void Unlit::FS::run(const FSIn& in, FSOut& out)
 {
 	Vec3 in_position = vec3(in.in_varying[VARY_position]);
 	Vec2 in_texcoord = vec2(in.in_varying[VARY_texcoord]);
+	Vec2 ddx_texcoord = vec2(in.ddx_varying[VARY_texcoord]);
+	Vec2 ddy_texcoord = vec2(in.ddy_varying[VARY_texcoord]);
 
-	Vec3 ambient_color = vec3(Material::texture_ambient0.sample(in_texcoord));
-	Vec3 diffuse_color = vec3(Material::texture_diffuse0.sample(in_texcoord));
+	Vec3 ambient_color = vec3(_texture_ambient0.sample(in_texcoord, ddx_texcoord, ddy_texcoord));
+	Vec3 diffuse_color = vec3(_texture_diffuse0.sample(in_texcoord, ddx_texcoord, ddy_texcoord));
 	
 	Vec3 color = vec3(Color::BLACK);
 	color = glm::max(color, ambient_color);
 	color = glm::max(color, diffuse_color);
-	color = glm::max(color, Material::color_ambient);
-	color = glm::max(color, Material::color_diffuse);
+	color = glm::max(color, _color_ambient);
+	color = glm::max(color, _color_diffuse);
+
+	if (_fast_math)
+	{
+		color = fastmath::pow(color, 1.0f / _gamma);
+		if (_exposure > 0.0f)
+			color = vec3(1.0f) - fastmath::exp(-color * _exposure);
+	}
+	else
+	{
+		color = glm::pow(color, vec3(1.0f / _gamma));
+		if (_exposure > 0.0f)
+			color = vec3(1.0f) - glm::exp(-color * _exposure);
+	}
+
+	out.color = vec4(color, 1.0f);
+}
 
-	color = glm::pow(color, vec3(1.0f / gamma));
-	if (exposure > 0.0f)
-		color = vec3(1.0f) - glm::exp(-color * exposure);
+void Unlit::FS::run_packet(const FSInPacket& in, FSOutPacket& out)
+{
+	Vec2x8 in_texcoord = vec2(in.in_varying[VARY_texcoord]);
+	Vec2x8 ddx_texcoord = vec2(in.ddx_varying[VARY_texcoord]);
+	Vec2x8 ddy_texcoord = vec2(in.ddy_varying[VARY_texcoord]);
+
+	Vec3x8 ambient_color = vec3(_texture_ambient0.sample(in_texcoord, ddx_texcoord, ddy_texcoord, in.active));
+	Vec3x8 diffuse_color = vec3(_texture_diffuse0.sample(in_texcoord, ddx_texcoord, ddy_texcoord, in.active));
+
+	Vec3x8 color = Vec3x8(vec3(Color::BLACK));
+	color = max(color, ambient_color);
+	color = max(color, diffuse_color);
+	color = max(color, Vec3x8(_color_ambient));
+	color = max(color, Vec3x8(_color_diffuse));
+
+	if (_fast_math)
+	{
+		color = fastmath::pow(color, 1.0f / _gamma);
+		if (_exposure > 0.0f)
+			color = Vec3x8(1.0f) - fastmath::exp(-color * _exposure);
+	}
+	else
+	{
+		color = pow(color, 1.0f / _gamma);
+		if (_exposure > 0.0f)
+			color = Vec3x8(1.0f) - exp(-color * _exposure);
+	}
 
 	out.color = vec4(color, 1.0f);
+	out.discarded = Mask8(0.0f);
+}
+
+void Unlit::specialized_draw(RenderDevice& device, FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count)
+{
+	device.draw<VS, FS, VARY_NUM>(framebuffer, vertex_array, instance_buffer, instance_count);
+}
+
+ShaderProgram Unlit::ir_program()
+{
+	using namespace ShaderIR;
+
+	static const ShaderProgram program = []
+	{
+		Builder vs(ATTR_NUM, VARY_NUM + 1);
+		{
+			Value3 in_position	= vec3(vs.input(ATTR_position));
+			Value2 in_texcoord	= vec2(vs.input(ATTR_texcoord));
+
+			Value4 out_position = vec4(in_position) * vs.matrix4(Builtin::MODELVIEW);
+			vs.output(0, out_position * vs.matrix4(Builtin::PROJECTION));
+			vs.output(1 + VARY_position, out_position);
+			vs.output(1 + VARY_texcoord, { { in_texcoord[0], in_texcoord[1], vs.constant(0.0f), vs.constant(1.0f) } });
+		}
+
+		Builder fs(VARY_NUM, 1);
+		{
+			Value2 in_texcoord = vec2(fs.input(VARY_texcoord));
+
+			Value gamma				= fs.uniform(Uniform::gamma, 2.2f);
+			Value exposure			= fs.uniform(Uniform::exposure, 1.0f);
+			Value3 color_ambient	= vec3(fs.uniform(Uniform::material_color_ambient, Color::BLACK));
+			Value3 color_diffuse	= vec3(fs.uniform(Uniform::material_color_diffuse, Color::BLACK));
+			int texture_ambient0	= fs.sampler(Uniform::material_texture_ambient0, TextureSampler(Color::BLACK));
+			int texture_diffuse0	= fs.sampler(Uniform::material_texture_diffuse0, TextureSampler(Color::BLACK));
+
+			Value3 ambient_color = vec3(fs.sample(texture_ambient0, in_texcoord));
+			Value3 diffuse_color = vec3(fs.sample(texture_diffuse0, in_texcoord));
+
+			Value3 color = fs.constant(vec3(Color::BLACK));
+			color = max(color, ambient_color);
+			color = max(color, diffuse_color);
+			color = max(color, color_ambient);
+			color = max(color, color_diffuse);
+
+			color = pow(color, 1.0f / gamma);
+			color = select(exposure > 0.0f, 1.0f - exp(-color * exposure), color);
+
+			fs.output(0, vec4(color, 1.0f));
+		}
+
+		return make_ir_program(vs.build(), fs.build());
+	}();
+
+	return program;
 }
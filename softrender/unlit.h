@@ -19,30 +19,89 @@ namespace Unlit
 		VARY_texcoord,
 		VARY_NUM
 	};
+	enum
+	{
+		INST_model,		// instance model matrix, one column per attribute
+		INST_NUM = INST_model + 4
+	};
 
-	class VS : public VertexShader
+	class VS final : public VertexShader
 	{
 	public:
 
+		std::shared_ptr<VertexShader> clone() const override { return std::make_shared<VS>(*this); }
+
 		void load_uniforms() override;
+
+		void begin_batch() override;
+
+		void load_instance(const Instance& instance, size_t instance_id) override;
 		
 		void run(const VSIn& in, VSOut& out) override;
 
+		int batch_attribute_num() const override { return ATTR_NUM; }
+
+		void run_batch(const VSInBatch& in, VSOutBatch& out) override;
+
+	private:
+
+		Mat4 _projection;
+		Mat4 _modelview;
+
 	};
 
-	class FS : public FragmentShader
+	class FS final : public FragmentShader
 	{
 	public:
 
+		// fast_math shades with the approximations of fastmath.h
+		explicit FS(bool fast_math = false) : _fast_math(fast_math) {}
+
+		std::shared_ptr<FragmentShader> clone() const override { return std::make_shared<FS>(*this); }
+
 		void load_uniforms() override;
 		
 		void run(const FSIn& in, FSOut& out) override;
+
+		bool supports_packet() const override { return true; }
+
+		bool may_discard() const override { return false; }
+
+		// texture lod
+		bool uses_derivatives() const override { return true; }
+
+		void run_packet(const FSInPacket& in, FSOutPacket& out) override;
+
+	private:
+
+		bool _fast_math;
+		float _gamma = 2.2f;
+		float _exposure = 1.0f;
+		Color3 _color_ambient;
+		Color3 _color_diffuse;
+		TextureSampler _texture_ambient0;
+		TextureSampler _texture_diffuse0;
 	};
 
+	// the same shading written in the shader IR, compiled to native code by the first set_shader_program
+	ShaderProgram ir_program();
+
+	// the pipeline instantiated for VS and FS, defined in unlit.cpp
+	void specialized_draw(RenderDevice& device, FrameBuffer& framebuffer, const VertexArray& vertex_array, const InstanceBuffer* instance_buffer, size_t instance_count);
+
 	inline ShaderProgram program = {
 		std::make_shared<VS>(),
 		std::make_shared<FS>(),
-		VARY_NUM
+		VARY_NUM,
+		&specialized_draw
+	};
+
+	// program with fast math shading
+	inline ShaderProgram fast_program = {
+		std::make_shared<VS>(),
+		std::make_shared<FS>(true),
+		VARY_NUM,
+		&specialized_draw
 	};
 }
 
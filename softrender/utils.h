@@ -2,13 +2,14 @@
 #define UTILS_H
 
 #include <chrono>
+#include <cstddef>
 
 inline static double get_time()
 {
 	return std::chrono::high_resolution_clock::now().time_since_epoch().count() * 1e-9;
 }
 
-inline static int get_batch_size(int total, int batch_count, int i)
+inline static size_t get_batch_size(size_t total, size_t batch_count, size_t i)
 {
 	return total / batch_count + (i < total % batch_count ? 1 : 0);
 }
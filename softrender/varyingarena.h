@@ -0,0 +1,72 @@
+#ifndef VARYING_ARENA_H
+#define VARYING_ARENA_H
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include "maths.h"
+
+// records of stride Vec4 each, the stride is set from the bound program so vertices and fragments
+// only carry the varyings it declares. storage is kept across clears and grows geometrically,
+// records reused after a clear keep their old contents
+class VaryingArena
+{
+public:
+
+	explicit VaryingArena(int stride = 0) : _stride(stride) {}
+
+	// drops every record and changes the record size
+	void reset(int stride)
+	{
+		_stride = stride;
+		_size = 0;
+	}
+
+	void clear() { _size = 0; }
+
+	int stride() const { return _stride; }
+
+	size_t size() const { return _size; }
+
+	bool empty() const { return _size == 0; }
+
+	Vec4* operator[](size_t i)			   { return _data.data() + i * _stride; }
+	const Vec4* operator[](size_t i) const { return _data.data() + i * _stride; }
+
+	// appends a record and returns its index, pointers to other records are invalidated if the storage grows
+	size_t push_back()
+	{
+		resize(_size + 1);
+		return _size - 1;
+	}
+
+	void resize(size_t size)
+	{
+		size_t need = size * _stride;
+		if (need > _data.size())
+			_data.resize(std::max(need, _data.size() * 2));
+		_size = size;
+	}
+
+	// copies every record of other to [at, at + other.size())
+	void copy_from(const VaryingArena& other, size_t at)
+	{
+		assert(other._stride == _stride && at + other._size <= _size);
+		std::copy(other[0], other[other._size], (*this)[at]);
+	}
+
+	void shrink_to_fit()
+	{
+		_data.resize(_size * _stride);
+		_data.shrink_to_fit();
+	}
+
+private:
+
+	std::vector<Vec4> _data;
+	int _stride;
+	size_t _size = 0;
+
+};
+
+#endif
@@ -0,0 +1,453 @@
+#include "virtualtexture.h"
+#include "fastmath.h"
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+namespace
+{
+	// page file header: magic, version, width, height, level count and page size as int32, followed by
+	// every page in page id order, texels row-major inside a page. pages past a level's edge repeat the edge
+	constexpr int32_t PAGE_FILE_MAGIC = 0x54565253;		// "SRVT"
+	constexpr int32_t PAGE_FILE_VERSION = 1;
+	constexpr size_t PAGE_FILE_HEADER_BYTES = 6 * sizeof(int32_t);
+
+	// slots beyond the mip tail a page pool keeps however small the budget
+	constexpr int MIN_STREAMED_SLOTS = 16;
+
+	// coordinate x of a level size texels wide after the warp mode, -1 for the border
+	inline int wrap(int x, int size, Texture::WarpMode mode)
+	{
+		if (x >= 0 && x < size)
+			return x;
+		if (mode == Texture::WarpMode::REPEAT)
+		{
+			x %= size;
+			return x < 0 ? x + size : x;
+		}
+		else if (mode == Texture::WarpMode::MIRRORED_REPEAT)
+		{
+			x %= size * 2;
+			x = x < 0 ? x + size * 2 : x;
+			return x >= size ? size * 2 - x - 1 : x;
+		}
+		else if (mode == Texture::WarpMode::CLAMP_TO_EDGE)
+			return clamp(x, 0, size - 1);
+		else
+			return -1;
+	}
+}
+
+VirtualTexture::VirtualTexture(std::string_view path, size_t memory_budget)
+{
+	open(path, memory_budget);
+}
+
+VirtualTexture::~VirtualTexture()
+{
+	close();
+}
+
+bool VirtualTexture::build(const Texture& texture, std::string_view path)
+{
+	if (texture.mip_level_num() == 0)
+		return false;
+
+	const Texture* source = &texture;
+	Texture mipmapped;
+	if (texture.mip_level_num() == 1)
+	{
+		mipmapped = texture;
+		mipmapped.generate_mipmaps();
+		source = &mipmapped;
+	}
+
+	std::ofstream file(std::string(path), std::ios::binary);
+	int32_t header[] = { PAGE_FILE_MAGIC, PAGE_FILE_VERSION, source->width(), source->height(), source->mip_level_num(), PAGE_SIZE };
+	file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	std::vector<unsigned char> page(PAGE_BYTES);
+	for (int level = 0; level < source->mip_level_num(); level++)
+	{
+		int w = source->width(level);
+		int h = source->height(level);
+		for (int y0 = 0; y0 < h; y0 += PAGE_SIZE)
+			for (int x0 = 0; x0 < w; x0 += PAGE_SIZE)
+			{
+				for (int y = 0; y < PAGE_SIZE; y++)
+					for (int x = 0; x < PAGE_SIZE; x++)
+					{
+						Color4 color = source->get_color(std::min(x0 + x, w - 1), std::min(y0 + y, h - 1), level);
+						for (int c = 0; c < 4; c++)
+							page[(size_t(y) * PAGE_SIZE + x) * 4 + c] = (unsigned char)clamp<int>(int(color[c] * 255.0f + 0.5f), 0, 255);
+					}
+				file.write(reinterpret_cast<const char*>(page.data()), page.size());
+			}
+	}
+
+	if (!file)
+	{
+		std::cerr << "failed to write virtual texture: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool VirtualTexture::open(std::string_view path, size_t memory_budget)
+{
+	close();
+
+	std::ifstream file(std::string(path), std::ios::binary);
+	int32_t header[6] = {};
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+	if (!file || header[0] != PAGE_FILE_MAGIC || header[1] != PAGE_FILE_VERSION || header[5] != PAGE_SIZE)
+	{
+		std::cerr << "failed to open virtual texture: " << path << std::endl;
+		return false;
+	}
+
+	int page_num = 0;
+	_first_tail_level = -1;
+	for (int i = 0, w = header[2], h = header[3]; i < header[4]; i++)
+	{
+		int pages_x = (w + PAGE_SIZE - 1) / PAGE_SIZE;
+		int pages_y = (h + PAGE_SIZE - 1) / PAGE_SIZE;
+		_levels.push_back(Level{ w, h, pages_x, pages_y, page_num });
+		page_num += pages_x * pages_y;
+		if (_first_tail_level < 0 && pages_x == 1 && pages_y == 1)
+			_first_tail_level = i;
+		w = std::max(w / 2, 1);
+		h = std::max(h / 2, 1);
+	}
+	if (_first_tail_level < 0)
+	{
+		_levels.clear();
+		std::cerr << "virtual texture has no mip tail: " << path << std::endl;
+		return false;
+	}
+
+	int tail_page_num = int(_levels.size()) - _first_tail_level;
+	int slot_num = std::max(int(memory_budget / PAGE_BYTES), tail_page_num + MIN_STREAMED_SLOTS);
+	_page_table.assign(page_num, NO_SLOT);
+	_slot_pages.assign(slot_num, -1);
+	_page_pool.resize(size_t(slot_num) * PAGE_BYTES);
+	_slot_frames.reset(new std::atomic<uint32_t>[slot_num]());
+	_requested.reset(new std::atomic<bool>[page_num]());
+
+	// the mip tail is read now and never evicted, so every footprint has a resident fallback
+	for (int i = _first_tail_level; i < int(_levels.size()); i++)
+	{
+		int slot = _pinned_slot_num++;
+		int page = _levels[i].first_page;
+		if (!_read_page(file, page, &_page_pool[size_t(slot) * PAGE_BYTES]))
+		{
+			close();
+			std::cerr << "failed to read virtual texture: " << path << std::endl;
+			return false;
+		}
+		_page_table[page] = slot;
+		_slot_pages[slot] = page;
+	}
+	for (int slot = slot_num - 1; slot >= _pinned_slot_num; slot--)
+		_free_slots.push_back(slot);
+
+	_path = path;
+	_frame = 1;
+	_is_shutdown = false;
+	_streamer = std::thread(&VirtualTexture::_stream_loop, this);
+	return true;
+}
+
+void VirtualTexture::close()
+{
+	if (_streamer.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lk(_stream_mtx);
+			_is_shutdown = true;
+		}
+		_stream_cond.notify_all();
+		_streamer.join();
+	}
+
+	_path.clear();
+	_levels.clear();
+	_page_table.clear();
+	_slot_pages.clear();
+	_page_pool.clear();
+	_pinned_slot_num = 0;
+	_free_slots.clear();
+	_slot_frames.reset();
+	_requested.reset();
+	_requests.clear();
+	_stream_queue.clear();
+	_loaded_pages.clear();
+}
+
+bool VirtualTexture::empty() const
+{
+	return _levels.empty();
+}
+
+bool VirtualTexture::_read_page(std::istream& file, int page, unsigned char* texels) const
+{
+	file.clear();
+	file.seekg(PAGE_FILE_HEADER_BYTES + size_t(page) * PAGE_BYTES);
+	file.read(reinterpret_cast<char*>(texels), PAGE_BYTES);
+	return bool(file);
+}
+
+void VirtualTexture::_stream_loop()
+{
+	std::ifstream file(_path, std::ios::binary);
+	std::unique_lock<std::mutex> lk(_stream_mtx);
+	while (true)
+	{
+		if (_is_shutdown)
+		{
+			break;
+		}
+		else if (!_stream_queue.empty())
+		{
+			LoadedPage loaded{ _stream_queue.front(), std::vector<unsigned char>(PAGE_BYTES) };
+			_stream_queue.pop_front();
+			lk.unlock();
+			// a page that fails to read stays requested and sampled from coarser levels
+			bool read = _read_page(file, loaded.page, loaded.texels.data());
+			lk.lock();
+			if (read)
+				_loaded_pages.push_back(std::move(loaded));
+		}
+		else
+		{
+			_stream_cond.wait(lk);
+		}
+	}
+}
+
+void VirtualTexture::update()
+{
+	if (_levels.empty())
+		return;
+
+	std::vector<LoadedPage> loaded;
+	{
+		std::lock_guard<std::mutex> lk(_stream_mtx);
+		loaded.swap(_loaded_pages);
+	}
+
+	// pages not sampled in the frame that just ended can make room, least recently sampled last
+	std::vector<int> evictable;
+	if (loaded.size() > _free_slots.size())
+	{
+		for (int slot = _pinned_slot_num; slot < int(_slot_pages.size()); slot++)
+			if (_slot_pages[slot] >= 0 && _slot_frames[slot].load(std::memory_order_relaxed) < _frame)
+				evictable.push_back(slot);
+		std::sort(evictable.begin(), evictable.end(), [this](int a, int b) {
+			return _slot_frames[a].load(std::memory_order_relaxed) > _slot_frames[b].load(std::memory_order_relaxed);
+		});
+	}
+
+	for (auto& page : loaded)
+	{
+		// pages that find no room are requested again when they are sampled next
+		_requested[page.page].store(false, std::memory_order_relaxed);
+		int slot = NO_SLOT;
+		if (!_free_slots.empty())
+		{
+			slot = _free_slots.back();
+			_free_slots.pop_back();
+		}
+		else if (!evictable.empty())
+		{
+			slot = evictable.back();
+			evictable.pop_back();
+			_page_table[_slot_pages[slot]] = NO_SLOT;
+		}
+		if (slot == NO_SLOT)
+			continue;
+
+		std::copy(page.texels.begin(), page.texels.end(), &_page_pool[size_t(slot) * PAGE_BYTES]);
+		_page_table[page.page] = slot;
+		_slot_pages[slot] = page.page;
+		_slot_frames[slot].store(_frame, std::memory_order_relaxed);
+	}
+
+	std::vector<int> requests;
+	{
+		std::lock_guard<std::mutex> lk(_request_mtx);
+		requests.swap(_requests);
+	}
+	if (!requests.empty())
+	{
+		// coarse pages first, they improve the blurriest fallbacks. no more pages are queued than the pool
+		// can take, the rest are requested again when they are sampled next
+		std::sort(requests.begin(), requests.end(), std::greater<int>());
+		std::lock_guard<std::mutex> lk(_stream_mtx);
+		size_t capacity = _slot_pages.size() - _pinned_slot_num;
+		for (int page : requests)
+		{
+			if (_stream_queue.size() < capacity)
+				_stream_queue.push_back(page);
+			else
+				_requested[page].store(false, std::memory_order_relaxed);
+		}
+		_stream_cond.notify_one();
+	}
+
+	_frame++;
+}
+
+int VirtualTexture::width(int level) const
+{
+	return level < int(_levels.size()) ? _levels[level].width : 0;
+}
+
+int VirtualTexture::height(int level) const
+{
+	return level < int(_levels.size()) ? _levels[level].height : 0;
+}
+
+int VirtualTexture::mip_level_num() const
+{
+	return int(_levels.size());
+}
+
+int VirtualTexture::page_count() const
+{
+	return int(_page_table.size());
+}
+
+int VirtualTexture::resident_page_count() const
+{
+	return int(_slot_pages.size() - _free_slots.size());
+}
+
+size_t VirtualTexture::memory_usage() const
+{
+	return _page_pool.size();
+}
+
+void VirtualTexture::_request(const Level& level, int x, int y) const
+{
+	int page = _page(level, x, y);
+	if (_requested[page].load(std::memory_order_relaxed) || _requested[page].exchange(true))
+		return;
+	std::lock_guard<std::mutex> lk(_request_mtx);
+	_requests.push_back(page);
+}
+
+Color4 VirtualTexture::sample(float x, float y, float lod) const
+{
+	return sample(x, y, lod, sampleMode, warpMode);
+}
+
+Color4 VirtualTexture::sample(float x, float y, float lod, Texture::SampleMode mode, Texture::WarpMode warp) const
+{
+	if (_levels.empty())
+		return Color::TRANSPARENT;
+
+	float l = clamp(lod, 0.0f, float(_levels.size() - 1));
+	if (mode == Texture::SampleMode::TRILINEAR)
+	{
+		int l0 = int(l);
+		Color4 color = _sample_level(x, y, l0, mode, warp);
+		if (l > float(l0))
+			color = lerp(color, _sample_level(x, y, l0 + 1, mode, warp), l - float(l0));
+		return color;
+	}
+	return _sample_level(x, y, int(l + 0.5f), mode, warp);
+}
+
+Vec4x8 VirtualTexture::sample(const Vec2x8& texcoord, const Mask8& active, const Float8& lod) const
+{
+	return sample(texcoord, active, lod, sampleMode, warpMode);
+}
+
+Vec4x8 VirtualTexture::sample(const Vec2x8& texcoord, const Mask8& active, const Float8& lod, Texture::SampleMode mode, Texture::WarpMode warp) const
+{
+	if (_levels.empty())
+		return Vec4x8(Color::TRANSPARENT);
+
+	int mask = movemask(active);
+	alignas(32) float u[SIMD_WIDTH], v[SIMD_WIDTH], l[SIMD_WIDTH];
+	alignas(32) float lanes[4][SIMD_WIDTH] = {};
+	texcoord.x.store(u);
+	texcoord.y.store(v);
+	lod.store(l);
+	for (int lane = 0; lane < SIMD_WIDTH; lane++)
+	{
+		if (!(mask >> lane & 1))
+			continue;
+		Color4 color = sample(u[lane], v[lane], l[lane], mode, warp);
+		for (int c = 0; c < 4; c++)
+			lanes[c][lane] = color[c];
+	}
+	return Vec4x8(Float8::load(lanes[0]), Float8::load(lanes[1]), Float8::load(lanes[2]), Float8::load(lanes[3]));
+}
+
+Color4 VirtualTexture::_sample_level(float u, float v, int level, Texture::SampleMode mode, Texture::WarpMode warp) const
+{
+	int taps = mode == Texture::SampleMode::NEAREST ? 1 : 2;
+	for (int i = level; ; i++)
+	{
+		const Level& lv = _levels[i];
+		float x = u * lv.width;
+		float y = v * lv.height;
+		float fx = taps == 1 ? std::floor(x) : std::floor(x - 0.5f);
+		float fy = taps == 1 ? std::floor(y) : std::floor(y - 0.5f);
+		int xs[2], ys[2];
+		for (int k = 0; k < taps; k++)
+		{
+			xs[k] = wrap(int(fx) + k, lv.width, warp);
+			ys[k] = wrap(int(fy) + k, lv.height, warp);
+		}
+
+		// the mip tail is always resident and ends the search
+		bool resident = true;
+		for (int j = 0; j < taps; j++)
+			for (int k = 0; k < taps; k++)
+				if (xs[k] >= 0 && ys[j] >= 0 && _slot(lv, xs[k], ys[j]) == NO_SLOT)
+				{
+					resident = false;
+					if (i == level)
+						_request(lv, xs[k], ys[j]);
+				}
+		if (!resident)
+			continue;
+
+		auto texel = [&](int x, int y) {
+			if (x < 0 || y < 0)
+				return Color4(0.0f);
+			int slot = _slot(lv, x, y);
+			if (_slot_frames[slot].load(std::memory_order_relaxed) != _frame)
+				_slot_frames[slot].store(_frame, std::memory_order_relaxed);
+			const unsigned char* c = &_page_pool[size_t(slot) * PAGE_BYTES + (size_t(y % PAGE_SIZE) * PAGE_SIZE + x % PAGE_SIZE) * 4];
+			return Color4(c[0], c[1], c[2], c[3]) * (1.0f / 255.0f);
+		};
+		if (taps == 1)
+			return texel(xs[0], ys[0]);
+		float tx = x - 0.5f - fx;
+		float ty = y - 0.5f - fy;
+		return lerp(lerp(texel(xs[0], ys[0]), texel(xs[1], ys[0]), tx), lerp(texel(xs[0], ys[1]), texel(xs[1], ys[1]), tx), ty);
+	}
+}
+
+float VirtualTexture::lod(const Vec2& ddx, const Vec2& ddy) const
+{
+	Vec2 size = Vec2(float(width()), float(height()));
+	Vec2 dx = ddx * size;
+	Vec2 dy = ddy * size;
+	return 0.5f * std::log2(std::max(glm::dot(dx, dx), glm::dot(dy, dy)));
+}
+
+Float8 VirtualTexture::lod(const Vec2x8& ddx, const Vec2x8& ddy) const
+{
+	Float8 w = float(width());
+	Float8 h = float(height());
+	Float8 dx = ddx.x * ddx.x * w * w + ddx.y * ddx.y * h * h;
+	Float8 dy = ddy.x * ddy.x * w * w + ddy.y * ddy.y * h * h;
+	return fastmath::log2(max(max(dx, dy), Float8(1e-8f))) * 0.5f;
+}
@@ -0,0 +1,157 @@
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "texture.h"
+
+// a texture whose mip chain lives in a page file and is only partly resident. every level is split into
+// PAGE_SIZE x PAGE_SIZE pages of RGBA8, a page table maps the resident ones to slots of a page pool sized
+// by a memory budget. levels that fit in one page (the mip tail) are pinned, the rest is streamed in.
+//
+// sampling never waits for I/O: a footprint whose pages are missing is filtered on the finest coarser level
+// that is resident, and the missing pages are recorded. update() hands the recorded pages to a streaming
+// thread that reads them from the page file, and commits the pages read since the last call, evicting the
+// least recently sampled ones when the pool is full
+class VirtualTexture
+{
+public:
+
+	static constexpr int PAGE_SIZE = 128;
+	static constexpr size_t PAGE_BYTES = size_t(PAGE_SIZE) * PAGE_SIZE * 4;
+
+	// NEAREST, BILINEAR or TRILINEAR, BICUBIC is filtered as BILINEAR
+	Texture::SampleMode sampleMode = Texture::SampleMode::TRILINEAR;
+	Texture::WarpMode warpMode = Texture::WarpMode::REPEAT;
+
+
+	VirtualTexture() = default;
+
+	VirtualTexture(std::string_view path, size_t memory_budget);
+
+	~VirtualTexture();
+
+	VirtualTexture(const VirtualTexture&) = delete;
+	VirtualTexture& operator=(const VirtualTexture&) = delete;
+
+	// writes the mip chain of texture to a page file, the chain is generated first when the texture has a
+	// single level. texels are stored as RGBA8
+	static bool build(const Texture& texture, std::string_view path);
+
+	// reads the header and the mip tail of a page file and starts streaming. the page pool holds
+	// memory_budget bytes of pages but never less than the mip tail and a few pages more
+	bool open(std::string_view path, size_t memory_budget);
+
+	void close();
+
+	bool empty() const;
+
+	// commits the pages streamed in since the last call and requests the pages sampling missed. not thread
+	// safe against sampling, call between frames
+	void update();
+
+	int width(int level = 0) const;
+
+	int height(int level = 0) const;
+
+	int mip_level_num() const;
+
+	int page_count() const;
+
+	int resident_page_count() const;
+
+	// bytes of the page pool
+	size_t memory_usage() const;
+
+
+	Color4 sample(float x, float y, float lod = 0.0f) const;
+
+	Vec4x8 sample(const Vec2x8& texcoord, const Mask8& active, const Float8& lod = Float8(0.0f)) const;
+
+	// same as above with the filter and warp mode given in place of sampleMode and warpMode
+	Color4 sample(float x, float y, float lod, Texture::SampleMode mode, Texture::WarpMode warp) const;
+
+	Vec4x8 sample(const Vec2x8& texcoord, const Mask8& active, const Float8& lod, Texture::SampleMode mode, Texture::WarpMode warp) const;
+
+	// level of detail of a footprint given the texcoord derivatives along screen x and y
+	float lod(const Vec2& ddx, const Vec2& ddy) const;
+
+	Float8 lod(const Vec2x8& ddx, const Vec2x8& ddy) const;
+
+private:
+
+	struct Level
+	{
+		int width;
+		int height;
+		int pages_x;
+		int pages_y;
+		int first_page;		// id of the level's first page, pages are numbered level by level, row-major
+	};
+
+	// a page read by the streaming thread, waiting for update() to commit it
+	struct LoadedPage
+	{
+		int page;
+		std::vector<unsigned char> texels;
+	};
+
+	static constexpr int NO_SLOT = -1;
+
+	std::string _path;
+	std::vector<Level> _levels;
+	int _first_tail_level = 0;
+
+	// slot of every page or NO_SLOT, only written by update()
+	std::vector<int> _page_table;
+	// page held by every slot or -1
+	std::vector<int> _slot_pages;
+	std::vector<unsigned char> _page_pool;
+	int _pinned_slot_num = 0;
+	std::vector<int> _free_slots;
+
+	// feedback from sampling: the frame a slot was last sampled in, for eviction, and a flag per page so
+	// a missing page is recorded once until it is streamed in
+	uint32_t _frame = 1;
+	mutable std::unique_ptr<std::atomic<uint32_t>[]> _slot_frames;
+	mutable std::unique_ptr<std::atomic<bool>[]> _requested;
+	mutable std::mutex _request_mtx;
+	mutable std::vector<int> _requests;
+
+	std::thread _streamer;
+	std::mutex _stream_mtx;
+	std::condition_variable _stream_cond;
+	std::deque<int> _stream_queue;
+	std::vector<LoadedPage> _loaded_pages;
+	bool _is_shutdown = false;
+
+	void _stream_loop();
+
+	bool _read_page(std::istream& file, int page, unsigned char* texels) const;
+
+	static int _page(const Level& level, int x, int y)
+	{
+		return level.first_page + (y / PAGE_SIZE) * level.pages_x + x / PAGE_SIZE;
+	}
+
+	// slot of the page of level at texel (x, y), NO_SLOT when it is missing
+	int _slot(const Level& level, int x, int y) const
+	{
+		return _page_table[_page(level, x, y)];
+	}
+
+	// records the page of level at texel (x, y) for update() to stream in
+	void _request(const Level& level, int x, int y) const;
+
+	Color4 _sample_level(float x, float y, int level, Texture::SampleMode mode, Texture::WarpMode warp) const;
+
+};
+
+#endif